@@ -135,6 +135,58 @@ uint32_t map_seq(int x, int min, int max, uint32_t colors[], int len) {
 #define SIZE 64
 
 
+//
+// random
+//
+
+// xorshift32, fixed cost per draw instead of the 32-bit divisions inside
+// random(); mirrors Rng::Generator in the controller-128 firmware
+struct Generator {
+  uint32_t state = 0x2545F491UL;
+
+  uint32_t getSeed() {
+    return state;
+  }
+
+  void setSeed(uint32_t seed) {
+    state = seed ? seed : 0x2545F491UL;
+  }
+
+  uint32_t next() {
+    uint32_t x = state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    state = x;
+    return x;
+  }
+
+  // uniform value in [0, n)
+  uint16_t below(uint16_t n) {
+    return ((uint32_t) (uint16_t) next() * n) >> 16;
+  }
+
+  boolean bit() {
+    return (next() >> 31) != 0;
+  }
+};
+
+// arp draws, reseeded on reset so random arps replay exactly until reset
+// is held for a new seed
+Generator arpRandom;
+uint32_t arpSeed = arpRandom.getSeed();
+
+// how long reset was held is a random number of microseconds
+void reseed_arps() {
+  Generator roll;
+  roll.setSeed(arpSeed ^ micros());
+  arpSeed = roll.next();
+}
+
+// randomize button draws, kept apart so they never shift the arp sequence
+Generator editRandom;
+
+
 //
 // tracks
 //
@@ -241,15 +293,18 @@ struct Track {
         break;
 
       case Arp::RANDOM:
-        next = random(length);
-        while (next == current) {
-          next = random(length);
+        // draw from the other length - 1 steps, then skip over current
+        if (length > 1) {
+          next = arpRandom.below(length - 1);
+          if (next >= current) {
+            next++;
+          }
+          current = next;
         }
-        current = next;
         break;
 
       case Arp::RANDOM_WALK:
-        if (random(2) == 1) {
+        if (arpRandom.bit()) {
           current++;
           if (current >= length) {
             current = (length - 1);
@@ -264,7 +319,7 @@ struct Track {
         break;
 
       case Arp::WRAPPING_RANDOM_WALK:
-        if (random(2) == 1) {
+        if (arpRandom.bit()) {
           current++;
           if (current >= length) {
             current = start;
@@ -279,7 +334,7 @@ struct Track {
         break;
 
       case Arp::WRAPPING_RANDOM_WALK_MOSTLY_RIGHT:
-        if (random(100) < 60) {
+        if (arpRandom.below(100) < 60) {
           current++;
           if (current >= length) {
             current = start;
@@ -487,7 +542,7 @@ struct Track {
       else {
         likelihood = 4;
       }
-      if (random(100) < likelihood) {
+      if (editRandom.below(100) < likelihood) {
         set(i, true);
       }
     }
@@ -560,6 +615,9 @@ Track tracks[7];
 #define RESET_BUTTON 1
 #define CLEAR_BUTTON 2
 
+// holding reset this long rolls a new arp seed
+#define RESEED_HOLD_MS 1000
+
 // unused
 #define DECREASE_START_BUTTON -1
 #define INCREASE_START_BUTTON -2
@@ -670,7 +728,10 @@ void clock_released() {
   previousClock = true;
 }
 
+unsigned long reset_press_time = 0;
+
 void reset_pressed() {
+  reset_press_time = millis();
   trellis.setPixelColor(RESET_BUTTON, 0, pressed);
   trellis.show();
 }
@@ -683,6 +744,10 @@ void reset_released() {
     Track* t = &tracks[i];
     t->reset();
   }
+  if (millis() - reset_press_time >= RESEED_HOLD_MS) {
+    reseed_arps();
+  }
+  arpRandom.setSeed(arpSeed);
 }
 
 void clear_pressed() {
@@ -1327,5 +1392,6 @@ void loop() {
       Track* t = &tracks[i];
       t->reset();
     }
+    arpRandom.setSeed(arpSeed);
   }
 }
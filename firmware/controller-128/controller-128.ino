@@ -23,28 +23,37 @@
 
 #include "hardware.h"
 #include "controller.h"
+#include "link.h"
+#include "telemetry.h"
+#include "recorder.h"
+#include "scheduler.h"
+
+// Indexed by Protocol::TaskId. Periods and budgets are in us. Budgets are
+// estimates, `c128link stats` shows the overruns.
+Scheduler::Task tasks[Protocol::TASK_COUNT] = {
+  Scheduler::Task(Hardware::tickClock,      Scheduler::CRITICAL,  2000, 300),
+  Scheduler::Task(Hardware::pollTrellis,    Scheduler::NORMAL,    5000, 200),
+  Scheduler::Task(Hardware::pollEncoders,   Scheduler::NORMAL,   10000, 500),
+  Scheduler::Task(Controller::tick,         Scheduler::NORMAL,   20000, 100),
+  Scheduler::Task(Controller::tickDisplay,  Scheduler::IDLE,     50000, 500),
+  Scheduler::Task(Link::poll,               Scheduler::IDLE,     20000, 300),
+  Scheduler::Task(Controller::tickBank,     Scheduler::IDLE,     10000, 200)
+};
 
 void setup() {
+#if TELEMETRY_ENABLED
+  Telemetry::init();
+#endif
+#if RECORDER_ENABLED
+  Recorder::init();
+#endif
   Hardware::init();
   Controller::init();
-
-  Serial.begin(9600);
+  Link::init();
+  Scheduler::init(tasks, Protocol::TASK_COUNT);
 }
 
 void loop() {
-  // uint64_t start = millis();
-  Hardware::tickClock();
-  // uint64_t middle = millis();
-  Controller::tick();
-  // uint64_t end = millis();
-
-  // Hardware::lcd.setCursor(0, 0);
-  // Hardware::lcd.print("HW: ");
-  // Hardware::lcd.print(middle - start);
-  // Hardware::lcd.print("   ");
-
-  // Hardware::lcd.setCursor(0, 1);
-  // Hardware::lcd.print("SW: ");
-  // Hardware::lcd.print(end - middle);
-  // Hardware::lcd.print("   ");
+  LOOP_TIMED();
+  Scheduler::run();
 }
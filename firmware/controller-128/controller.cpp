@@ -22,137 +22,386 @@
 */
 
 #include "controller.h"
-
-#define PANEL_WIDTH 16
-#define PANEL_HEIGHT 8
-
-#define CLOCK_X 0
-#define CLOCK_MODE_X 1
-#define SETTINGS_X 2
-#define CLEAR_X 3
-#define SONG_X 4
-#define PATTERNS_START_X 5
-#define DIRECTION_X 12
-#define PLAY_SONG_X 13
-#define PLAY_PATTERN_X 14
-#define RESET_X 15
-
-#define PATTERN_COUNT 7
+#if CONTROLLER_ENGINE == ENGINE_PATTERNS
+#include <avr/eeprom.h>
+#include "rng.h"
+#include "euclid.h"
+#include "journal.h"
+#include "midi.h"
+#include "telemetry.h"
+#include "recorder.h"
+#include "scheduler.h"
+#include "geometry.h"
 
 #define MIN_PATTERN_LEN 2
 #define DEFAULT_PATTERN_LEN 16
 #define MAX_PATTERN_LEN 32
 
-#define TEMPO_STEP 2
+// Runs in the song, each playing its pattern up to MAX_SONG_REPEATS times,
+// so up to 512 patterns in all. Repeats are stored in a nibble.
+#define MAX_SONG_RUNS 32
+#define MAX_SONG_REPEATS 16
+
+// Tempo encoder detents in hundredths of a BPM, the fine step is while
+// the right encoder is held
+#define TEMPO_STEP (2 * TEMPO_SCALE)
+#define TEMPO_FINE_STEP 10
 #define MAX_TEMPO_TAPS 4
 
+// A tap interval more than mean / TAP_OUTLIER_DIVISOR from the mean of the
+// ones before it is a missed or extra tap
+#define TAP_OUTLIER_DIVISOR 4
+
+// Recent step start times kept for quantizing recorded hits
+#define STEP_HISTORY_LEN 4
+
+// Probability is 0-15 of 15, compared against a random byte
+#define MAX_PROBABILITY 15
+#define PROBABILITY_LIMIT(p) ((uint16_t) (p) * 17 + ((p) == MAX_PROBABILITY))
+// Narrow grids set probability two levels per pad
+#define PROBABILITY_PER_PAD (16 / GRID_WIDTH)
+
+// Loop counter wraps at the LCM of the condition loop lengths
+#define CONDITION_LOOP_PERIOD 12
+
 // Millis
 #define POPUP_PERSIST_TIME 1500
 
+// Image bytes read or compared per run of the bank task, at about 1 us each
+#define BANK_CHUNK 16
+// Edits are written back once the pads and encoders have been left alone
+// this long (ms), rather than after every step toggled
+#define BANK_SETTLE_MS 2000
+
 namespace Controller {
-  struct Pattern {
-    uint32_t blankColor, activeColor;
+  using namespace Geometry;
+
+  // Low nibble of Pattern::conditions, decides which loops a conditional step fires on
+  enum TrigCondition : uint8_t {
+    COND_ALWAYS = 0,
+    COND_FILL = 1,
+    COND_NOT_FILL = 2,
+    COND_FIRST_RATIO = 3 // COND_FIRST_RATIO + i uses CONDITION_RATIOS[i]
+  };
+
+  // {A - 1, B}: fire on the Ath of every B loops
+  static const uint8_t CONDITION_RATIOS[][2] = {
+    {0, 2}, {1, 2},
+    {0, 3}, {1, 3}, {2, 3},
+    {0, 4}, {1, 4}, {2, 4}, {3, 4}
+  };
+
+  // After the ratios: the channel is a looping shift register, like a Turing
+  // machine module. Each loop its steps rotate one place and, with the
+  // channel's probability, one random step flips. Its chance steps always pass
+  // the condition.
+  #define COND_TURING (COND_FIRST_RATIO + sizeof(CONDITION_RATIOS) / sizeof(CONDITION_RATIOS[0]))
+  #define CONDITION_COUNT (COND_TURING + 1)
+
+  template<typename T>
+  void reverseSteps(T *from, T *to) {
+    while (from + 1 < to) {
+      T tmp = *from;
+      *from++ = *--to;
+      *to = tmp;
+    }
+  }
 
-    uint8_t state[MAX_PATTERN_LEN];
+  // Rotates the first len steps of data left by amount, in place
+  template<typename T>
+  void rotateSteps(T *data, uint8_t len, uint8_t amount) {
+    reverseSteps(data, data + amount);
+    reverseSteps(data + amount, data + len);
+    reverseSteps(data, data + len);
+  }
+
+  struct Pattern {
+    RowMask state[MAX_PATTERN_LEN];
     uint8_t length = DEFAULT_PATTERN_LEN;
 
+    // Same layout as state: a set bit means that step only fires if the
+    // channel's probability and condition pass
+    RowMask chance[MAX_PATTERN_LEN];
+    // Per channel (indexed by row): probability << 4 | TrigCondition
+    uint8_t conditions[GRID_HEIGHT];
+
     uint8_t scroll = 0;
 
-    Pattern(uint32_t blank, uint32_t active):
-        blankColor(blank), activeColor(active) {
+    // Rotation is stored as an offset applied on read: logical step i is
+    // at index(i). Always less than length.
+    uint8_t offset = 0;
+
+    // Bank pattern held, -1: none yet
+    int8_t bankIndex = -1;
+    uint16_t lastUse = 0; // Value of useClock when last played or viewed
+
+    Pattern() {
       memset(state, 0, sizeof(state));
+      memset(chance, 0, sizeof(chance));
+      memset(conditions, MAX_PROBABILITY << 4 | COND_ALWAYS, sizeof(conditions));
     }
 
     void copyFrom(Pattern *from) {
-      memcpy(state, from->state, MAX_PATTERN_LEN);
+      memcpy(state, from->state, sizeof(state));
+      memcpy(chance, from->chance, sizeof(chance));
+      memcpy(conditions, from->conditions, sizeof(conditions));
       length = from->length;
       scroll = from->scroll;
+      offset = from->offset;
+    }
+
+    // Byte i of the pattern's Protocol::PatternImage. Row masks are little
+    // endian on the 32U4, as in the image.
+    uint8_t &imageByte(uint8_t i) {
+      using namespace Protocol;
+      if (i == PATTERN_LENGTH)
+        return length;
+      if (i == PATTERN_OFFSET)
+        return offset;
+      if (i < PATTERN_CHANCE)
+        return ((uint8_t *) state)[i - PATTERN_STATE];
+      if (i < PATTERN_CONDITIONS)
+        return ((uint8_t *) chance)[i - PATTERN_CHANCE];
+      return conditions[i - PATTERN_CONDITIONS];
     }
 
-    void rotateLeft() {
-      uint8_t first = state[0];
-      memmove(&state[0], &state[1], length - 1);
-      state[length - 1] = first;
+    inline uint8_t index(uint8_t step) const {
+      uint8_t i = step + offset;
+      return i >= length ? i - length : i;
+    }
+
+    // Inverse of index(), i must be less than length
+    inline uint8_t stepOf(uint8_t i) const {
+      return i >= offset ? i - offset : i + length - offset;
+    }
+
+    // Positive amounts move steps to the right
+    void rotate(int16_t amount) {
+      int16_t shifted = ((int16_t) offset - amount) % length;
+      offset = shifted < 0 ? shifted + length : shifted;
+    }
+
+    inline void rotateLeft() { rotate(-1); }
+    inline void rotateRight() { rotate(1); }
+
+    // Moves the data so that offset is 0, needed before the length changes
+    void normalize() {
+      if (!offset)
+        return;
+      rotateSteps(state, length, offset);
+      rotateSteps(chance, length, offset);
+      offset = 0;
     }
 
-    void rotateRight() {
-      uint8_t last = state[length - 1];
-      memmove(&state[1], &state[0], length - 1);
-      state[0] = last;
+    // Undoes normalize(), moving the data back to how it was stored at offset `to`
+    void denormalize(uint8_t to) {
+      rotateSteps(state, length, length - to);
+      rotateSteps(chance, length, length - to);
+      offset = to;
     }
   };
 
+  // The song is a chain of runs, each one pattern played a number of times
+  // over. The song view shows the expanded timeline, a column per repeat,
+  // worked out from the runs as it's drawn rather than stored.
   struct SongPattern {
-    // High bits first, then low
-    uint8_t state[MAX_PATTERN_LEN >> 1];
-    uint8_t length = DEFAULT_PATTERN_LEN;
+    // Pattern << 4 | repeats - 1
+    uint8_t runs[MAX_SONG_RUNS];
+    uint8_t length = DEFAULT_PATTERN_LEN; // Runs
+    uint16_t total = DEFAULT_PATTERN_LEN; // Columns, kept up to date by recount()
 
-    uint8_t scroll = 0;
+    uint16_t scroll = 0;
+
+    // Same as Pattern::offset, in runs
+    uint8_t offset = 0;
 
     SongPattern() {
-      memset(state, 0, sizeof(state));
+      memset(runs, 0, sizeof(runs));
     }
 
-    uint8_t get(uint8_t index) {
-      if (index & 1)
-        return state[index / 2] & 0x0F;
-      else
-        return state[index / 2] >> 4;
+    inline uint8_t index(uint8_t run) const {
+      uint8_t i = run + offset;
+      return i >= length ? i - length : i;
     }
 
-    void set(uint8_t index, uint8_t val) {
-      if (index & 1)
-        state[index / 2] = (state[index / 2] & 0xF0) | val;
-      else
-        state[index / 2] = (state[index / 2] & 0x0F) | (val << 4);
+    inline uint8_t runOf(uint8_t i) const {
+      return i >= offset ? i - offset : i + length - offset;
     }
 
-    void rotateLeft() {
-      uint8_t first = get(0);
-      for (uint8_t i = 0; i < length - 1; i++) {
-        set(i, get(i + 1));
-      }
-      set(length - 1, first);
+    inline uint8_t getPattern(uint8_t run) const {
+      return runs[index(run)] >> 4;
+    }
+
+    inline uint8_t getRepeats(uint8_t run) const {
+      return (runs[index(run)] & 0x0F) + 1;
+    }
+
+    void setPattern(uint8_t run, uint8_t pattern) {
+      uint8_t i = index(run);
+      runs[i] = (runs[i] & 0x0F) | (pattern << 4);
+    }
+
+    void setRepeats(uint8_t run, uint8_t repeats) {
+      uint8_t i = index(run);
+      runs[i] = (runs[i] & 0xF0) | (repeats - 1);
+    }
+
+    void recount() {
+      total = 0;
+      for (uint8_t i = 0; i < length; i++)
+        total += (runs[i] & 0x0F) + 1;
     }
 
-    void rotateRight() {
-      uint8_t last = get(length - 1);
-      for (uint8_t i = length - 1; i > 0; i--) {
-        set(i, get(i - 1));
+    // The run column x falls in, and the column that run starts at. Walks
+    // at most MAX_SONG_RUNS runs, past the end is the last run.
+    uint8_t find(uint16_t x, uint16_t &start) const {
+      uint8_t run = 0;
+      start = 0;
+      while (run + 1 < length) {
+        uint8_t repeats = getRepeats(run);
+        if (x < start + repeats)
+          break;
+        start += repeats;
+        run++;
       }
-      set(0, last);
+      return run;
+    }
+
+    uint16_t startOf(uint8_t run) const {
+      uint16_t start = 0;
+      for (uint8_t i = 0; i < run; i++)
+        start += getRepeats(i);
+      return start;
+    }
+
+    void rotate(int16_t amount) {
+      int16_t shifted = ((int16_t) offset - amount) % length;
+      offset = shifted < 0 ? shifted + length : shifted;
+    }
+
+    inline void rotateLeft() { rotate(-1); }
+    inline void rotateRight() { rotate(1); }
+
+    void normalize() {
+      if (!offset)
+        return;
+      rotateSteps(runs, length, offset);
+      offset = 0;
+    }
+
+    void denormalize(uint8_t to) {
+      rotateSteps(runs, length, length - to);
+      offset = to;
     }
   };
 
   // --- MODEL ---
-  Pattern patterns[PATTERN_COUNT] {
-    Pattern(COLOR(3, 0, 0), COLOR(30,  0,  0)),
-    Pattern(COLOR(3, 2, 0), COLOR(30, 15,  0)),
-    Pattern(COLOR(3, 3, 0), COLOR(30, 30,  0)),
-    Pattern(COLOR(0, 3, 0), COLOR( 0, 30,  0)),
-    Pattern(COLOR(0, 3, 3), COLOR( 0, 30, 30)),
-    Pattern(COLOR(0, 0, 3), COLOR( 0,  0, 30)),
-    Pattern(COLOR(2, 0, 3), COLOR(15,  0, 30))
-  };
+  // Patterns live in the EEPROM bank, and a buffer per pattern pad holds the
+  // ones used most recently. One more buffer than that, so a bulk edit of
+  // the playing pattern can be built off to the side and swapped in by the
+  // clock path.
+  using Protocol::BANK_PATTERNS;
+  Pattern patternBuffers[PATTERN_COUNT + 1];
+  Pattern* patterns[BANK_PATTERNS]; // Null: only in the bank for now
+  Pattern* spareBuffer = &patternBuffers[PATTERN_COUNT];
+  Pattern* retiredPattern = nullptr; // Old copy of an edited playing pattern, played until the next step
+  bool retireAtWrap = false; // Keep playing the old copy until the pattern wraps instead
   SongPattern songPattern;
 
   Pattern* playingPattern = nullptr; // Null: not playing
+  uint8_t playingPatternIdx = 0;
+  // Published by the UI and taken by the clock path when the playing pattern wraps, -1: none
+  volatile int8_t cuedPattern = -1;
+  volatile int16_t cuedSongPosition = -1; // Song column
   bool playedSongPreviously = false;
   int8_t cursorX;
-  int8_t songCursorX = -1; // -1: not playing song
+  int16_t songCursorX = -1; // Song column, -1: not playing song
+  uint8_t songRun; // Run and repeat of songCursorX, so moving on is O(1)
+  uint8_t songRepeat;
+  bool songWaiting = false; // songCursorX's pattern wasn't in RAM at the wrap, the last one loops until it is
   int8_t direction = 1;
 
-  uint64_t prevTapTime;
-  uint64_t tapDurations[MAX_TEMPO_TAPS];
-  int8_t tapCount = -1;
+  // Tap times are when the pad was pressed, from the Trellis event, not when
+  // the press got processed
+  uint32_t prevTapTime; // Last tap that counted
+  uint32_t lastTapTime; // Last tap, counted or not
+  uint32_t tapIntervals[MAX_TEMPO_TAPS]; // us, oldest first
+  int8_t tapCount = -1; // Taps that counted, -1: not tapping
+  bool tapOutlier = false; // The last tap didn't count
 
-  uint8_t currentOutputs = 0x00;
-  uint8_t gateMask = 0x00; // If bit is set, the channel is a gate, otherwise it's a trigger
+  RowMask currentOutputs = 0x00;
+  RowMask gateMask = 0x00; // If bit is set, the channel is a gate, otherwise it's a trigger
 
   bool clockOn = false;
+  bool stepPlayed = false; // The step under the playhead went out, not yet when play starts
+
+  Rng::Generator rng;
+  uint32_t playSeed = RNG_DEFAULT_SEED; // Restored on reset so chance replays exactly until the next play
+  bool seedHeld = false; // Play keeps playSeed instead of drawing a new one
+  uint8_t loopCount = 0;
+  RowMask loopChannels = 0; // Channels whose condition passes on the current loop
+  RowMask fillChannels = 0;
+  RowMask notFillChannels = 0;
+  RowMask turingChannels = 0; // Channels set to COND_TURING in the playing pattern
+  RowMask turingCarry = 0; // The loop's first step as it was before it shifted
+  bool turingPrimed = false; // turingCarry was taken this loop
+
+  struct StepTime {
+    uint32_t time; // micros() when the step's clock edge happened
+    uint8_t patternIdx; // Slot rather than buffer, bulk edits swap buffers
+    uint8_t step;
+  };
+  StepTime stepHistory[STEP_HISTORY_LEN];
+  uint8_t stepHistoryIdx = 0; // Next slot to write
+  uint8_t stepHistoryCount = 0;
+  bool recording = false;
+
+  // Undo journal targets are pattern indices, or the song
+  #define SONG_TARGET BANK_PATTERNS
+  static_assert(SONG_TARGET <= Journal::TARGET_MASK, "Journal targets don't fit");
+
+  enum EditKind : uint8_t {
+    EDIT_STEP,      // index: step, stored run for the song
+    EDIT_CHANCE,    // index: step
+    EDIT_CONDITION, // index: channel
+    EDIT_OFFSET,
+    EDIT_LENGTH,
+    EDIT_NORMALIZE, // mask: the offset before normalizing, not an xor
+    EDIT_SNAPSHOT   // Swaps the pattern's image with undoSnapshot
+  };
+
+  Journal::Ring journal;
+
+  // A gesture that rewrites more of a pattern than the ring holds keeps the
+  // image from before it here instead, see beginPatternGesture()
+  uint8_t undoSnapshot[Protocol::PATTERN_IMAGE_SIZE];
+  #define UNDO_RAM_BYTES (Journal::RAM_BYTES + sizeof(undoSnapshot))
+
+  // Song image loaded over serial while playing, applied when the playing pattern wraps
+  uint8_t pendingSong[Protocol::SONG_IMAGE_SIZE];
+  bool songLoadPending = false;
+
+  // The pattern pads show bankPage * PATTERN_COUNT and on
+  uint8_t bankPage = 0;
+  uint16_t useClock = 0; // Counts pattern uses, for finding the least recently used
+  // Waiting to be paged in, -1: none
+  int8_t wantedView = -1; // Pad pressed for a pattern not in RAM yet
+  int8_t wantedLoad = -1; // Serial load answered BUSY until it's in
+  // A buffer taken for another pattern: its old pattern's edits are
+  // written back, then the new one is read in
+  Pattern* bankBuffer = nullptr; // Null: no transfer
+  bool bankWriting;
+  uint8_t bankTarget;
+  uint8_t bankByte; // Next image byte to compare or read
+  // Where writing back edits to the patterns in RAM is up to
+  uint8_t persistBuffer = 0;
+  uint8_t persistByte = 0;
+  uint32_t lastInputTime = 0;
 
   // --- VIEW ---
-  #define MAX_COLUMN_UPDATES_PER_LOOP 2
+  // Roughly how long one column takes, updatePixels() keeps going while
+  // the scheduler pass has this much left
+  #define COLUMN_UPDATE_US 100
 
   static const uint32_t CURSOR        = COLOR(15, 15, 15);
   static const uint32_t OUT_OF_BOUNDS = COLOR( 0,  0,  0);
@@ -168,89 +417,171 @@ namespace Controller {
 
   static const uint32_t CLOCK_MODE_SOFTWARE = COLOR(30, 30, 0);
   static const uint32_t CLOCK_MODE_HARDWARE = COLOR(30, 15, 0);
+  static const uint32_t CLOCK_MODE_MIDI = COLOR(0, 15, 30);
 
   static const uint32_t SETTINGS_TRIGGER = COLOR(8, 8, 0);
   static const uint32_t SETTINGS_GATE = COLOR(0, 8, 0);
 
+  // Blank, then active, for each pattern pad. Every bank page has the same.
+  static const uint32_t PATTERN_COLORS[PATTERN_COUNT][2] = {
+#if PATTERN_COUNT == 7
+    { COLOR(3, 0, 0), COLOR(30,  0,  0) },
+    { COLOR(3, 2, 0), COLOR(30, 15,  0) },
+    { COLOR(3, 3, 0), COLOR(30, 30,  0) },
+    { COLOR(0, 3, 0), COLOR( 0, 30,  0) },
+    { COLOR(0, 3, 3), COLOR( 0, 30, 30) },
+    { COLOR(0, 0, 3), COLOR( 0,  0, 30) },
+    { COLOR(2, 0, 3), COLOR(15,  0, 30) }
+#else
+    { COLOR(3, 0, 0), COLOR(30,  0,  0) },
+    { COLOR(0, 3, 0), COLOR( 0, 30,  0) },
+    { COLOR(0, 0, 3), COLOR( 0,  0, 30) }
+#endif
+  };
+
+  enum SettingsPage : uint8_t {
+    SETTINGS_GATES,
+    SETTINGS_PROBABILITY,
+    SETTINGS_CONDITION,
+    SETTINGS_PAGE_COUNT
+  };
+
   Pattern* viewedPattern = nullptr; // If null, song pattern
   uint8_t viewedPatternIdx = 0;
-  uint16_t dirtyColumns = 0xFFFF;
+  ColumnMask dirtyColumns = ALL_COLUMNS;
   bool rightEncoderPressed = false;
+  bool rightEncoderUsed = false; // Turned or combined since pressed, so the release is not a click
   uint64_t popupTime = 0; // 0 = no popup
   bool settingsMenuOpen = false;
+  uint8_t settingsPage = SETTINGS_GATES;
   uint8_t heldPatterns = 0;
   bool songHeld = false;
+  ColumnMask layeredControls = 0; // Control pads pressed on the layer, so release matches
+  int8_t heldStepX = -1; // Pattern step held down for Euclidean fills, -1: none
+  uint8_t heldStepY;
+  uint8_t heldStepGesture; // Journal gesture of its press
+  int8_t euclidPulses = -1; // -1: not started for the held step
+  // Range between the held step and a second one on its row, -1: none
+  int8_t rangeFirst = -1;
+  uint8_t rangeCount;
+  RowMask rangeRows; // The row's channel, or every channel
+  int8_t heldSongRun = -1; // Song run held down for setting its repeats, -1: none
+
+  inline uint32_t blankColor(uint8_t index) { return PATTERN_COLORS[index % PATTERN_COUNT][0]; }
+  inline uint32_t activeColor(uint8_t index) { return PATTERN_COLORS[index % PATTERN_COUNT][1]; }
+
+  // Bank pattern under a pattern pad, or a pattern row of the song view
+  inline uint8_t padPattern(uint8_t pad) {
+    return bankPage * PATTERN_COUNT + pad;
+  }
+
+  // -1: the pattern is on another bank page
+  inline int8_t patternPad(uint8_t index) {
+    uint8_t pad = index - bankPage * PATTERN_COUNT;
+    return pad < PATTERN_COUNT ? pad : -1;
+  }
 
   #define PIXEL_TO_PATTERN(x) ((x) + getCurrentScroll())
   #define PATTERN_TO_PIXEL(x) ((x) - getCurrentScroll())
 
-  uint8_t getCurrentScroll() {
+  uint16_t getCurrentScroll() {
     return viewedPattern ? viewedPattern->scroll : songPattern.scroll;
   }
 
-  void redrawColumn(uint8_t patternX) {
-    int8_t pixelX = PATTERN_TO_PIXEL(patternX);
-    if (pixelX >= 0 || pixelX < PANEL_WIDTH) {
-      dirtyColumns |= (1 << pixelX);
+  void redrawColumn(uint16_t patternX) {
+    int16_t pixelX = PATTERN_TO_PIXEL(patternX);
+    if (pixelX >= 0 && pixelX < GRID_WIDTH) {
+      dirtyColumns |= columnBit(pixelX);
     }
   }
 
-  inline void updatePatternColumn(uint8_t pixelX) {
+  // The column views fill colors for rows 1 and down, indexed by row
+  inline void fillColumn(uint32_t *colors, uint32_t color) {
+    for (uint8_t y = 1; y < GRID_HEIGHT; y++)
+      colors[y] = color;
+  }
+
+  inline void updatePatternColumn(uint8_t pixelX, uint32_t *colors) {
     uint8_t patternX = PIXEL_TO_PATTERN(pixelX);
     if (patternX >= viewedPattern->length) {
-      for (uint8_t y = 1; y < PANEL_HEIGHT; y++)
-        Hardware::setPixel(pixelX, y, OUT_OF_BOUNDS);
+      fillColumn(colors, OUT_OF_BOUNDS);
       return;
     }
 
     uint32_t unset = (viewedPattern == playingPattern && patternX == cursorX)
-      ? CURSOR : viewedPattern->blankColor;
-    uint8_t state = viewedPattern->state[patternX];
-
-    for (uint8_t y = 1; y < PANEL_HEIGHT; y++)
-      Hardware::setPixel(pixelX, y, state & (1 << y) ? viewedPattern->activeColor : unset);
+      ? CURSOR : blankColor(viewedPatternIdx);
+    uint32_t active = activeColor(viewedPatternIdx);
+    uint32_t conditional = (active >> 1) & 0x7F7F7F; // Half brightness
+    uint8_t i = viewedPattern->index(patternX);
+    RowMask state = viewedPattern->state[i];
+    RowMask chance = viewedPattern->chance[i];
+
+    for (uint8_t y = 1; y < GRID_HEIGHT; y++) {
+      RowMask bit = rowBit(y);
+      colors[y] = state & bit ? (chance & bit ? conditional : active) : unset;
+    }
   }
 
-  uint8_t getSongState(uint8_t col) {
-    uint8_t idx = col >> 1;
-    if (col & 1)
-      return songPattern.state[idx] & 0xF;
-    else
-      return songPattern.state[idx] >> 4;
+  // Pattern played at a column of the song, and whether the column is a
+  // repeat rather than the start of its run
+  inline uint8_t getSongState(uint16_t col, bool &repeat) {
+    uint16_t start;
+    uint8_t run = songPattern.find(col, start);
+    repeat = col != start;
+    return songPattern.getPattern(run);
   }
 
-  inline void updateSongColumn(uint8_t pixelX) {
-    uint8_t patternX = PIXEL_TO_PATTERN(pixelX);
-    if (patternX >= songPattern.length) {
-      for (uint8_t y = 1; y < PANEL_HEIGHT; y++)
-        Hardware::setPixel(pixelX, y, OUT_OF_BOUNDS);
+  inline void updateSongColumn(uint8_t pixelX, uint32_t *colors) {
+    uint16_t patternX = PIXEL_TO_PATTERN(pixelX);
+    if (patternX >= songPattern.total) {
+      fillColumn(colors, OUT_OF_BOUNDS);
       return;
     }
 
     // Will only be true when playing, since patternX can never be -1
-    bool isCursor = patternX == songCursorX;
+    bool isCursor = (int16_t) patternX == songCursorX;
 
-    uint8_t patternIdx = getSongState(patternX);
+    bool repeat;
+    int8_t pad = patternPad(getSongState(patternX, repeat));
 
-    for (uint8_t y = 1; y < PANEL_HEIGHT; y++) {
-      Pattern* rowPattern = &patterns[y - 1];
+    for (uint8_t y = 1; y < GRID_HEIGHT; y++) {
+      uint8_t rowPattern = padPattern(y - 1);
+      if (y > PATTERN_COUNT || rowPattern >= BANK_PATTERNS) {
+        colors[y] = OUT_OF_BOUNDS;
+        continue;
+      }
 
       uint32_t color;
-      if (y - 1 == patternIdx)
-        color = rowPattern->activeColor;
+      if (y - 1 == pad)
+        color = repeat ? (activeColor(rowPattern) >> 1) & 0x7F7F7F : activeColor(rowPattern);
       else if (isCursor)
         color = CURSOR;
       else
-        color = rowPattern->blankColor;
+        color = blankColor(rowPattern);
 
-      Hardware::setPixel(pixelX, y, color);
+      colors[y] = color;
     }
   }
 
-  inline void updateSettingsColumn(uint8_t pixelX) {
-    for (uint8_t y = 1; y < PANEL_HEIGHT; y++) {
-      uint32_t color = gateMask & (1 << y) ? SETTINGS_GATE : SETTINGS_TRIGGER;
-      Hardware::setPixel(pixelX, y, color);
+  inline void updateSettingsColumn(uint8_t pixelX, uint32_t *colors) {
+    if (settingsPage == SETTINGS_GATES) {
+      for (uint8_t y = 1; y < GRID_HEIGHT; y++)
+        colors[y] = gateMask & rowBit(y) ? SETTINGS_GATE : SETTINGS_TRIGGER;
+      return;
+    }
+
+    // Chance pages edit the viewed pattern, one row per channel
+    if (!viewedPattern || (settingsPage == SETTINGS_CONDITION && pixelX >= CONDITION_COUNT)) {
+      fillColumn(colors, OUT_OF_BOUNDS);
+      return;
+    }
+
+    for (uint8_t y = 1; y < GRID_HEIGHT; y++) {
+      uint8_t condition = viewedPattern->conditions[y];
+      bool lit = settingsPage == SETTINGS_PROBABILITY
+        ? pixelX * PROBABILITY_PER_PAD <= (condition >> 4)
+        : pixelX == (condition & 0x0F);
+      colors[y] = lit ? activeColor(viewedPatternIdx) : blankColor(viewedPatternIdx);
     }
   }
 
@@ -259,19 +590,23 @@ namespace Controller {
       return;
 
     uint8_t updates = 0;
-    for (uint8_t x = 0; x < PANEL_WIDTH; x++) {
-      uint16_t cond = dirtyColumns & (1 << x);
+    uint32_t colors[GRID_HEIGHT];
+    for (uint8_t x = 0; x < GRID_WIDTH; x++) {
+      ColumnMask cond = dirtyColumns & columnBit(x);
       if (!cond) continue;
       dirtyColumns ^= cond; // Clear this bit
 
       if (settingsMenuOpen)
-        updateSettingsColumn(x);
+        updateSettingsColumn(x, colors);
       else if (viewedPattern)
-        updatePatternColumn(x);
+        updatePatternColumn(x, colors);
       else
-        updateSongColumn(x);
+        updateSongColumn(x, colors);
+      Hardware::setColumn(x, 1, colors);
 
-      if (++updates >= MAX_COLUMN_UPDATES_PER_LOOP)
+      // At least one column a pass, so the grid always catches up
+      updates++;
+      if (Scheduler::left() < COLUMN_UPDATE_US)
         break;
     }
 
@@ -279,70 +614,300 @@ namespace Controller {
       Hardware::updateTrellis();
   }
 
-  void drawInitialControlRow() {
-    Hardware::setPixel(CLOCK_MODE_X, 0, CLOCK_MODE_SOFTWARE);
-    Hardware::setPixel(DIRECTION_X, 0, CLOCK_FORWARD);
+  // Controls only reachable on the layer have nowhere to show their state
+  inline void setControlPixel(uint8_t control, uint32_t color) {
+    if (controlX(control) >= 0)
+      Hardware::setPixel(controlX(control), 0, color);
+  }
 
-    for (uint8_t x = 0; x < PATTERN_COUNT; x++) {
-      Hardware::setPixel(x + PATTERNS_START_X, 0, patterns[x].blankColor);
+  // Does nothing for a pattern on another bank page
+  inline void setPatternPixel(uint8_t index, uint32_t color) {
+    int8_t pad = patternPad(index);
+    if (pad >= 0)
+      setControlPixel(CONTROL_PATTERN + pad, color);
+  }
+
+  void drawPatternPads() {
+    for (uint8_t i = 0; i < PATTERN_COUNT; i++) {
+      uint8_t index = padPattern(i);
+      uint32_t color = index >= BANK_PATTERNS ? OUT_OF_BOUNDS
+        : viewedPattern && index == viewedPatternIdx ? activeColor(index)
+        : blankColor(index);
+      setControlPixel(CONTROL_PATTERN + i, color);
     }
   }
 
+  void drawInitialControlRow() {
+    setControlPixel(CONTROL_CLOCK_MODE, CLOCK_MODE_SOFTWARE);
+    setControlPixel(CONTROL_DIRECTION, CLOCK_FORWARD);
+    drawPatternPads();
+  }
+
+  Pattern *usePattern(uint8_t index);
+
+  // A pattern that isn't in RAM yet is shown once it's been paged in
   void switchToPattern(uint8_t index) {
-    if (!viewedPattern)
-      Hardware::setPixel(SONG_X, 0, SONG_BLANK);
-    else {
-      if (viewedPatternIdx == index)
-        return;
-      
-      Hardware::setPixel(PATTERNS_START_X + viewedPatternIdx, 0, viewedPattern->blankColor);
+    if (viewedPattern && viewedPatternIdx == index)
+      return;
+    Pattern *pattern = usePattern(index);
+    if (!pattern) {
+      wantedView = index;
+      return;
     }
+    wantedView = -1;
+
+    if (!viewedPattern)
+      setControlPixel(CONTROL_SONG, SONG_BLANK);
+    else
+      setPatternPixel(viewedPatternIdx, blankColor(viewedPatternIdx));
 
-    viewedPattern = &patterns[index];
+    viewedPattern = pattern;
     viewedPatternIdx = index;
-    dirtyColumns = 0xFFFF;
+    dirtyColumns = ALL_COLUMNS;
 
-    Hardware::setPixel(PATTERNS_START_X + index, 0, viewedPattern->activeColor);
+    setPatternPixel(index, activeColor(index));
     if (!playingPattern)
-      Hardware::setPixel(PLAY_PATTERN_X, 0, viewedPattern->activeColor);
+      setControlPixel(CONTROL_PLAY_PATTERN, activeColor(index));
   }
 
   void switchToSong() {
+    wantedView = -1;
     if (!viewedPattern) return;
-    Hardware::setPixel(PATTERNS_START_X + viewedPatternIdx, 0, viewedPattern->blankColor);
+    setPatternPixel(viewedPatternIdx, blankColor(viewedPatternIdx));
 
     if (!playingPattern)
-      Hardware::setPixel(PLAY_PATTERN_X, 0, SONG_ACTIVE);
+      setControlPixel(CONTROL_PLAY_PATTERN, SONG_ACTIVE);
 
     viewedPattern = nullptr;
-    dirtyColumns = 0xFFFF;
-    Hardware::setPixel(SONG_X, 0, SONG_ACTIVE);
+    dirtyColumns = ALL_COLUMNS;
+    setControlPixel(CONTROL_SONG, SONG_ACTIVE);
   }
 
   inline uint32_t currentPatternActive() {
     if (viewedPattern)
-      return viewedPattern->activeColor;
+      return activeColor(viewedPatternIdx);
     else
       return SONG_ACTIVE;    
   }
 
+  inline void setPlayingPattern(uint8_t index) {
+    playingPatternIdx = index;
+    playingPattern = patterns[index];
+  }
+
+  // First column of the song, or the last when playing backwards
+  void startSong() {
+    if (direction < 0) {
+      songRun = songPattern.length - 1;
+      songRepeat = songPattern.getRepeats(songRun) - 1;
+      songCursorX = songPattern.total - 1;
+    } else {
+      songRun = songRepeat = 0;
+      songCursorX = 0;
+    }
+  }
+
+  // Next column in the play direction. Only the playing run is looked at, so
+  // this takes the same time however long the song is.
+  void advanceSong() {
+    if (direction < 0) {
+      if (songRepeat) {
+        songRepeat--;
+        songCursorX--;
+      } else if (songRun) {
+        songRun--;
+        songRepeat = songPattern.getRepeats(songRun) - 1;
+        songCursorX--;
+      } else {
+        startSong();
+      }
+    } else {
+      if (++songRepeat < songPattern.getRepeats(songRun)) {
+        songCursorX++;
+      } else if (songRun + 1 < songPattern.length) {
+        songRun++;
+        songRepeat = 0;
+        songCursorX++;
+      } else {
+        startSong();
+      }
+    }
+  }
+
+  // The run advanceSong() would move to, without moving
+  uint8_t nextSongRun() {
+    if (direction < 0) {
+      if (songRepeat)
+        return songRun;
+      return songRun ? songRun - 1 : songPattern.length - 1;
+    }
+    if (songRepeat + 1 < songPattern.getRepeats(songRun))
+      return songRun;
+    return songRun + 1 < songPattern.length ? songRun + 1 : 0;
+  }
+
+  void jumpSong(uint16_t x) {
+    uint16_t start;
+    songRun = songPattern.find(x, start);
+    songRepeat = x - start;
+    songCursorX = x;
+  }
+
+  // Plays the pattern at the song cursor. If it's still in the bank, the
+  // playing pattern loops again while it's paged in and the song waits.
+  void playSongPattern() {
+    uint8_t index = songPattern.getPattern(songRun);
+    songWaiting = !usePattern(index);
+    if (!songWaiting)
+      setPlayingPattern(index);
+  }
+
+  void redrawRun(uint8_t run) {
+    uint16_t start = songPattern.startOf(run);
+    for (uint8_t i = songPattern.getRepeats(run); i > 0; i--)
+      redrawColumn(start++);
+  }
+
+  // After any change to the runs. The play position keeps its run and
+  // repeat where they still exist, and its column is worked out again.
+  void songChanged() {
+    songPattern.recount();
+    if (songCursorX < 0)
+      return;
+
+    if (songRun >= songPattern.length)
+      songRun = songPattern.length - 1;
+    uint8_t repeats = songPattern.getRepeats(songRun);
+    if (songRepeat >= repeats)
+      songRepeat = repeats - 1;
+
+    int16_t x = songPattern.startOf(songRun) + songRepeat;
+    if (x != songCursorX && !viewedPattern) {
+      redrawColumn(songCursorX);
+      redrawColumn(x);
+    }
+    songCursorX = x;
+  }
+
+  void finishTuringRotation();
+  void updateLoopConditions();
+
+  // Returns the buffer a bulk edit of a pattern should be written to. The
+  // playing pattern is never rewritten in place: it gets copied to the spare
+  // buffer, which takes its slot for viewing and editing right away, and the
+  // clock path switches playback over at the next step.
+  Pattern* beginBulkEdit(uint8_t index) {
+    Pattern *current = patterns[index];
+    if (current != playingPattern)
+      return current;
+
+    finishTuringRotation();
+    *spareBuffer = *current;
+    patterns[index] = spareBuffer;
+    retiredPattern = current;
+    spareBuffer = nullptr;
+    if (viewedPattern == current)
+      viewedPattern = patterns[index];
+    return patterns[index];
+  }
+
+  inline void finishBulkEdit() {
+    if (!retiredPattern)
+      return;
+    spareBuffer = retiredPattern;
+    retiredPattern = nullptr;
+    retireAtWrap = false;
+    if (playingPattern) {
+      playingPattern = patterns[playingPatternIdx];
+      // Undo, redo and copies can change the channels' conditions
+      updateLoopConditions();
+    }
+  }
+
+  void applySongImage(const uint8_t *image) {
+    using namespace Protocol;
+    songPattern.length = image[SONG_LENGTH];
+    songPattern.offset = image[SONG_OFFSET];
+    songPattern.scroll = 0;
+    memcpy(songPattern.runs, image + SONG_RUNS, sizeof(songPattern.runs));
+    songChanged();
+    memcpy(&gateMask, image + SONG_GATES, sizeof(gateMask));
+    Hardware::setClockTempo(image[SONG_TEMPO] | image[SONG_TEMPO + 1] << 8);
+    uint32_t seed = 0;
+    for (uint8_t i = 4; i--; )
+      seed = seed << 8 | image[SONG_SEED + i];
+    seedHeld = seed != 0;
+    if (seedHeld)
+      playSeed = seed;
+    songLoadPending = false;
+
+    // Undo records would no longer line up with the data
+    journal.clear();
+    dirtyColumns = ALL_COLUMNS;
+  }
+
+  inline void applyPendingLoads() {
+    finishBulkEdit();
+    if (songLoadPending)
+      applySongImage(pendingSong);
+  }
+
+#if MIDI_MIRROR_NOTES
+  RowMask midiNotes = 0; // Channels with a note on, same bits as the outputs
+
+  void sendNotes(RowMask channels, bool on) {
+    for (uint8_t y = 1; y < GRID_HEIGHT; y++)
+      if (channels & rowBit(y))
+        Midi::sendNote(MIDI_FIRST_NOTE + y - 1, on);
+  }
+
+  // Every step retriggers its notes, and triggers end with the clock phase
+  // while gates hold until the next step
+  void mirrorNotes() {
+    if (clockOn) {
+      sendNotes(midiNotes, false);
+      midiNotes = currentOutputs & ~1;
+      sendNotes(midiNotes, true);
+    } else {
+      sendNotes(midiNotes & ~gateMask, false);
+      midiNotes &= gateMask;
+    }
+  }
+#endif
+
+  // Transport goes out over MIDI unless it came in that way
+  inline void sendTransport(uint8_t status) {
+    if (Hardware::getClockSource() != Hardware::CLOCK_MIDI)
+      Midi::sendRealtime(status);
+  }
+
   inline void stopPlaying() {
     if (playingPattern && playingPattern == viewedPattern)
       redrawColumn(cursorX);
     if (songCursorX >= 0 && !viewedPattern)
       redrawColumn(songCursorX);
 
+    if (playingPattern)
+      sendTransport(Midi::STOP);
+    finishTuringRotation();
+    applyPendingLoads();
     playingPattern = nullptr;
     songCursorX = -1;
+    songWaiting = false;
+    cuedPattern = cuedSongPosition = -1;
 
-    Hardware::setPixel(PLAY_SONG_X, 0, SONG_ACTIVE);
-    Hardware::setPixel(PLAY_PATTERN_X, 0, currentPatternActive());
+    setControlPixel(CONTROL_PLAY_SONG, SONG_ACTIVE);
+    setControlPixel(CONTROL_PLAY_PATTERN, currentPatternActive());
 
     Hardware::lcd.setCursor(0, 0);
-    Hardware::lcd.print("Idle            ");
+    Hardware::lcd.print(F("Idle            "));
 
     Hardware::outputTriggers(0x00); // No outputs
     currentOutputs = 0x00;
+#if MIDI_MIRROR_NOTES
+    sendNotes(midiNotes, false);
+    midiNotes = 0;
+#endif
   }
 
   // Prevents the current popup from ending, the lcd should be updated after
@@ -352,21 +917,462 @@ namespace Controller {
 
   void beginNewLengthPopup(uint8_t len) {
     Hardware::lcd.setCursor(0, 1);
-    Hardware::lcd.print("New length: ");
+    Hardware::lcd.print(F("New length: "));
+    Hardware::lcd.print(len);
+    Hardware::lcd.print(F("   "));
+    popupTime = millis();
+  }
+
+  void beginSettingsPopup() {
+    Hardware::lcd.setCursor(0, 1);
+    switch (settingsPage) {
+      case SETTINGS_GATES:       Hardware::lcd.print(F("Gates/triggers  ")); break;
+      case SETTINGS_PROBABILITY: Hardware::lcd.print(F("Probability     ")); break;
+      case SETTINGS_CONDITION:   Hardware::lcd.print(F("Condition       ")); break;
+    }
+    popupTime = millis();
+  }
+
+  void beginConditionPopup(uint8_t y) {
+    uint8_t condition = viewedPattern->conditions[y];
+    Hardware::lcd.setCursor(0, 1);
+    Hardware::lcd.print(F("Ch "));
+    Hardware::lcd.print(y);
+    Hardware::lcd.print(F(": "));
+    if (settingsPage == SETTINGS_PROBABILITY) {
+      Hardware::lcd.print((condition >> 4) * 100 / MAX_PROBABILITY);
+      Hardware::lcd.print('%');
+      if ((condition & 0x0F) == COND_TURING)
+        Hardware::lcd.print(F(" flip"));
+    } else {
+      uint8_t cond = condition & 0x0F;
+      if (cond == COND_ALWAYS)
+        Hardware::lcd.print(F("Always"));
+      else if (cond == COND_FILL)
+        Hardware::lcd.print(F("Fill"));
+      else if (cond == COND_NOT_FILL)
+        Hardware::lcd.print(F("Not fill"));
+      else if (cond == COND_TURING)
+        Hardware::lcd.print(F("Turing"));
+      else {
+        const uint8_t *ratio = CONDITION_RATIOS[cond - COND_FIRST_RATIO];
+        Hardware::lcd.print(ratio[0] + 1);
+        Hardware::lcd.print(':');
+        Hardware::lcd.print(ratio[1]);
+      }
+    }
+    Hardware::lcd.print(F("        "));
+    popupTime = millis();
+  }
+
+  void beginEuclidPopup(uint8_t pulses, uint8_t len) {
+    Hardware::lcd.setCursor(0, 1);
+    Hardware::lcd.print(F("Euclid: "));
+    Hardware::lcd.print(pulses);
+    Hardware::lcd.print('/');
     Hardware::lcd.print(len);
-    Hardware::lcd.print("   ");
+    Hardware::lcd.print(F("      "));
+    popupTime = millis();
+  }
+
+  void beginRepeatsPopup(uint8_t repeats) {
+    Hardware::lcd.setCursor(0, 1);
+    Hardware::lcd.print(F("Repeats: "));
+    Hardware::lcd.print(repeats);
+    Hardware::lcd.print(F("       "));
+    popupTime = millis();
+  }
+
+  void beginBankPopup() {
+    Hardware::lcd.setCursor(0, 1);
+    Hardware::lcd.print(F("Patterns "));
+    Hardware::lcd.print(bankPage * PATTERN_COUNT + 1);
+    Hardware::lcd.print('-');
+    Hardware::lcd.print(min(bankPage * PATTERN_COUNT + PATTERN_COUNT, (int) BANK_PATTERNS));
+    Hardware::lcd.print(F("     "));
+    popupTime = millis();
+  }
+
+  void beginRecordPopup() {
+    Hardware::lcd.setCursor(0, 1);
+    Hardware::lcd.print(recording ? F("Record: on      ") : F("Record: off     "));
+    popupTime = millis();
+  }
+
+#if RECORDER_ENABLED
+  // Holding settings and pressing reset keeps the flight recorder from
+  // overwriting what just happened, until the same again lets it go on
+  void toggleRecorderFreeze() {
+    Recorder::freeze(!Recorder::isFrozen());
+    Hardware::lcd.setCursor(0, 1);
+    Hardware::lcd.print(Recorder::isFrozen() ? F("Recorder: frozen") : F("Recorder: live  "));
+    popupTime = millis();
+  }
+#endif
+
+  void beginSeedPopup() {
+    Hardware::lcd.setCursor(0, 1);
+    if (!seedHeld) {
+      Hardware::lcd.print(F("Seed: each play "));
+    } else {
+      Hardware::lcd.print(F("Seed: "));
+      for (int8_t shift = 28; shift >= 0; shift -= 4) {
+        uint8_t digit = (playSeed >> shift) & 0xF;
+        Hardware::lcd.print((char) (digit < 10 ? '0' + digit : 'A' + digit - 10));
+      }
+      Hardware::lcd.print(F("  "));
+    }
+    popupTime = millis();
+  }
+
+  // Holding settings and pressing play pattern keeps the seed of the run
+  // that's playing, or last played, for every play after it. It's saved
+  // with the song.
+  void toggleSeedHeld() {
+    seedHeld = !seedHeld;
+    beginSeedPopup();
+  }
+
+  void beginUndoPopup() {
+    Hardware::lcd.setCursor(0, 1);
+    // The last gesture was too big to journal, and emptied it
+    if (journal.overflowed) {
+      Hardware::lcd.print(F("Undo: too big   "));
+      popupTime = millis();
+      return;
+    }
+    Hardware::lcd.print(F("Undo "));
+    Hardware::lcd.print(journal.size());
+    Hardware::lcd.print('/');
+    Hardware::lcd.print(JOURNAL_RECORDS);
+    Hardware::lcd.print(' ');
+    Hardware::lcd.print(UNDO_RAM_BYTES);
+    Hardware::lcd.print(F("B      "));
+    popupTime = millis();
+  }
+
+  void beginCuePopup() {
+    Hardware::lcd.setCursor(0, 1);
+    if (cuedPattern >= 0) {
+      Hardware::lcd.print(F("Next: pattern "));
+      Hardware::lcd.print(cuedPattern + 1);
+    } else if (cuedSongPosition >= 0) {
+      Hardware::lcd.print(F("Next: step "));
+      Hardware::lcd.print(cuedSongPosition + 1);
+    } else {
+      Hardware::lcd.print(F("Next: -"));
+    }
+    Hardware::lcd.print(F("        "));
     popupTime = millis();
   }
 
   void updateTempoLCDInfo() {
     cancelPopup();
+    uint16_t tempo = Hardware::getClockTempo();
+    uint8_t hundredths = tempo % TEMPO_SCALE;
     Hardware::lcd.setCursor(0, 1);
-    Hardware::lcd.print("Tempo: ");
-    Hardware::lcd.print(Hardware::getClockBPM());
-    Hardware::lcd.print(" BPM   ");
+    // A fraction takes the colon's place so 250.00 BPM still fits
+    Hardware::lcd.print(hundredths ? F("Tempo ") : F("Tempo: "));
+    Hardware::lcd.print(tempo / TEMPO_SCALE);
+    if (hundredths) {
+      Hardware::lcd.print(hundredths < 10 ? F(".0") : F("."));
+      Hardware::lcd.print(hundredths);
+    }
+    Hardware::lcd.print(F(" BPM   "));
+  }
+
+#if TELEMETRY_ENABLED
+  #define DEBUG_REFRESH_TIME 500
+  #define DEBUG_PAGE_COUNT (Protocol::PROBE_COUNT + 3)
+
+  static const char PROBE_NAMES[Protocol::PROBE_COUNT][6] PROGMEM = {
+    "Btn", "Enc", "Clk", "Rst", "Tick", "Read", "Show", "LCD", "Shift", "Link"
+  };
+
+  int8_t debugPage = -1; // -1: off
+  uint32_t debugRefreshTime = 0;
+
+  inline uint32_t cyclesToMicros(uint32_t cycles) {
+    return cycles / clockCyclesPerMicrosecond();
+  }
+
+  // Summary, then one page per probe, then the queues and the bank
+  void showDebugPage() {
+    using namespace Protocol;
+    const TelemetryImage &stats = Telemetry::snapshot();
+    Hardware::LCD &lcd = Hardware::lcd;
+
+    lcd.setCursor(0, 0);
+    if (debugPage == 0) {
+      uint8_t worst = LOOP_BUCKETS - 1;
+      while (worst > 0 && !stats.loopHistogram[worst])
+        worst--;
+      lcd.print(F("Loop < "));
+      lcd.print(1UL << (worst + 1));
+      lcd.print(F(" us"));
+      lcd.setCursor(0, 1);
+      lcd.print(F("Stack free "));
+      lcd.print(stats.stackFree);
+    } else if (debugPage <= PROBE_COUNT) {
+      const ProbeStats &probe = stats.probes[debugPage - 1];
+      lcd.print((const __FlashStringHelper *) PROBE_NAMES[debugPage - 1]);
+      lcd.print(F(" max "));
+      lcd.print(cyclesToMicros(probe.maxCycles));
+      lcd.print(F(" us"));
+      lcd.setCursor(0, 1);
+      lcd.print(F("avg "));
+      lcd.print(probe.calls ? cyclesToMicros(probe.cycles / probe.calls) : 0);
+      lcd.print(F(" n "));
+      lcd.print(probe.calls);
+    } else if (debugPage == PROBE_COUNT + 2) {
+      lcd.print(F("Bank hit "));
+      lcd.print(stats.tallies[TALLY_BANK_HIT]);
+      lcd.print(F(" miss "));
+      lcd.print(stats.tallies[TALLY_BANK_MISS]);
+      lcd.setCursor(0, 1);
+      lcd.print(F("Loads "));
+      lcd.print(stats.tallies[TALLY_BANK_LOAD]);
+      lcd.print(F(" wr "));
+      lcd.print(stats.tallies[TALLY_BANK_WRITE]);
+    } else {
+      lcd.print(F("Int "));
+      lcd.print(stats.marks[MARK_INTERRUPT_QUEUE]);
+      lcd.print(F(" Clk "));
+      lcd.print(stats.marks[MARK_CLOCK_QUEUE]);
+      lcd.setCursor(0, 1);
+      lcd.print(F("Serial rx "));
+      lcd.print(stats.marks[MARK_SERIAL_RX]);
+    }
+    lcd.print(F("        "));
+    debugRefreshTime = millis();
+  }
+
+  void nextDebugPage() {
+    if (++debugPage >= DEBUG_PAGE_COUNT) {
+      debugPage = -1;
+      Hardware::lcd.clear();
+      updateTempoLCDInfo();
+    } else {
+      Hardware::lcd.clear();
+      showDebugPage();
+    }
+  }
+#endif
+
+  // --- BANK ---
+  // Pattern i is stored in EEPROM as its Protocol::PatternImage, at
+  // i * PATTERN_IMAGE_SIZE. Erased EEPROM fails validation, so a new board
+  // starts with blank patterns.
+  inline uint8_t *bankAddress(uint8_t index, uint8_t byte) {
+    return (uint8_t *) (uintptr_t) (index * Protocol::PATTERN_IMAGE_SIZE + byte);
+  }
+
+  bool validPattern(uint8_t length, uint8_t offset, const uint8_t *conditions) {
+    if (length < MIN_PATTERN_LEN || length > MAX_PATTERN_LEN || offset >= length)
+      return false;
+    for (uint8_t y = 0; y < GRID_HEIGHT; y++)
+      if ((conditions[y] & 0x0F) >= CONDITION_COUNT)
+        return false;
+    return true;
+  }
+
+  // Counts a use of the pattern, for telemetry and for choosing what to
+  // page out. Null if it's still in the bank, in which case tickBank()
+  // pages it in once whoever asked marks it wanted.
+  Pattern *usePattern(uint8_t index) {
+    Pattern *pattern = patterns[index];
+    if (pattern) {
+      pattern->lastUse = ++useClock;
+      TALLY(TALLY_BANK_HIT);
+    } else {
+      TALLY(TALLY_BANK_MISS);
+    }
+    return pattern;
+  }
+
+  #define BANK_WANTS 6
+
+  // Patterns that should be in RAM by the time they're needed, most urgent
+  // first, -1 for none. The song's next pattern is known a whole pattern
+  // ahead, so it's normally in before the wrap that plays it.
+  void wantedPatterns(int8_t *wants) {
+    wants[0] = wantedView;
+    wants[1] = wantedLoad;
+    wants[2] = cuedPattern;
+    wants[3] = wants[4] = -1;
+    if (songCursorX >= 0) {
+      int16_t cue = cuedSongPosition;
+      uint16_t start;
+      if (cue >= 0 && (uint16_t) cue < songPattern.total)
+        wants[3] = songPattern.getPattern(songPattern.find(cue, start));
+      wants[4] = songPattern.getPattern(songWaiting ? songRun : nextSongRun());
+    }
+    // Where play and reset start the song
+    wants[5] = songPattern.getPattern(direction < 0 ? songPattern.length - 1 : 0);
+  }
+
+  // Least recently used buffer that nothing is playing, showing or wants
+  // more urgently than the pattern it's for
+  Pattern *pickBuffer(const int8_t *wants, uint8_t urgency) {
+    Pattern *oldest = nullptr;
+    for (uint8_t i = 0; i <= PATTERN_COUNT; i++) {
+      Pattern *buffer = &patternBuffers[i];
+      if (buffer == spareBuffer || buffer == retiredPattern
+          || buffer == viewedPattern || buffer == playingPattern)
+        continue;
+      bool wanted = false;
+      for (uint8_t w = 0; w < urgency; w++)
+        wanted |= buffer->bankIndex == wants[w];
+      if (wanted)
+        continue;
+      if (!oldest || (uint16_t) (useClock - buffer->lastUse) > (uint16_t) (useClock - oldest->lastUse))
+        oldest = buffer;
+    }
+    return oldest;
+  }
+
+  // What Pattern() holds, which is also what an erased bank slot loads as
+  bool isBlank(Pattern *pattern) {
+    using namespace Protocol;
+    for (uint8_t i = 0; i < PATTERN_IMAGE_SIZE; i++) {
+      uint8_t blank = i == PATTERN_LENGTH ? DEFAULT_PATTERN_LEN
+        : i >= PATTERN_CONDITIONS ? MAX_PROBABILITY << 4 | COND_ALWAYS : 0;
+      if (pattern->imageByte(i) != blank)
+        return false;
+    }
+    return true;
+  }
+
+  // Compares up to BANK_CHUNK bytes of the buffer's image against the bank,
+  // from byte on, and starts writing the first that differs. True once the
+  // end is reached with nothing left to write.
+  bool writeBack(Pattern *buffer, uint8_t &byte) {
+    // Saves a whole image of writes on a new board
+    if (!byte && eeprom_read_byte(bankAddress(buffer->bankIndex, Protocol::PATTERN_LENGTH)) > MAX_PATTERN_LEN
+        && isBlank(buffer))
+      return true;
+    for (uint8_t n = 0; n < BANK_CHUNK; n++) {
+      if (byte >= Protocol::PATTERN_IMAGE_SIZE)
+        return true;
+      uint8_t *address = bankAddress(buffer->bankIndex, byte);
+      uint8_t value = buffer->imageByte(byte++);
+      if (eeprom_read_byte(address) != value) {
+        // Only called when the EEPROM is ready, so this doesn't wait
+        eeprom_write_byte(address, value);
+        TALLY(TALLY_BANK_WRITE);
+        return false;
+      }
+    }
+    return false;
+  }
+
+  void finishLoad() {
+    Pattern *pattern = bankBuffer;
+    bankBuffer = nullptr;
+    if (!validPattern(pattern->length, pattern->offset, pattern->conditions))
+      *pattern = Pattern();
+    pattern->scroll = 0;
+    pattern->bankIndex = bankTarget;
+    pattern->lastUse = ++useClock;
+    patterns[bankTarget] = pattern;
+    TALLY(TALLY_BANK_LOAD);
+
+    if (wantedView == (int8_t) bankTarget) {
+      switchToPattern(bankTarget);
+      Hardware::updateTrellis();
+    }
+  }
+
+  // Takes a buffer from the pattern it holds, which stops being reachable
+  // right away but is written back before anything new is read in
+  void startPaging(uint8_t index, const int8_t *wants, uint8_t urgency) {
+    Pattern *buffer = pickBuffer(wants, urgency);
+    if (!buffer)
+      return;
+    if (buffer->bankIndex >= 0) {
+      patterns[buffer->bankIndex] = nullptr;
+      // Undo can only reach patterns in RAM
+      if (journal.refersTo(buffer->bankIndex))
+        journal.clear();
+    }
+    bankBuffer = buffer;
+    bankWriting = buffer->bankIndex >= 0;
+    bankTarget = index;
+    bankByte = 0;
+  }
+
+  // Writes edits to the patterns in RAM back to the bank, one buffer after
+  // another, once the user has left things alone for a while
+  void persist() {
+    if (millis() - lastInputTime < BANK_SETTLE_MS)
+      return;
+    Pattern *buffer = &patternBuffers[persistBuffer];
+    // Turing channels change the playing pattern every loop, which would
+    // wear out the bank, so it waits until it stops playing
+    bool mutating = buffer == playingPattern && turingChannels;
+    if (buffer->bankIndex >= 0 && patterns[buffer->bankIndex] == buffer && !mutating
+        && !writeBack(buffer, persistByte))
+      return;
+    persistByte = 0;
+    if (++persistBuffer > PATTERN_COUNT)
+      persistBuffer = 0;
+  }
+
+  // Scheduler task in idle time. A step is at most BANK_CHUNK bytes read or
+  // compared, and one byte written, so paging never holds up the clock.
+  void tickBank() {
+    // Reads wait for a write in progress
+    if (!eeprom_is_ready())
+      return;
+
+    if (bankBuffer) {
+      if (bankWriting) {
+        if (writeBack(bankBuffer, bankByte)) {
+          bankWriting = false;
+          bankByte = 0;
+        }
+        return;
+      }
+      for (uint8_t n = 0; n < BANK_CHUNK && bankByte < Protocol::PATTERN_IMAGE_SIZE; n++, bankByte++)
+        bankBuffer->imageByte(bankByte) = eeprom_read_byte(bankAddress(bankTarget, bankByte));
+      if (bankByte >= Protocol::PATTERN_IMAGE_SIZE)
+        finishLoad();
+      return;
+    }
+
+    int8_t wants[BANK_WANTS];
+    wantedPatterns(wants);
+    for (uint8_t w = 0; w < BANK_WANTS; w++) {
+      if (wants[w] >= 0 && !patterns[wants[w]]) {
+        startPaging(wants[w], wants, w);
+        return;
+      }
+    }
+    persist();
+  }
+
+  // Blocks, but only at power on
+  void loadBank() {
+    for (uint8_t i = 0; i < PATTERN_COUNT; i++) {
+      bankBuffer = &patternBuffers[i];
+      bankTarget = i;
+      for (bankByte = 0; bankByte < Protocol::PATTERN_IMAGE_SIZE; bankByte++)
+        bankBuffer->imageByte(bankByte) = eeprom_read_byte(bankAddress(i, bankByte));
+      finishLoad();
+    }
+  }
+
+  void switchBankPage(uint8_t page) {
+    if (page * PATTERN_COUNT >= BANK_PATTERNS)
+      return;
+    bankPage = page;
+    drawPatternPads();
+    beginBankPopup();
   }
 
   void init() {
+    loadBank();
+
     cursorX = 0;
     drawInitialControlRow();
     switchToPattern(0);
@@ -375,41 +1381,145 @@ namespace Controller {
     Hardware::updateTrellis();
   }
 
+  // Software, then hardware, then MIDI
   inline void toggleClockMode() {
-    bool enabled = !Hardware::isSoftwareClockEnabled();
-    Hardware::setSoftwareClockEnabled(enabled);
-    Hardware::setPixel(CLOCK_MODE_X, 0, enabled ? CLOCK_MODE_SOFTWARE : CLOCK_MODE_HARDWARE);
+    static const uint32_t colors[] = { CLOCK_MODE_SOFTWARE, CLOCK_MODE_HARDWARE, CLOCK_MODE_MIDI };
+    uint8_t source = Hardware::getClockSource() + 1;
+    if (source > Hardware::CLOCK_MIDI)
+      source = Hardware::CLOCK_SOFTWARE;
+    Hardware::setClockSource((Hardware::ClockSource) source);
+    setControlPixel(CONTROL_CLOCK_MODE, colors[source]);
+  }
+
+  // Starts the gesture for an edit of a whole pattern that takes records
+  // records. If they wouldn't fit in the ring, the pattern's image is kept
+  // instead and this returns false, so the caller records nothing. There's
+  // one snapshot, so taking another empties the journal if the last one is
+  // still in it.
+  bool beginPatternGesture(uint8_t index, Pattern *pattern, uint8_t records) {
+    if (records <= JOURNAL_RECORDS) {
+      journal.begin();
+      return true;
+    }
+    if (journal.holds(EDIT_SNAPSHOT))
+      journal.clear();
+    journal.begin();
+    for (uint8_t i = 0; i < Protocol::PATTERN_IMAGE_SIZE; i++)
+      undoSnapshot[i] = pattern->imageByte(i);
+    journal.record(index, EDIT_SNAPSHOT, 0, 1);
+    return false;
   }
 
   inline void clearCurrent() {
     if (viewedPattern) {
-      memset(viewedPattern->state, 0, sizeof(viewedPattern->state));
+      Pattern *pattern = beginBulkEdit(viewedPatternIdx);
+      // Empty masks take no records
+      uint8_t records = pattern->offset != 0;
+      for (uint8_t i = 0; i < MAX_PATTERN_LEN; i++)
+        records += (pattern->state[i] != 0) + (pattern->chance[i] != 0);
+      if (beginPatternGesture(viewedPatternIdx, pattern, records)) {
+        for (uint8_t i = 0; i < MAX_PATTERN_LEN; i++) {
+          journal.record(viewedPatternIdx, EDIT_STEP, i, pattern->state[i]);
+          journal.record(viewedPatternIdx, EDIT_CHANCE, i, pattern->chance[i]);
+        }
+        journal.record(viewedPatternIdx, EDIT_OFFSET, 0, pattern->offset);
+      }
+      memset(pattern->state, 0, sizeof(pattern->state));
+      memset(pattern->chance, 0, sizeof(pattern->chance));
+      pattern->offset = 0;
     } else {
-      memset(songPattern.state, 0, sizeof(songPattern.state));
+      journal.begin();
+      for (uint8_t i = 0; i < sizeof(songPattern.runs); i++)
+        journal.record(SONG_TARGET, EDIT_STEP, i, songPattern.runs[i]);
+      journal.record(SONG_TARGET, EDIT_OFFSET, 0, songPattern.offset);
+      memset(songPattern.runs, 0, sizeof(songPattern.runs));
+      songPattern.offset = 0;
+      songChanged();
     }
-    dirtyColumns = 0xFFFF;
+    dirtyColumns = ALL_COLUMNS;
   }
 
   inline void toggleClockDirection() {
+    finishTuringRotation(); // The first step is at the other end now
     direction = -direction;
-    Hardware::setPixel(DIRECTION_X, 0, direction < 0 ? CLOCK_BACKWARD : CLOCK_FORWARD);
+    setControlPixel(CONTROL_DIRECTION, direction < 0 ? CLOCK_BACKWARD : CLOCK_FORWARD);
+  }
+
+  void updatePatternLCDInfo() {
+    Hardware::lcd.setCursor(0, 0);
+    Hardware::lcd.print(F("Pattern "));
+    Hardware::lcd.print(playingPatternIdx + 1);
+    Hardware::lcd.print(F("      "));
   }
 
   void updateSongLCDInfo() {
     Hardware::lcd.setCursor(0, 0);
-    Hardware::lcd.print("Song: Pattern ");
-    Hardware::lcd.print(getSongState(songCursorX) + 1);
-    Hardware::lcd.print(" ");
+    Hardware::lcd.print(F("Song: Pattern "));
+    Hardware::lcd.print(songPattern.getPattern(songRun) + 1);
+    Hardware::lcd.print(' ');
+  }
+
+  // Evaluated once per loop of the playing pattern, so the per-step cost is only the probability roll
+  void updateLoopConditions() {
+    loopChannels = fillChannels = notFillChannels = turingChannels = 0;
+    for (uint8_t y = 1; y < GRID_HEIGHT; y++) {
+      uint8_t cond = playingPattern->conditions[y] & 0x0F;
+      RowMask bit = rowBit(y);
+      if (cond == COND_FILL) {
+        fillChannels |= bit;
+      } else if (cond == COND_NOT_FILL) {
+        notFillChannels |= bit;
+      } else if (cond == COND_ALWAYS) {
+        loopChannels |= bit;
+      } else if (cond == COND_TURING) {
+        turingChannels |= bit;
+        loopChannels |= bit;
+      } else {
+        const uint8_t *ratio = CONDITION_RATIOS[cond - COND_FIRST_RATIO];
+        if (loopCount % ratio[1] == ratio[0])
+          loopChannels |= bit;
+      }
+    }
+  }
+
+  // Play from stop rolls new chances, unless the seed is held. The press
+  // lands at a random microsecond, so that's the new seed.
+  inline void drawPlaySeed() {
+    if (!seedHeld)
+      playSeed = Rng::Generator(playSeed ^ micros()).next();
+  }
+
+  inline void restartLoopConditions() {
+    stepHistoryCount = 0;
+    rng.setSeed(playSeed);
+    loopCount = 0;
+    updateLoopConditions();
+  }
+
+  inline void advanceLoopConditions() {
+    if (++loopCount >= CONDITION_LOOP_PERIOD)
+      loopCount = 0;
+    updateLoopConditions();
   }
 
   inline void playSong() {
+    // The start is kept in RAM, see wantedPatterns(), so it's only missing
+    // just after an edit
+    uint8_t first = songPattern.getPattern(direction < 0 ? songPattern.length - 1 : 0);
+    if (!usePattern(first))
+      return;
+
+    drawPlaySeed();
+    sendTransport(Midi::START);
     playedSongPreviously = true;
-    Hardware::setPixel(PLAY_SONG_X, 0, PLAY_STOP);
-    Hardware::setPixel(PLAY_PATTERN_X, 0, PLAY_STOP);
+    setControlPixel(CONTROL_PLAY_SONG, PLAY_STOP);
+    setControlPixel(CONTROL_PLAY_PATTERN, PLAY_STOP);
 
-    songCursorX = direction < 0 ? songPattern.length - 1 : 0;
-    playingPattern = &patterns[getSongState(songCursorX)];
+    startSong();
+    setPlayingPattern(songPattern.getPattern(songRun));
     cursorX = direction < 0 ? playingPattern->length - 1 : 0;
+    stepPlayed = false;
+    restartLoopConditions();
 
     if (!viewedPattern)
       redrawColumn(songCursorX);
@@ -423,92 +1533,98 @@ namespace Controller {
       return;
     }
 
+    drawPlaySeed();
+    sendTransport(Midi::START);
     playedSongPreviously = false;
-    Hardware::setPixel(PLAY_SONG_X, 0, PLAY_STOP);
-    Hardware::setPixel(PLAY_PATTERN_X, 0, PLAY_STOP);
+    setControlPixel(CONTROL_PLAY_SONG, PLAY_STOP);
+    setControlPixel(CONTROL_PLAY_PATTERN, PLAY_STOP);
 
-    playingPattern = viewedPattern;
+    setPlayingPattern(viewedPatternIdx);
     cursorX = direction < 0 ? playingPattern->length - 1 : 0;
+    stepPlayed = false;
+    restartLoopConditions();
     redrawColumn(cursorX);
 
-    Hardware::lcd.setCursor(0, 0);
-    Hardware::lcd.print("Pattern ");
-    Hardware::lcd.print(viewedPatternIdx + 1);
-    Hardware::lcd.print("      ");
+    updatePatternLCDInfo();
+  }
+
+  // Takes over from the playing pattern when it next wraps
+  inline void cuePattern(uint8_t index) {
+    cuedPattern = cuedPattern == index ? -1 : index;
+    beginCuePopup();
+  }
+
+  inline void cueSongPosition(uint16_t position) {
+    cuedSongPosition = cuedSongPosition == position ? -1 : position;
+    beginCuePopup();
   }
 
+  void clockRising(uint32_t time);
+
   inline void beginTapTempo() {
     tapCount = 0;
+    tapOutlier = false;
+  }
+
+  inline bool isTapOutlier(uint32_t interval, uint32_t mean) {
+    uint32_t off = interval > mean ? interval - mean : mean - interval;
+    return off > mean / TAP_OUTLIER_DIVISOR;
   }
 
   inline void clockPress() {
-    // Serial.println("clockPress()");
     if (!Hardware::isSoftwareClockEnabled()) {
-      onClockRising();
+      clockRising(Hardware::getButtonEventTime());
       return;
     }
 
-    if (tapCount < 0) {
-      // Serial.println("tapCount < 0");
+    if (tapCount < 0)
       return;
-    }
 
-    uint64_t time = millis();
+    uint32_t time = Hardware::getButtonEventTime();
+    uint32_t sinceLast = time - lastTapTime;
+    lastTapTime = time;
     if (tapCount == 0) {
       prevTapTime = time;
       tapCount++;
-      // Serial.print("tapCount == 0: ");
-      // Serial.print(prevTapTime);
-      // Serial.print(" ");
-      // Serial.println(tapCount);
       return;
     }
 
-    uint64_t dur = time - prevTapTime;
+    uint8_t count = min(tapCount - 1, MAX_TEMPO_TAPS);
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < count; i++)
+      total += tapIntervals[i];
+
+    uint32_t interval = time - prevTapTime;
+    if (count && isTapOutlier(interval, total / count)) {
+      if (!tapOutlier) {
+        // A tap too soon is an extra one, the next is still timed from the
+        // last good tap. A tap too late had one missed before it.
+        tapOutlier = true;
+        if (interval > total / count)
+          prevTapTime = time;
+        return;
+      }
+      // Two in a row, so the tempo really changed. Start over from the last
+      // two taps.
+      interval = sinceLast;
+      tapCount = 1;
+      count = 0;
+      total = 0;
+    }
+    tapOutlier = false;
     prevTapTime = time;
-    // Serial.print("Duration: ");
-    // Serial.print(dur);
-    // Serial.print(" ");
-    // Serial.print(time);
-    // Serial.print(" ");
-    // Serial.print(prevTapTime);
-    // Serial.print(" ");
-    // Serial.println(tapCount);
-
-    if (tapCount >= 1 && tapCount <= MAX_TEMPO_TAPS) {
-      tapDurations[tapCount - 1] = dur;
-      // Serial.print("Put into ");
-      // Serial.println(tapCount - 1);
-    } else {
-      // Move all the durations back one spot
-      memmove(&tapDurations[0], &tapDurations[1], (MAX_TEMPO_TAPS - 1) * sizeof(uint64_t));
-      tapDurations[MAX_TEMPO_TAPS - 1] = dur;
 
-      // Serial.print("Moved back, put into ");
-      // Serial.println(MAX_TEMPO_TAPS - 1);
+    if (count == MAX_TEMPO_TAPS) {
+      total -= tapIntervals[0];
+      memmove(&tapIntervals[0], &tapIntervals[1], (MAX_TEMPO_TAPS - 1) * sizeof(uint32_t));
+      count--;
     }
-    tapCount++;
-
-    // Serial.print("tapDurations = ");
-    // for (uint8_t i = 0; i < MAX_TEMPO_TAPS; i++) {
-    //   Serial.print(tapDurations[i]);
-    //   Serial.print(" ");
-    // }
-    // Serial.println();
+    tapIntervals[count++] = interval;
+    total += interval;
+    if (tapCount <= MAX_TEMPO_TAPS)
+      tapCount++;
 
-    uint64_t avg = 0;
-    uint8_t count = min(tapCount - 1, MAX_TEMPO_TAPS);
-    // Serial.print("Count: ");
-    // Serial.println(count);
-    for (uint8_t i = 0; i < count; i++)
-      avg += tapDurations[i];
-    // Serial.print("Total: ");
-    // Serial.println(avg);
-    avg /= count;
-    // Serial.print("Avg: ");
-    // Serial.println(avg);
-
-    Hardware::setClockInterval(avg);
+    Hardware::setClockInterval((total + count / 2) / count);
     updateTempoLCDInfo();
   }
 
@@ -519,174 +1635,667 @@ namespace Controller {
     tapCount = -1;
   }
 
-  inline void switchToPatternButton(int index) {
-    heldPatterns |= (1 << index);
+  inline void switchToPatternButton(uint8_t pad) {
+    uint8_t index = padPattern(pad);
+    if (index >= BANK_PATTERNS)
+      return;
+    heldPatterns |= (1 << pad);
 
-    uint8_t heldIndex;
-    for (heldIndex = 0; heldIndex < PATTERN_COUNT; heldIndex++) {
-      if (heldIndex == index)
+    uint8_t heldPad;
+    for (heldPad = 0; heldPad < PATTERN_COUNT; heldPad++) {
+      if (heldPad == pad)
         continue;
-      if (heldPatterns & (1 << heldIndex))
+      if (heldPatterns & (1 << heldPad))
         break;
     }
 
-    if (heldIndex < PATTERN_COUNT) {
-      // Copy from held pattern to new pattern
-      Pattern *from = &patterns[heldIndex];
-      patterns[index].copyFrom(from);
+    // Copy from held pattern to new pattern, both have to be in RAM
+    if (heldPad < PATTERN_COUNT && patterns[padPattern(heldPad)] && patterns[index]) {
+      Pattern *from = patterns[padPattern(heldPad)], *to = beginBulkEdit(index);
+      uint8_t records = (to->length != from->length) + (to->offset != from->offset);
+      for (uint8_t i = 0; i < MAX_PATTERN_LEN; i++)
+        records += (to->state[i] != from->state[i]) + (to->chance[i] != from->chance[i]);
+      for (uint8_t i = 0; i < GRID_HEIGHT; i++)
+        records += to->conditions[i] != from->conditions[i];
+      if (beginPatternGesture(index, to, records)) {
+        for (uint8_t i = 0; i < MAX_PATTERN_LEN; i++) {
+          journal.record(index, EDIT_STEP, i, to->state[i] ^ from->state[i]);
+          journal.record(index, EDIT_CHANCE, i, to->chance[i] ^ from->chance[i]);
+        }
+        for (uint8_t i = 0; i < GRID_HEIGHT; i++)
+          journal.record(index, EDIT_CONDITION, i, to->conditions[i] ^ from->conditions[i]);
+        journal.record(index, EDIT_LENGTH, 0, to->length ^ from->length);
+        journal.record(index, EDIT_OFFSET, 0, to->offset ^ from->offset);
+      }
+      to->copyFrom(from);
     }
 
     switchToPattern(index);
   }
 
+  // While a pattern plays, playing a different viewed pattern cues it instead of stopping
+  inline void playPatternPress() {
+    if (!playingPattern)
+      playPattern();
+    else if (songCursorX < 0 && viewedPattern && viewedPatternIdx != playingPatternIdx)
+      cuePattern(viewedPatternIdx);
+    else
+      stopPlaying();
+  }
+
+  // Decides the control under a pad, remembering the layer until release
+  inline uint8_t pressControl(uint8_t x) {
+    bool layer = CONTROL_LAYER && rightEncoderPressed;
+    if (layer) {
+      rightEncoderUsed = true;
+      layeredControls |= columnBit(x);
+    }
+    return controlAt(x, layer);
+  }
+
+  inline uint8_t releaseControl(uint8_t x) {
+    bool layer = CONTROL_LAYER && (layeredControls & columnBit(x));
+    layeredControls &= ~columnBit(x);
+    return controlAt(x, layer);
+  }
+
+  // --- RANGE EDITS ---
+  // Steps are stored as one RowMask each, so a range edit writes each step
+  // once for every selected channel: (step & ~rows) | (source & rows).
+  // That's also one journal record per step, however many channels.
+  enum RangeEdit : uint8_t {
+    RANGE_COPY,
+    RANGE_SHIFT,  // amount: steps later, wrapping within the range
+    RANGE_DOUBLE, // Twice as slow from the first step, the end falls off
+    RANGE_HALVE,  // Twice as fast, played twice to fill the range
+    RANGE_INVERT  // Steps only, conditional marks stay put
+  };
+
+  // Step j of the range after the edit, from a copy of the range before
+  RowMask rangeStep(const RowMask *before, uint8_t edit, uint8_t j, int16_t amount) {
+    uint8_t n = rangeCount;
+    switch (edit) {
+      case RANGE_SHIFT: {
+        int16_t k = (j - amount) % n;
+        return before[k < 0 ? k + n : k];
+      }
+      case RANGE_DOUBLE:
+        return j & 1 ? 0 : before[j >> 1];
+      case RANGE_HALVE: {
+        uint8_t half = (n + 1) >> 1;
+        uint8_t k = (j < half ? j : j - half) << 1;
+        return before[k] | (k + 1 < n ? before[k + 1] : 0);
+      }
+      case RANGE_INVERT:
+        return ~before[j];
+      default:
+        return before[j];
+    }
+  }
+
+  // Rewrites the range's channels of the viewed pattern into a pattern
+  // starting at step first, as far as that pattern goes. rowShift moves a
+  // single channel to another row.
+  void editRange(uint8_t edit, int16_t amount, uint8_t index, uint8_t first, int8_t rowShift) {
+    Pattern *from = viewedPattern;
+    Pattern *to = beginBulkEdit(index);
+    uint8_t count = min(rangeCount, to->length - first);
+    RowMask rows = rowShift >= 0 ? rangeRows << rowShift : rangeRows >> -rowShift;
+    RowMask before[MAX_PATTERN_LEN];
+
+    journal.begin();
+    for (uint8_t pass = 0; pass < 2; pass++) {
+      // A copy of the pattern a bulk edit started still has the old steps
+      const RowMask *source = pass ? from->chance : from->state;
+      RowMask *steps = pass ? to->chance : to->state;
+      for (uint8_t j = 0; j < rangeCount; j++) {
+        RowMask step = source[from->index(rangeFirst + j)];
+        before[j] = rowShift >= 0 ? step << rowShift : step >> -rowShift;
+      }
+
+      uint8_t passEdit = pass && edit == RANGE_INVERT ? (uint8_t) RANGE_COPY : edit;
+      for (uint8_t j = 0; j < count; j++) {
+        uint8_t i = to->index(first + j);
+        RowMask after = (steps[i] & ~rows) | (rangeStep(before, passEdit, j, amount) & rows);
+        journal.record(index, pass ? EDIT_CHANCE : EDIT_STEP, i, steps[i] ^ after);
+        steps[i] = after;
+      }
+    }
+
+    if (to == viewedPattern)
+      for (uint8_t j = 0; j < count; j++)
+        redrawColumn(first + j);
+  }
+
+  void beginRangePopup(const __FlashStringHelper *edit) {
+    Hardware::lcd.setCursor(0, 1);
+    Hardware::lcd.print(edit);
+    Hardware::lcd.print(' ');
+    Hardware::lcd.print(rangeFirst + 1);
+    Hardware::lcd.print('-');
+    Hardware::lcd.print(rangeFirst + rangeCount);
+    Hardware::lcd.print(rangeRows == rowBit(heldStepY) ? F("      ") : F(" all  "));
+    popupTime = millis();
+  }
+
+  void applyEdit(const Journal::Record &record, bool undo);
+
+  // The held step's press toggled it, which selecting takes back unless
+  // something was edited since. Holding the right encoder selects every
+  // channel.
+  void selectRange(uint8_t x) {
+    if (journal.isNewest(heldStepGesture))
+      journal.undo([](const Journal::Record &record) { applyEdit(record, true); });
+    if (rightEncoderPressed)
+      rightEncoderUsed = true;
+
+    rangeFirst = min(x, (uint8_t) heldStepX);
+    rangeCount = abs(x - heldStepX) + 1;
+    rangeRows = rightEncoderPressed ? (RowMask) ~rowBit(0) : rowBit(heldStepY);
+    beginRangePopup(F("Range"));
+  }
+
+  // A single channel goes to the row pressed, all of them stay on theirs
+  void pasteRange(uint8_t index, uint8_t x, uint8_t y) {
+    bool single = rangeRows == rowBit(heldStepY);
+    editRange(RANGE_COPY, 0, index, x, single ? y - heldStepY : 0);
+    beginRangePopup(F("Copied"));
+  }
+
+  // Same steps of another pattern, if it's in RAM
+  void pasteRangeToPad(uint8_t pad) {
+    uint8_t index = padPattern(pad);
+    if (index >= BANK_PATTERNS || !patterns[index] || rangeFirst >= patterns[index]->length)
+      return;
+    editRange(RANGE_COPY, 0, index, rangeFirst, 0);
+    beginRangePopup(F("Copied"));
+  }
+
+  void shiftRange(int16_t movement) {
+    editRange(RANGE_SHIFT, movement, viewedPatternIdx, rangeFirst, 0);
+    beginRangePopup(F("Shift"));
+  }
+
+  // Right doubles, left halves, a detent at a time
+  void scaleRange(int16_t movement) {
+    for (; movement > 0; movement--)
+      editRange(RANGE_DOUBLE, 0, viewedPatternIdx, rangeFirst, 0);
+    for (; movement < 0; movement++)
+      editRange(RANGE_HALVE, 0, viewedPatternIdx, rangeFirst, 0);
+    beginRangePopup(F("Scaled"));
+  }
+
+  void invertRange() {
+    editRange(RANGE_INVERT, 0, viewedPatternIdx, rangeFirst, 0);
+    beginRangePopup(F("Invert"));
+  }
+
   inline void controlRow(uint8_t x) {
-    switch (x) {
-      case CLOCK_X:        clockPress(); break;
-      case CLOCK_MODE_X:   beginTapTempo(); break;
-      case SETTINGS_X:     settingsMenuOpen = true; dirtyColumns = 0xFFFF; break;
-      case CLEAR_X:        clearCurrent(); break;
-      case SONG_X:         switchToSong(); songHeld = true; break;
-      case DIRECTION_X:    toggleClockDirection(); break;
-      case PLAY_SONG_X:    if (playingPattern) stopPlaying(); else playSong(); break;
-      case PLAY_PATTERN_X: if (playingPattern) stopPlaying(); else playPattern(); break;
-      case RESET_X:        onReset(); break;
-      default:             switchToPatternButton(x - PATTERNS_START_X); break;
+    uint8_t control = pressControl(x);
+    switch (control) {
+      case CONTROL_CLOCK:        clockPress(); break;
+      case CONTROL_CLOCK_MODE:   beginTapTempo(); break;
+      case CONTROL_SETTINGS:     settingsMenuOpen = true; settingsPage = SETTINGS_GATES; dirtyColumns = ALL_COLUMNS; break;
+#if TELEMETRY_ENABLED
+      case CONTROL_CLEAR:        if (settingsMenuOpen) nextDebugPage(); else if (rangeFirst >= 0) invertRange(); else clearCurrent(); break;
+#else
+      case CONTROL_CLEAR:        if (rangeFirst >= 0) invertRange(); else clearCurrent(); break;
+#endif
+      case CONTROL_SONG:         switchToSong(); songHeld = true; break;
+      case CONTROL_DIRECTION:    toggleClockDirection(); break;
+      case CONTROL_PLAY_SONG:    if (playingPattern) stopPlaying(); else playSong(); break;
+      case CONTROL_PLAY_PATTERN: if (settingsMenuOpen) toggleSeedHeld(); else playPatternPress(); break;
+#if RECORDER_ENABLED
+      case CONTROL_RESET:        if (settingsMenuOpen) toggleRecorderFreeze(); else onReset(); break;
+#else
+      case CONTROL_RESET:        onReset(); break;
+#endif
+      default:
+        if (settingsMenuOpen)
+          switchBankPage(control - CONTROL_PATTERN);
+        else if (rangeFirst >= 0)
+          pasteRangeToPad(control - CONTROL_PATTERN);
+        else
+          switchToPatternButton(control - CONTROL_PATTERN);
+        break;
     }
     Hardware::updateTrellis();
   }
 
+  inline void settingsPress(uint8_t x, uint8_t y) {
+    if (settingsPage == SETTINGS_GATES) {
+      gateMask ^= rowBit(y);
+      dirtyColumns = ALL_COLUMNS;
+      return;
+    }
+    if (!viewedPattern)
+      return;
+
+    // Turing channels can come and go
+    if (viewedPattern == playingPattern)
+      finishTuringRotation();
+
+    uint8_t *condition = &viewedPattern->conditions[y];
+    uint8_t before = *condition;
+    if (settingsPage == SETTINGS_PROBABILITY) {
+      uint8_t probability = (x + 1) * PROBABILITY_PER_PAD - 1;
+      *condition = (probability << 4) | (*condition & 0x0F);
+    } else {
+      if (x >= CONDITION_COUNT)
+        return;
+      *condition = (*condition & 0xF0) | x;
+    }
+    journal.begin();
+    journal.record(viewedPatternIdx, EDIT_CONDITION, y, before ^ *condition);
+    if (viewedPattern == playingPattern)
+      updateLoopConditions();
+    beginConditionPopup(y);
+    dirtyColumns = ALL_COLUMNS;
+  }
+
+  // Sets the channel on whichever played step was nearest to the moment the
+  // pad was hit, rather than the step playing when the event got processed
+  void recordHit(uint8_t y, uint32_t time) {
+    if (!stepHistoryCount)
+      return;
+
+    // Walk back to the newest step that started at or before the hit
+    StepTime *before = nullptr, *after = nullptr;
+    uint8_t idx = stepHistoryIdx;
+    uint8_t age;
+    for (age = 0; age < stepHistoryCount; age++) {
+      idx = (idx ? idx : STEP_HISTORY_LEN) - 1;
+      if ((int32_t) (time - stepHistory[idx].time) >= 0) {
+        before = &stepHistory[idx];
+        break;
+      }
+      after = &stepHistory[idx];
+    }
+
+    uint8_t patternIdx;
+    int8_t step;
+    if (!before) {
+      // Older than the whole history
+      patternIdx = after->patternIdx;
+      step = after->step;
+    } else if (after) {
+      bool nearerBefore = time - before->time <= after->time - time;
+      patternIdx = nearerBefore ? before->patternIdx : after->patternIdx;
+      step = nearerBefore ? before->step : after->step;
+    } else {
+      // After the newest step, so compare against when the next one is due
+      patternIdx = before->patternIdx;
+      step = before->step;
+      if (age + 1 < stepHistoryCount) {
+        StepTime *prev = &stepHistory[(idx ? idx : STEP_HISTORY_LEN) - 1];
+        uint32_t period = before->time - prev->time;
+        if (time - before->time > period / 2 && patterns[patternIdx]) {
+          uint8_t length = patterns[patternIdx]->length;
+          step += direction;
+          if (step < 0)
+            step = length - 1;
+          else if (step >= length)
+            step = 0;
+        }
+      }
+    }
+
+    // A pattern paged out since has nowhere to record to
+    Pattern *pattern = patterns[patternIdx];
+    if (!pattern)
+      return;
+    uint8_t i = pattern->index(step);
+    journal.begin();
+    journal.record(patternIdx, EDIT_STEP, i, ~pattern->state[i] & rowBit(y));
+    pattern->state[i] |= rowBit(y);
+    if (pattern == viewedPattern)
+      redrawColumn(step);
+  }
+
   uint8_t whichPattern = 0;
   void onButtonPress(uint8_t x, uint8_t y) {
-    uint8_t patternX = PIXEL_TO_PATTERN(x);
+    PROBE(PROBE_BUTTON);
+    lastInputTime = millis();
+    uint16_t patternX = PIXEL_TO_PATTERN(x);
     if (y == 0) {
       controlRow(x);
       return;
     } else if (settingsMenuOpen) {
-      gateMask ^= 1 << y;
-      dirtyColumns = 0xFFFF;
+      settingsPress(x, y);
     } else if (!viewedPattern) {
-      if (patternX < songPattern.length) {
-        uint8_t col = patternX >> 1;
-        if (patternX & 1)
-          songPattern.state[col] = (songPattern.state[col] & 0xF0) | (y - 1);
-        else
-          songPattern.state[col] = (songPattern.state[col] & 0x0F) | ((y - 1) << 4); 
-        dirtyColumns |= 1 << x;
+      if (patternX < songPattern.total && y <= PATTERN_COUNT && padPattern(y - 1) < BANK_PATTERNS) {
+        if (songHeld && songCursorX >= 0) {
+          // Holding song while it plays jumps there when the pattern wraps
+          cueSongPosition(patternX);
+        } else {
+          // Sets the pattern of the whole run, which stays held so the
+          // right encoder can change its repeats
+          uint16_t start;
+          uint8_t run = songPattern.find(patternX, start);
+          uint8_t i = songPattern.index(run);
+          uint8_t before = songPattern.runs[i];
+          songPattern.setPattern(run, padPattern(y - 1));
+          journal.begin();
+          journal.record(SONG_TARGET, EDIT_STEP, i, before ^ songPattern.runs[i]);
+          redrawRun(run);
+
+          heldSongRun = run;
+          heldStepY = y;
+        }
       }
+    } else if (recording && playingPattern) {
+      recordHit(y, Hardware::getButtonEventTime());
+    } else if (rangeFirst >= 0) {
+      if (patternX < viewedPattern->length)
+        pasteRange(viewedPatternIdx, patternX, y);
+    } else if (heldStepX >= 0 && y == heldStepY && patternX != (uint16_t) heldStepX
+               && patternX < viewedPattern->length) {
+      selectRange(patternX);
     } else {
+      if (rightEncoderPressed)
+        rightEncoderUsed = true;
       if (patternX < viewedPattern->length) {
-        viewedPattern->state[patternX] ^= 1 << y;
-        dirtyColumns |= 1 << x;
+        // Holding the right encoder marks steps as conditional instead
+        uint8_t i = viewedPattern->index(patternX);
+        journal.begin();
+        journal.record(viewedPatternIdx, rightEncoderPressed ? EDIT_CHANCE : EDIT_STEP, i, rowBit(y));
+        if (rightEncoderPressed)
+          viewedPattern->chance[i] ^= rowBit(y);
+        else
+          viewedPattern->state[i] ^= rowBit(y);
+        dirtyColumns |= columnBit(x);
+
+        heldStepX = patternX;
+        heldStepY = y;
+        heldStepGesture = journal.gestures;
+        euclidPulses = -1;
       }
     }
     Hardware::updateTrellis();
   }
 
   void onButtonRelease(uint8_t x, uint8_t y) {
+    PROBE(PROBE_BUTTON);
+    if (y > 0 && y == heldStepY)
+      heldStepX = heldSongRun = rangeFirst = -1;
+
     if (y == 0) {
-      if (x == SETTINGS_X) {
+      uint8_t control = releaseControl(x);
+      if (control == CONTROL_SETTINGS) {
         settingsMenuOpen = false;
-        dirtyColumns = 0xFFFF;
+        dirtyColumns = ALL_COLUMNS;
       }
-      if (x == CLOCK_X && !Hardware::isSoftwareClockEnabled())
+      if (control == CONTROL_CLOCK && !Hardware::isSoftwareClockEnabled())
         onClockFalling();
-      if (x == CLOCK_MODE_X)
+      if (control == CONTROL_CLOCK_MODE)
         endTapTempo();
-      if (x == SONG_X)
+      if (control == CONTROL_SONG)
         songHeld = false;
+      if (control >= CONTROL_PATTERN) {
+        heldPatterns &= ~(1 << (control - CONTROL_PATTERN));
+        // Serial.print("Held ");
+        // Serial.println(heldPatterns, BIN);
+      }
     }
     Hardware::updateTrellis();
-
-    int8_t pattern = (int8_t) x - PATTERNS_START_X;
-    if (pattern >= 0 && pattern < PATTERN_COUNT) {
-      heldPatterns &= ~(1 << pattern);
-      // Serial.print("Held ");
-      // Serial.println(heldPatterns, BIN);
-    }
   }
 
 
   void tick() {
+    PROBE(PROBE_TICK);
     updatePixels();
+  }
 
+  void tickDisplay() {
     if (popupTime && (millis() - popupTime) >= POPUP_PERSIST_TIME) {
       updateTempoLCDInfo(); // Will also cancel the popup
     }
+#if TELEMETRY_ENABLED
+    if (debugPage >= 0 && millis() - debugRefreshTime >= DEBUG_REFRESH_TIME)
+      showDebugPage();
+#endif
+  }
+
+
+  // Fill is held down on the playing pattern's button
+  inline bool isFillHeld() {
+    int8_t pad = patternPad(playingPatternIdx);
+    return pad >= 0 && (heldPatterns & (1 << pad));
+  }
+
+  // One random byte per channel, one draw per four channels
+  inline RowMask rollProbabilities(Pattern *pattern) {
+    RowMask pass = 0;
+    uint32_t roll = rng.next();
+    for (uint8_t y = 1; y < GRID_HEIGHT; y++) {
+      if ((y & 3) == 0)
+        roll = rng.next();
+      uint8_t probability = pattern->conditions[y] >> 4;
+      if ((uint8_t) roll < PROBABILITY_LIMIT(probability))
+        pass |= rowBit(y);
+      roll >>= 8;
+    }
+    return pass;
+  }
+
+  inline RowMask stepTriggers(Pattern *pattern, uint8_t step) {
+    uint8_t i = pattern->index(step);
+    RowMask triggers = pattern->state[i];
+    RowMask conditional = triggers & pattern->chance[i];
+    if (conditional) {
+      RowMask pass = loopChannels | (isFillHeld() ? fillChannels : notFillChannels);
+      triggers &= ~conditional | (pass & rollProbabilities(pattern));
+    }
+    return triggers;
+  }
+
+  // Sets the Turing channels of a step of the playing pattern to next's,
+  // true if that changed anything
+  inline bool takeTuringBits(uint8_t x, RowMask next) {
+    RowMask *step = &playingPattern->state[playingPattern->index(x)];
+    RowMask changed = (*step ^ next) & turingChannels;
+    *step ^= changed;
+    return changed;
+  }
+
+  // Turing channels rotate one step per loop. Rather than move all of a
+  // channel's bits at the wrap, each step takes the next step's bits as the
+  // playhead leaves it, one mask operation a clock, so the rotation is done
+  // by the time the pattern wraps. The last step gets the first step's bits
+  // as they were before it shifted.
+  inline void shiftTuringStep() {
+    Pattern *pattern = playingPattern;
+    if (!turingChannels || !stepPlayed || cursorX >= pattern->length)
+      return;
+
+    uint8_t first = direction < 0 ? pattern->length - 1 : 0;
+    uint8_t last = direction < 0 ? 0 : pattern->length - 1;
+    RowMask next;
+    if (cursorX == first) {
+      turingCarry = pattern->state[pattern->index(cursorX)];
+      turingPrimed = true;
+    } else if (!turingPrimed) {
+      // Playback didn't start this loop from the first step, shifting now
+      // would lose its bits
+      return;
+    }
+    if (cursorX == last) {
+      next = turingCarry;
+      turingPrimed = false;
+    } else {
+      next = pattern->state[pattern->index(cursorX + direction)];
+    }
+    takeTuringBits(cursorX, next);
+  }
+
+  // Finishes the loop's rotation in one pass, for when the playhead won't
+  // get to the last step: a reset, a stop, a direction change or an edit of
+  // the playing pattern. Dropping the carry instead would lose the first
+  // step's bits and leave a step doubled. The steps from the playhead on
+  // take the next step's bits, as they would have on the way.
+  void finishTuringRotation() {
+    if (!turingPrimed)
+      return;
+    turingPrimed = false;
+
+    Pattern *pattern = playingPattern;
+    uint8_t last = direction < 0 ? 0 : pattern->length - 1;
+    for (uint8_t x = cursorX; x != last; x += direction) {
+      if (takeTuringBits(x, pattern->state[pattern->index(x + direction)]) && viewedPattern == pattern)
+        redrawColumn(x);
+    }
+    if (takeTuringBits(last, turingCarry) && viewedPattern == pattern)
+      redrawColumn(last);
   }
 
+  // With each Turing channel's probability, flips one of its steps at random.
+  // A draw or two per channel, and only the flipped step's column is redrawn.
+  inline void flipTuringSteps() {
+    Pattern *pattern = playingPattern;
+    for (uint8_t y = 1; y < GRID_HEIGHT; y++) {
+      RowMask bit = rowBit(y);
+      if (!(turingChannels & bit))
+        continue;
+      uint8_t probability = pattern->conditions[y] >> 4;
+      if (rng.byte() >= PROBABILITY_LIMIT(probability))
+        continue;
+      uint8_t step = rng.below(pattern->length);
+      pattern->state[pattern->index(step)] ^= bit;
+      if (viewedPattern == pattern)
+        redrawColumn(step);
+    }
+  }
 
   void writeOutputs() {
     if (clockOn) {
-      currentOutputs = playingPattern->state[cursorX];
+      currentOutputs = stepTriggers(playingPattern, cursorX);
       Hardware::outputTriggers(currentOutputs | 1); // Always output trigger on output 1 for clock out
     } else {
       Hardware::outputTriggers(currentOutputs & gateMask);
     }
+#if MIDI_MIRROR_NOTES
+    mirrorNotes();
+#endif
+  }
+
+  // Moves on to the cued pattern or song position, or the next song step.
+  // Only pointers change here, no pattern data is copied.
+  void wrapPlayingPattern() {
+    applyPendingLoads();
+
+    if (songCursorX >= 0) {
+      if (!viewedPattern)
+        redrawColumn(songCursorX);
+
+      // Only a cued jump has to look through the runs
+      int16_t cue = cuedSongPosition;
+      cuedSongPosition = -1;
+      if (cue >= 0 && (uint16_t) cue < songPattern.total)
+        jumpSong(cue);
+      else if (!songWaiting)
+        advanceSong();
+      playSongPattern();
+
+      if (!viewedPattern)
+        redrawColumn(songCursorX);
+      updateSongLCDInfo();
+    } else if (cuedPattern >= 0 && usePattern(cuedPattern)) {
+      // A cue still in the bank waits for the next wrap
+      setPlayingPattern(cuedPattern);
+      cuedPattern = -1;
+      updatePatternLCDInfo();
+    }
+    advanceLoopConditions();
+    flipTuringSteps();
   }
 
   void onClockRising() {
-    Hardware::setPixel(0, 0, direction < 0 ? CLOCK_BACKWARD : CLOCK_FORWARD);
+    PROBE(PROBE_CLOCK);
+    clockRising(Hardware::getClockEventTime());
+  }
+
+  void clockRising(uint32_t time) {
+    setControlPixel(CONTROL_CLOCK, direction < 0 ? CLOCK_BACKWARD : CLOCK_FORWARD);
     Hardware::updateTrellis();
 
     if (!playingPattern)
       return;
 
-    // Advance cursor and pattern position
+    // A bulk edit of the playing pattern takes over at the step boundary,
+    // loads wait for the pattern boundary
+    if (!retireAtWrap)
+      finishBulkEdit();
+
+    // Advance cursor and pattern position. The step left behind is redrawn
+    // anyway, so Turing channels shifting it costs no extra column.
+    shiftTuringStep();
     if (viewedPattern == playingPattern)
       redrawColumn(cursorX);
     cursorX += direction;
     if (cursorX < 0) {
-      if (songCursorX >= 0) {
-        if (!viewedPattern)
-          redrawColumn(songCursorX);
-        if (--songCursorX < 0)
-          songCursorX = songPattern.length - 1;
-        playingPattern = &patterns[getSongState(songCursorX)];
-        if (!viewedPattern)
-          redrawColumn(songCursorX);
-        updateSongLCDInfo();
-      }
+      wrapPlayingPattern();
       cursorX = playingPattern->length - 1;
     }
     if (cursorX >= playingPattern->length) {
-      if (songCursorX >= 0) {
-        if (!viewedPattern)
-          redrawColumn(songCursorX);
-        if (++songCursorX >= songPattern.length)
-          songCursorX = 0;
-        playingPattern = &patterns[getSongState(songCursorX)];
-        if (!viewedPattern)
-          redrawColumn(songCursorX);
-        updateSongLCDInfo();
-      }
+      wrapPlayingPattern();
       cursorX = 0;
     }
     if (viewedPattern == playingPattern)
       redrawColumn(cursorX);
 
+    StepTime *entry = &stepHistory[stepHistoryIdx];
+    entry->time = time;
+    entry->patternIdx = playingPatternIdx;
+    entry->step = cursorX;
+    if (++stepHistoryIdx >= STEP_HISTORY_LEN)
+      stepHistoryIdx = 0;
+    if (stepHistoryCount < STEP_HISTORY_LEN)
+      stepHistoryCount++;
+
     clockOn = true;
     writeOutputs();
+    stepPlayed = true;
   }
 
   void onClockFalling() {
+    PROBE(PROBE_CLOCK);
     clockOn = false;
     writeOutputs();
 
-    Hardware::setPixel(0, 0, CLOCK_OFF);
+    setControlPixel(CONTROL_CLOCK, CLOCK_OFF);
     Hardware::updateTrellis();
   }
 
+  // MIDI start rewinds, continue keeps going from where playback is
+  void onTransportStart(bool rewind) {
+    if (!playingPattern) {
+      if (playedSongPreviously)
+        playSong();
+      else
+        playPattern();
+    } else if (rewind) {
+      onReset();
+    }
+  }
+
+  void onTransportStop() {
+    if (playingPattern)
+      stopPlaying();
+  }
+
   void onReset() {
+    PROBE(PROBE_RESET);
     if (!playingPattern)
       return;
+    finishTuringRotation();
 
     if (songCursorX > 0) {
       if (!viewedPattern)
         redrawColumn(songCursorX);
       if (viewedPattern == playingPattern)
         redrawColumn(cursorX);
-      songCursorX = direction < 0 ? songPattern.length - 1 : 0;
-      playingPattern = &patterns[getSongState(songCursorX)];
+      startSong();
+      playSongPattern();
       cursorX = direction < 0 ? playingPattern->length - 1 : 0;
       if (!viewedPattern)
         redrawColumn(songCursorX);
@@ -699,71 +2308,92 @@ namespace Controller {
       if (playingPattern == viewedPattern)
         redrawColumn(cursorX);
     }
+    restartLoopConditions();
 
     writeOutputs();
+    stepPlayed = true;
   }
 
   void lengthenPattern() {
     if (viewedPattern) {
       if (viewedPattern->length < MAX_PATTERN_LEN) {
+        beginBulkEdit(viewedPatternIdx);
+        journal.record(viewedPatternIdx, EDIT_NORMALIZE, 0, viewedPattern->offset);
+        viewedPattern->normalize();
         uint8_t col = viewedPattern->length++;
+        journal.record(viewedPatternIdx, EDIT_LENGTH, 0, col ^ (col + 1));
         redrawColumn(col);
         beginNewLengthPopup(col + 1);
       }
     } else {
-      if (songPattern.length < MAX_PATTERN_LEN) {
-        uint8_t col = songPattern.length++;
-        redrawColumn(col);
-        beginNewLengthPopup(col + 1);
+      if (songPattern.length < MAX_SONG_RUNS) {
+        journal.record(SONG_TARGET, EDIT_NORMALIZE, 0, songPattern.offset);
+        songPattern.normalize();
+        uint8_t run = songPattern.length++;
+        journal.record(SONG_TARGET, EDIT_LENGTH, 0, run ^ (run + 1));
+        songChanged();
+        redrawRun(run);
+        beginNewLengthPopup(run + 1);
       }
     }
   }
 
-  uint8_t calcMaxScroll(uint8_t patternLen) {
-    return max(patternLen, PANEL_WIDTH) - PANEL_WIDTH;
+  uint16_t calcMaxScroll(uint16_t patternLen) {
+    return max(patternLen, GRID_WIDTH) - GRID_WIDTH;
   }
 
   void shortenPattern() {
     if (viewedPattern) {
       if (viewedPattern->length > MIN_PATTERN_LEN) {
+        beginBulkEdit(viewedPatternIdx);
+        journal.record(viewedPatternIdx, EDIT_NORMALIZE, 0, viewedPattern->offset);
+        viewedPattern->normalize();
         uint8_t col = --viewedPattern->length;
+        journal.record(viewedPatternIdx, EDIT_LENGTH, 0, col ^ (col + 1));
         beginNewLengthPopup(col);
 
         uint8_t maxScroll = calcMaxScroll(col);
         if (getCurrentScroll() >= maxScroll) {
           viewedPattern->scroll = maxScroll;
-          dirtyColumns = 0xFFFF;
+          dirtyColumns = ALL_COLUMNS;
         } else {
           redrawColumn(col);
         }
       }
     } else {
       if (songPattern.length > MIN_PATTERN_LEN) {
-        uint8_t col = --songPattern.length;
-        beginNewLengthPopup(col);
-
-        uint8_t maxScroll = calcMaxScroll(col);
+        journal.record(SONG_TARGET, EDIT_NORMALIZE, 0, songPattern.offset);
+        songPattern.normalize();
+        uint8_t run = --songPattern.length;
+        journal.record(SONG_TARGET, EDIT_LENGTH, 0, run ^ (run + 1));
+        beginNewLengthPopup(run);
+
+        // The columns the run took are now out of bounds
+        uint16_t end = songPattern.total;
+        songChanged();
+        uint16_t maxScroll = calcMaxScroll(songPattern.total);
         if (getCurrentScroll() >= maxScroll) {
           songPattern.scroll = maxScroll;
-          dirtyColumns = 0xFFFF;
+          dirtyColumns = ALL_COLUMNS;
         } else {
-          redrawColumn(col);
+          for (uint16_t x = songPattern.total; x < end; x++)
+            redrawColumn(x);
         }
       }
     }
   }
 
   void doScroll(int16_t amount) {
-    uint8_t scroll = getCurrentScroll();
+    uint16_t scroll = getCurrentScroll();
     
     if (amount < 0 && scroll == 0)
       return;
-    uint8_t len = viewedPattern ? viewedPattern->length : songPattern.length;
-    uint8_t maxScroll = calcMaxScroll(len);
+    uint16_t len = viewedPattern ? viewedPattern->length : songPattern.total;
+    uint16_t maxScroll = calcMaxScroll(len);
     if (amount > 0 && scroll == maxScroll)
       return;
 
-    dirtyColumns = 0xFFFF;
+    dirtyColumns = ALL_COLUMNS;
 
     if (amount < 0 && scroll < -amount)
       scroll = 0;
@@ -787,12 +2417,12 @@ namespace Controller {
     // else
     //   currentLen = songPattern.length;
 
-    // uint8_t maxScroll = min(currentLen, PANEL_WIDTH) - PANEL_WIDTH;
+    // uint8_t maxScroll = min(currentLen, GRID_WIDTH) - GRID_WIDTH;
     // if (amount > 0 && scroll == maxScroll)
     //   return; // Can't scroll past end of pattern
 
     // // Redraw everything since the view is changing
-    // dirtyColumns = 0xFFFF;
+    // dirtyColumns = ALL_COLUMNS;
 
     // // Move the scroll by amount, while limiting to keep pattern on screen
     // int16_t unclamped = (int16_t) scroll + amount;
@@ -800,14 +2430,157 @@ namespace Controller {
     // scroll = clamped;
   }
 
+  // Fills the held step's channel with evenly spread hits, the first on the held step
+  void euclidFill(int16_t movement) {
+    beginBulkEdit(viewedPatternIdx);
+    uint8_t len = viewedPattern->length;
+    RowMask bit = rowBit(heldStepY);
+
+    if (euclidPulses < 0) {
+      euclidPulses = 0;
+      for (uint8_t i = 0; i < len; i++)
+        if (viewedPattern->state[i] & bit)
+          euclidPulses++;
+    }
+    euclidPulses = constrain(euclidPulses + movement, 0, len);
+
+    // Steps are stored rotated by offset, so rotate the mask to match
+    uint32_t mask = Euclid::pattern(len, euclidPulses, heldStepX + viewedPattern->offset);
+    uint8_t hits = 0;
+    journal.begin();
+    for (uint8_t i = 0; i < len; i++) {
+      if ((i & 7) == 0) {
+        hits = mask;
+        mask >>= 8;
+      }
+      RowMask before = viewedPattern->state[i];
+      viewedPattern->state[i] = (before & ~bit) | (hits & 1 ? bit : 0);
+      journal.record(viewedPatternIdx, EDIT_STEP, i, before ^ viewedPattern->state[i]);
+      hits >>= 1;
+    }
+
+    beginEuclidPopup(euclidPulses, len);
+    dirtyColumns = ALL_COLUMNS;
+  }
+
+
+  void changeRepeats(int16_t movement) {
+    uint8_t i = songPattern.index(heldSongRun);
+    uint8_t before = songPattern.runs[i];
+    uint8_t repeats = constrain(songPattern.getRepeats(heldSongRun) + movement, 1, MAX_SONG_REPEATS);
+    songPattern.setRepeats(heldSongRun, repeats);
+    journal.begin();
+    journal.record(SONG_TARGET, EDIT_STEP, i, before ^ songPattern.runs[i]);
+    songChanged();
+
+    beginRepeatsPopup(repeats);
+    dirtyColumns = ALL_COLUMNS;
+  }
+
+  // Applies one journal record. Everything but normalizing is an xor, so
+  // undo and redo only differ there. Only columns the record touches get
+  // redrawn, unless it moves the whole pattern.
+  void applyEdit(const Journal::Record &record, bool undo) {
+    uint8_t kind = record.getKind();
+    uint8_t target = record.getTarget();
+
+    if (target == SONG_TARGET) {
+      switch (kind) {
+        case EDIT_STEP:   songPattern.runs[record.index] ^= record.mask; break;
+        case EDIT_OFFSET: songPattern.offset ^= record.mask; break;
+        case EDIT_LENGTH: songPattern.length ^= record.mask; break;
+        case EDIT_NORMALIZE:
+          if (undo) songPattern.denormalize(record.mask); else songPattern.normalize();
+          break;
+      }
+      songChanged();
+      if (viewedPattern)
+        return;
+      // A change of pattern leaves the columns where they were
+      if (kind == EDIT_STEP && !(record.mask & 0x0F)) {
+        if (record.index < songPattern.length)
+          redrawRun(songPattern.runOf(record.index));
+      } else {
+        dirtyColumns = ALL_COLUMNS;
+      }
+      return;
+    }
+
+    Pattern *pattern = beginBulkEdit(target);
+    switch (kind) {
+      case EDIT_STEP:      pattern->state[record.index] ^= record.mask; break;
+      case EDIT_CHANCE:    pattern->chance[record.index] ^= record.mask; break;
+      case EDIT_CONDITION: pattern->conditions[record.index] ^= record.mask; break;
+      case EDIT_OFFSET:    pattern->offset ^= record.mask; break;
+      case EDIT_LENGTH:    pattern->length ^= record.mask; break;
+      case EDIT_NORMALIZE:
+        if (undo) pattern->denormalize(record.mask); else pattern->normalize();
+        break;
+      case EDIT_SNAPSHOT:
+        for (uint8_t i = 0; i < Protocol::PATTERN_IMAGE_SIZE; i++) {
+          uint8_t &byte = pattern->imageByte(i);
+          uint8_t was = byte;
+          byte = undoSnapshot[i];
+          undoSnapshot[i] = was;
+        }
+        break;
+    }
+    if (pattern != viewedPattern)
+      return;
+    if (kind == EDIT_STEP || kind == EDIT_CHANCE) {
+      if (record.index < pattern->length)
+        redrawColumn(pattern->stepOf(record.index));
+    } else {
+      dirtyColumns = ALL_COLUMNS;
+    }
+  }
+
+  // Negative movement undoes that many gestures, positive redoes them
+  void undoRedo(int16_t movement) {
+    for (; movement < 0; movement++)
+      journal.undo([](const Journal::Record &record) { applyEdit(record, true); });
+    for (; movement > 0; movement--)
+      journal.redo([](const Journal::Record &record) { applyEdit(record, false); });
+    beginUndoPopup();
+  }
+
   void onEncoderTurn(Hardware::Encoder encoder, int16_t movement) {
+    PROBE(PROBE_ENCODER);
+    lastInputTime = millis();
     if (encoder == Hardware::Encoder::LEFT) {
-      uint16_t tempo = Hardware::getClockBPM();
-      tempo += movement * TEMPO_STEP;
-      Hardware::setClockBPM(tempo);
+      // Holding settings turns the tempo encoder into undo and redo
+      if (settingsMenuOpen) {
+        undoRedo(movement);
+        return;
+      }
+      if (viewedPattern && rangeFirst >= 0) {
+        scaleRange(movement);
+        return;
+      }
+      int32_t step = TEMPO_STEP;
+      if (rightEncoderPressed) {
+        rightEncoderUsed = true;
+        step = TEMPO_FINE_STEP;
+      }
+      int32_t tempo = Hardware::getClockTempo() + movement * step;
+      Hardware::setClockTempo(constrain(tempo, 0, 0xFFFF));
       updateTempoLCDInfo();
     } else {
-      if (rightEncoderPressed) {
+      if (rightEncoderPressed)
+        rightEncoderUsed = true;
+
+      if (settingsMenuOpen) {
+        settingsPage = (settingsPage + movement % SETTINGS_PAGE_COUNT + SETTINGS_PAGE_COUNT) % SETTINGS_PAGE_COUNT;
+        beginSettingsPopup();
+        dirtyColumns = ALL_COLUMNS;
+      } else if (viewedPattern && rangeFirst >= 0) {
+        shiftRange(movement);
+      } else if (viewedPattern && heldStepX >= 0) {
+        euclidFill(movement);
+      } else if (!viewedPattern && heldSongRun >= 0) {
+        changeRepeats(movement);
+      } else if (rightEncoderPressed) {
+        journal.begin();
         while (movement != 0) {
           if (movement > 0) {
             lengthenPattern();
@@ -817,28 +2590,20 @@ namespace Controller {
             movement++;
           }
         }
-      } else if (viewedPattern && (heldPatterns & (1 << viewedPatternIdx))) {
-        while (movement != 0) {
-          if (movement > 0) {
-            viewedPattern->rotateRight();
-            movement--;
-          } else {
-            viewedPattern->rotateLeft();
-            movement++;
-          }
-        }
-        dirtyColumns = 0xFFFF;
+      } else if (viewedPattern && patternPad(viewedPatternIdx) >= 0
+                 && (heldPatterns & (1 << patternPad(viewedPatternIdx)))) {
+        uint8_t before = viewedPattern->offset;
+        viewedPattern->rotate(movement);
+        journal.begin();
+        journal.record(viewedPatternIdx, EDIT_OFFSET, 0, before ^ viewedPattern->offset);
+        dirtyColumns = ALL_COLUMNS;
       } else if (!viewedPattern && songHeld) {
-        while (movement != 0) {
-          if (movement > 0) {
-            songPattern.rotateRight();
-            movement--;
-          } else {
-            songPattern.rotateLeft();
-            movement++;
-          }
-          dirtyColumns = 0xFFFF;
-        }
+        uint8_t before = songPattern.offset;
+        songPattern.rotate(movement);
+        journal.begin();
+        journal.record(SONG_TARGET, EDIT_OFFSET, 0, before ^ songPattern.offset);
+        songChanged();
+        dirtyColumns = ALL_COLUMNS;
       } else {
         doScroll(-movement);
       }
@@ -846,6 +2611,7 @@ namespace Controller {
   }
 
   void onEncoderPress(Hardware::Encoder encoder) {
+    PROBE(PROBE_ENCODER);
     if (encoder == Hardware::Encoder::LEFT) {
       if (!playingPattern) {
         if (playedSongPreviously)
@@ -857,12 +2623,113 @@ namespace Controller {
       }
     } else {
       rightEncoderPressed = true;
+      rightEncoderUsed = false;
     }
   }
 
   void onEncoderRelease(Hardware::Encoder encoder) {
+    PROBE(PROBE_ENCODER);
     if (encoder == Hardware::Encoder::RIGHT) {
       rightEncoderPressed = false;
+
+      // A click on its own toggles live recording
+      if (!rightEncoderUsed) {
+        recording = !recording;
+        beginRecordPopup();
+      }
+    }
+  }
+
+  void getPatternImage(uint8_t index, uint8_t *image) {
+    using namespace Protocol;
+    // A pattern still being written back is only complete in its old buffer
+    Pattern *pattern = patterns[index];
+    if (!pattern && bankBuffer && bankWriting && bankBuffer->bankIndex == index)
+      pattern = bankBuffer;
+    if (!pattern) {
+      eeprom_read_block(image, bankAddress(index, 0), PATTERN_IMAGE_SIZE);
+      if (!validPattern(image[PATTERN_LENGTH], image[PATTERN_OFFSET], image + PATTERN_CONDITIONS)) {
+        // Never saved, so what a load would page in
+        memset(image, 0, PATTERN_IMAGE_SIZE);
+        image[PATTERN_LENGTH] = DEFAULT_PATTERN_LEN;
+        memset(image + PATTERN_CONDITIONS, MAX_PROBABILITY << 4 | COND_ALWAYS, GRID_HEIGHT);
+      }
+      return;
+    }
+    image[PATTERN_LENGTH] = pattern->length;
+    image[PATTERN_OFFSET] = pattern->offset;
+    memcpy(image + PATTERN_STATE, pattern->state, sizeof(pattern->state));
+    memcpy(image + PATTERN_CHANCE, pattern->chance, sizeof(pattern->chance));
+    memcpy(image + PATTERN_CONDITIONS, pattern->conditions, sizeof(pattern->conditions));
+  }
+
+  Protocol::Status loadPatternImage(uint8_t index, const uint8_t *image) {
+    using namespace Protocol;
+    uint8_t length = image[PATTERN_LENGTH];
+    if (index >= BANK_PATTERNS || !validPattern(length, image[PATTERN_OFFSET], image + PATTERN_CONDITIONS))
+      return BAD_IMAGE;
+
+    // Loads go through RAM, so one for a pattern in the bank pages it in
+    // and asks the host to send it again
+    if (!usePattern(index)) {
+      wantedLoad = index;
+      return BUSY;
+    }
+    if (wantedLoad == (int8_t) index)
+      wantedLoad = -1;
+
+    // Loading the playing pattern goes through the spare buffer like any bulk
+    // edit, but playback only moves over once the old copy wraps
+    Pattern *pattern = beginBulkEdit(index);
+    if (playingPattern && index == playingPatternIdx)
+      retireAtWrap = true;
+
+    pattern->length = length;
+    pattern->offset = image[PATTERN_OFFSET];
+    pattern->scroll = 0;
+    memcpy(pattern->state, image + PATTERN_STATE, sizeof(pattern->state));
+    memcpy(pattern->chance, image + PATTERN_CHANCE, sizeof(pattern->chance));
+    memcpy(pattern->conditions, image + PATTERN_CONDITIONS, sizeof(pattern->conditions));
+
+    journal.clear();
+    if (pattern == viewedPattern)
+      dirtyColumns = ALL_COLUMNS;
+    return OK;
+  }
+
+  void getSongImage(uint8_t *image) {
+    using namespace Protocol;
+    uint16_t tempo = Hardware::getClockTempo();
+    image[SONG_LENGTH] = songPattern.length;
+    image[SONG_OFFSET] = songPattern.offset;
+    memcpy(image + SONG_RUNS, songPattern.runs, sizeof(songPattern.runs));
+    memcpy(image + SONG_GATES, &gateMask, sizeof(gateMask));
+    image[SONG_TEMPO] = tempo & 0xFF;
+    image[SONG_TEMPO + 1] = tempo >> 8;
+    uint32_t seed = seedHeld ? playSeed : 0;
+    for (uint8_t i = 0; i < 4; i++, seed >>= 8)
+      image[SONG_SEED + i] = seed;
+  }
+
+  Protocol::Status loadSongImage(const uint8_t *image) {
+    using namespace Protocol;
+    uint8_t length = image[SONG_LENGTH];
+    if (length < MIN_PATTERN_LEN || length > MAX_SONG_RUNS || image[SONG_OFFSET] >= length)
+      return BAD_IMAGE;
+    for (uint8_t i = 0; i < sizeof(songPattern.runs); i++)
+      if ((image[SONG_RUNS + i] >> 4) >= BANK_PATTERNS)
+        return BAD_IMAGE;
+
+    if (!playingPattern) {
+      applySongImage(image);
+      return OK;
     }
+    if (songLoadPending)
+      return BUSY;
+    memcpy(pendingSong, image, SONG_IMAGE_SIZE);
+    songLoadPending = true;
+    return OK;
   }
 }
+
+#endif
@@ -26,6 +26,15 @@
 
 #include <Arduino.h>
 #include "hardware.h"
+#include "protocol.h"
+
+// Sequencer engines, chosen at build time with -DCONTROLLER_ENGINE=...
+// Both run on the same Hardware layer.
+#define ENGINE_PATTERNS 0 // Patterns and songs, controller.cpp
+#define ENGINE_TRACKS 1   // Free-running tracks with arps, tracks.cpp
+#ifndef CONTROLLER_ENGINE
+#define CONTROLLER_ENGINE ENGINE_PATTERNS
+#endif
 
 namespace Controller {
   void init();
@@ -33,15 +42,30 @@ namespace Controller {
   void onButtonPress(uint8_t x, uint8_t y);
   void onButtonRelease(uint8_t x, uint8_t y);
 
+  // Scheduler tasks: tick() redraws the grid, tickDisplay() keeps the LCD
+  // up to date and tickBank() pages patterns to and from EEPROM, both in
+  // idle time
   void tick();
+  void tickDisplay();
+  void tickBank();
 
   void onClockRising();
   void onClockFalling();
   void onReset();
+  void onTransportStart(bool rewind);
+  void onTransportStop();
 
   void onEncoderTurn(Hardware::Encoder encoder, int16_t movement);
   void onEncoderPress(Hardware::Encoder encoder);
   void onEncoderRelease(Hardware::Encoder encoder);
+
+  // Images for the serial link, laid out as in protocol.h. Loads are
+  // validated first, and anything the playing pattern depends on waits for
+  // it to wrap.
+  void getPatternImage(uint8_t index, uint8_t *image);
+  Protocol::Status loadPatternImage(uint8_t index, const uint8_t *image);
+  void getSongImage(uint8_t *image);
+  Protocol::Status loadSongImage(const uint8_t *image);
 }
 
 #endif
@@ -0,0 +1,74 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "euclid.h"
+
+namespace Euclid {
+  // The table holds lengths 2..EUCLID_MAX_LENGTH with 1..length-1 pulses,
+  // since 0 and length pulses are trivial
+  constexpr uint16_t tableOffset(uint8_t length) {
+    return (uint16_t) (length - 2) * (length - 1) / 2;
+  }
+
+  #define EUCLID_TABLE_SIZE tableOffset(EUCLID_MAX_LENGTH + 1)
+
+  constexpr uint8_t lengthAt(uint16_t entry, uint8_t length = 2) {
+    return entry < length - 1 ? length : lengthAt(entry - (length - 1), length + 1);
+  }
+
+  constexpr uint32_t maskAt(uint16_t entry) {
+    return mask(lengthAt(entry), entry - tableOffset(lengthAt(entry)) + 1);
+  }
+
+  // Expands to maskAt(0), maskAt(1), ... so the whole table is computed by the compiler
+  template<uint16_t... I> struct Indices {};
+  template<uint16_t N, uint16_t... I> struct BuildIndices : BuildIndices<N - 1, N - 1, I...> {};
+  template<uint16_t... I> struct BuildIndices<0, I...> { typedef Indices<I...> type; };
+
+  template<typename> struct Table;
+  template<uint16_t... I> struct Table<Indices<I...> > {
+    static const uint32_t masks[sizeof...(I)];
+  };
+  template<uint16_t... I>
+  const uint32_t Table<Indices<I...> >::masks[sizeof...(I)] PROGMEM = { maskAt(I)... };
+
+  typedef Table<BuildIndices<EUCLID_TABLE_SIZE>::type> MaskTable;
+
+  static_assert(EUCLID_MAX_LENGTH <= 32, "Euclid masks are 32 bits wide");
+  static_assert(maskAt(tableOffset(8) + 2) == 0b01001001, "E(3, 8) should be x..x..x.");
+
+  uint32_t pattern(uint8_t length, uint8_t pulses, uint8_t rotation) {
+    if (length == 0 || pulses == 0)
+      return 0;
+
+    uint32_t all = length >= 32 ? 0xFFFFFFFF : (1UL << length) - 1;
+    if (pulses >= length)
+      return all;
+
+    uint32_t m = pgm_read_dword(&MaskTable::masks[tableOffset(length) + pulses - 1]);
+    rotation %= length;
+    if (rotation)
+      m = ((m << rotation) | (m >> (length - rotation))) & all;
+    return m;
+  }
+}
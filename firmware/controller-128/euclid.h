@@ -0,0 +1,46 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef euclid_h
+#define euclid_h
+
+#include <Arduino.h>
+
+// Longest pattern the mask table covers, one bit per step
+#define EUCLID_MAX_LENGTH 32
+
+namespace Euclid {
+  // Bit i is a hit when (i * pulses) mod length wraps below pulses. This
+  // spreads the hits as evenly as Bjorklund's algorithm (up to rotation)
+  // and always puts the first hit on step 0.
+  constexpr uint32_t mask(uint8_t length, uint8_t pulses, uint8_t i = 0) {
+    return i >= length ? 0
+      : ((uint16_t) i * pulses % length < pulses ? 1UL << i : 0) | mask(length, pulses, i + 1);
+  }
+
+  // Mask with `pulses` of `length` steps set, first hit on step `rotation`.
+  // A flash table lookup plus one rotate, no per-step work.
+  uint32_t pattern(uint8_t length, uint8_t pulses, uint8_t rotation);
+}
+
+#endif
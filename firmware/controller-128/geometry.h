@@ -0,0 +1,154 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef geometry_h
+#define geometry_h
+
+// Grid size and everything derived from it. Plain C++ with no Arduino
+// dependency, like protocol.h, so host tools build for the same geometry.
+// Everything here is a compile time constant: a different size is a
+// different build, not a runtime check.
+
+#include <stdint.h>
+
+// Pads across and down, in NeoTrellis boards of 4x4. Row 0 is the control
+// row, every other row is a channel.
+#ifndef GRID_WIDTH
+#define GRID_WIDTH 16 // 8 or 16
+#endif
+#ifndef GRID_HEIGHT
+#define GRID_HEIGHT 8 // 8 or 16
+#endif
+
+// Bytes of a row mask, as stored in pattern and song images
+#define GRID_ROW_BYTES (GRID_HEIGHT / 8)
+
+namespace Geometry {
+  // Smallest type for a mask of that many bits, up to the 32 outputs of a
+  // chain of four shift registers
+  template<uint8_t Bits> struct MaskFor;
+  template<> struct MaskFor<8> { typedef uint8_t type; };
+  template<> struct MaskFor<16> { typedef uint16_t type; };
+  template<> struct MaskFor<24> { typedef uint32_t type; };
+  template<> struct MaskFor<32> { typedef uint32_t type; };
+
+  constexpr uint8_t log2(uint8_t n) {
+    return n > 1 ? 1 + log2(n >> 1) : 0;
+  }
+
+  constexpr uint8_t WIDTH = GRID_WIDTH;
+  constexpr uint8_t HEIGHT = GRID_HEIGHT;
+  constexpr uint8_t WIDTH_SHIFT = log2(WIDTH);
+
+  constexpr uint8_t BOARD_SHIFT = 2; // Boards are 4x4
+  constexpr uint8_t BOARD_COLS = WIDTH >> BOARD_SHIFT;
+  constexpr uint8_t BOARD_ROWS = HEIGHT >> BOARD_SHIFT;
+  constexpr uint8_t BOARD_COUNT = BOARD_COLS * BOARD_ROWS;
+  constexpr uint8_t FIRST_BOARD_ADDRESS = 0x2E;
+
+  static_assert(WIDTH == 8 || WIDTH == 16, "GRID_WIDTH must be 8 or 16");
+  static_assert(HEIGHT == 8 || HEIGHT == 16, "GRID_HEIGHT must be 8 or 16");
+
+  // One bit per column or per row, bit 0 is column 0 or the control row
+  typedef MaskFor<WIDTH>::type ColumnMask;
+  typedef MaskFor<HEIGHT>::type RowMask;
+
+  constexpr ColumnMask ALL_COLUMNS = (ColumnMask) ~(ColumnMask) 0;
+
+  constexpr ColumnMask columnBit(uint8_t x) { return (ColumnMask) 1 << x; }
+  constexpr RowMask rowBit(uint8_t y) { return (RowMask) 1 << y; }
+
+  // The Trellis numbers keys across the whole grid in reading order
+  constexpr uint8_t keyX(uint16_t key) { return key & (WIDTH - 1); }
+  constexpr uint8_t keyY(uint16_t key) { return key >> WIDTH_SHIFT; }
+
+  // Boards are jumpered to consecutive addresses in reading order
+  constexpr uint8_t boardAddress(uint8_t row, uint8_t col) {
+    return FIRST_BOARD_ADDRESS + row * BOARD_COLS + col;
+  }
+
+  // --- CONTROL ROW ---
+  enum Control : uint8_t {
+    CONTROL_CLOCK,
+    CONTROL_CLOCK_MODE,
+    CONTROL_SETTINGS,
+    CONTROL_CLEAR,
+    CONTROL_SONG,
+    CONTROL_DIRECTION,
+    CONTROL_PLAY_SONG,
+    CONTROL_PLAY_PATTERN,
+    CONTROL_RESET,
+    CONTROL_PATTERN // Pattern i is CONTROL_PATTERN + i
+  };
+
+#if GRID_WIDTH == 16
+  // Clock, clock mode, settings, clear, song, the patterns, direction, play
+  // song, play pattern, reset
+  #define PATTERN_COUNT 7
+  #define CONTROL_LAYER 0
+  constexpr uint8_t PATTERNS_X = 5;
+
+  constexpr uint8_t controlAt(uint8_t x, bool) {
+    return x < PATTERNS_X ? x
+      : x < PATTERNS_X + PATTERN_COUNT ? CONTROL_PATTERN + x - PATTERNS_X
+      : x - PATTERN_COUNT;
+  }
+
+  // -1: the control has no pad of its own
+  constexpr int8_t controlX(uint8_t control) {
+    return control >= CONTROL_PATTERN ? PATTERNS_X + control - CONTROL_PATTERN
+      : control <= CONTROL_SONG ? control
+      : control + PATTERN_COUNT;
+  }
+#else
+  // Clock, settings, song, the patterns, play pattern, reset. Holding the
+  // right encoder swaps in clock mode, clear, play song and direction, which
+  // have no light of their own.
+  #define PATTERN_COUNT 3
+  #define CONTROL_LAYER 1
+  constexpr uint8_t PATTERNS_X = 3;
+
+  constexpr uint8_t controlAt(uint8_t x, bool layer) {
+    return x >= PATTERNS_X && x < PATTERNS_X + PATTERN_COUNT ? CONTROL_PATTERN + x - PATTERNS_X
+      : x == 0 ? (layer ? CONTROL_CLOCK_MODE : CONTROL_CLOCK)
+      : x == 1 ? CONTROL_SETTINGS
+      : x == 2 ? (layer ? CONTROL_CLEAR : CONTROL_SONG)
+      : x == 6 ? (layer ? CONTROL_PLAY_SONG : CONTROL_PLAY_PATTERN)
+      : (layer ? CONTROL_DIRECTION : CONTROL_RESET);
+  }
+
+  constexpr int8_t controlX(uint8_t control) {
+    return control >= CONTROL_PATTERN ? PATTERNS_X + control - CONTROL_PATTERN
+      : control == CONTROL_CLOCK ? 0
+      : control == CONTROL_SETTINGS ? 1
+      : control == CONTROL_SONG ? 2
+      : control == CONTROL_PLAY_PATTERN ? 6
+      : control == CONTROL_RESET ? 7
+      : -1;
+  }
+#endif
+
+  static_assert(PATTERN_COUNT < HEIGHT, "Song rows don't fit the patterns");
+}
+
+#endif
@@ -21,8 +21,11 @@
 
 */
 
+#include <Wire.h>
 #include "hardware.h"
 #include "controller.h"
+#include "midi.h"
+#include "scheduler.h"
 
 // Pin definitions
 // Trellis must use pins 5 and 6 (SCL/INT0, SDA/INT1)
@@ -45,14 +48,44 @@
 #define CLOCK_INTERRUPT 7     // INT2
 #define RESET 9
 
+// Pixels per seesaw buffer write: two bytes of register and two of offset
+// have to fit in its 32-byte I2C buffer too
+#define PIXELS_PER_WRITE 8
+
+// Twi queue slots pixel writes leave free, so keypad polling never waits
+// behind a whole redraw
+#define KEYPAD_SLOTS 1
+
+// How long the seesaw needs between a register and reading it back, from
+// the seesaw library
+#define KEYPAD_COUNT_DELAY 500
+#define KEYPAD_FIFO_DELAY 1000
+
+// Wire gives up on a board after this long while they're started
+#define WIRE_TIMEOUT_US 25000
+
+// How often a board that stopped answering is asked again
+#define BOARD_RETRY_MS 500
+
+// How long the missing boards are shown before starting anyway
+#define MISSING_MESSAGE_MS 2000
+
 namespace Hardware {
-  FastTrellis trellisArray[TRELLIS_HEIGHT / 4][TRELLIS_WIDTH / 4] = {
-    {FastTrellis(0x2E), FastTrellis(0x2F), FastTrellis(0x30), FastTrellis(0x31)},
-    {FastTrellis(0x32), FastTrellis(0x33), FastTrellis(0x34), FastTrellis(0x35)}
+  #define BOARD(row, col) FastTrellis(Geometry::boardAddress(row, col))
+#if GRID_WIDTH == 16
+  #define BOARD_ROW(row) {BOARD(row, 0), BOARD(row, 1), BOARD(row, 2), BOARD(row, 3)}
+#else
+  #define BOARD_ROW(row) {BOARD(row, 0), BOARD(row, 1)}
+#endif
+  FastTrellis trellisArray[Geometry::BOARD_ROWS][Geometry::BOARD_COLS] = {
+    BOARD_ROW(0), BOARD_ROW(1),
+#if GRID_HEIGHT == 16
+    BOARD_ROW(2), BOARD_ROW(3)
+#endif
   };
-  FastMultiTrellis trellis((FastTrellis *)trellisArray, TRELLIS_HEIGHT / 4, TRELLIS_WIDTH / 4);
+  FastMultiTrellis trellis((FastTrellis *)trellisArray, Geometry::BOARD_ROWS, Geometry::BOARD_COLS);
 
-  LiquidCrystal lcd(LCD_RS, LCD_EN, LCD_D4, LCD_D5, LCD_D6, LCD_D7);
+  LCD lcd(LCD_RS, LCD_EN, LCD_D4, LCD_D5, LCD_D6, LCD_D7);
   
   struct EncoderState {
     Encoder which;
@@ -89,15 +122,18 @@ namespace Hardware {
 
     void callHandlers() {
       if (change != 0) {
+        RECORD(EVENT_TURN, which << 7 | (constrain(change, -64, 63) & 0x7F), micros());
         Controller::onEncoderTurn(which, change);
         change = 0;
       }
       
       bool s = digitalRead(pinS);
       if (!s && prevS) {
+        RECORD(EVENT_PUSH, which, micros());
         Controller::onEncoderPress(which);
       }
       if (s && !prevS) {
+        RECORD(EVENT_LET, which, micros());
         Controller::onEncoderRelease(which);
       }
       prevS = s;
@@ -110,22 +146,39 @@ namespace Hardware {
   volatile uint8_t interruptWriteIdx = 0;
   uint8_t interruptReadIdx = 0;
 
-  volatile uint8_t hwClockBuffer[INTERRUPT_BUF_SIZE]; // Stores snapshots of PIND
+  #define HW_CLOCK_BUF_SIZE 8
+  volatile uint8_t hwClockBuffer[HW_CLOCK_BUF_SIZE]; // Stores snapshots of PIND
+  volatile uint32_t hwClockTimes[HW_CLOCK_BUF_SIZE]; // micros() at each snapshot
   volatile uint8_t hwClockWriteIdx = 0;
   uint8_t hwClockReadIdx = 0;
 
   EncoderState leftEncoder(Encoder::LEFT, L_ENCODER_A, L_ENCODER_B, L_ENCODER_S);
   EncoderState rightEncoder(Encoder::RIGHT, R_ENCODER_A, R_ENCODER_B, R_ENCODER_S);
 
-  volatile bool softwareClockEnabled;
-  uint64_t prevTime;
-  double unprocessedTime;
-  double secondsPerPhase;
+  // The software clock counts us times tempo, so a phase is the same number
+  // of units at any tempo and nothing is lost to rounding
+  #define PHASE_UNITS (30000000UL * TEMPO_SCALE / TICKS_PER_BEAT)
+
+  // Most us added to phaseUnits at once, so it can't overflow at MAX_TEMPO
+  #define PHASE_CHUNK_US 100000UL
+
+  volatile ClockSource clockSource;
+  uint32_t prevTime;
+  uint32_t phaseUnits; // Into the current phase
   bool clockEdge;
-  uint16_t bpm;
+  uint16_t tempo;
   uint64_t prevRead;
   bool prevReset;
   bool prevHwClock;
+  uint32_t clockEventTime;
+
+  // MIDI clock out: MIDI_TICKS_PER_PHASE ticks spread over each clock phase
+  uint32_t phaseStart;
+  uint32_t phaseLength;
+  uint32_t prevRisingTime;
+  uint8_t midiTicksSent = MIDI_TICKS_PER_PHASE;
+
+  Midi::TempoFollower midiFollower;
   
   inline void initShiftRegister() {
     pinMode(SHIFT_DATA,  OUTPUT);
@@ -138,24 +191,47 @@ namespace Hardware {
 
   inline void initLCD() {
     lcd.begin(16, 2);
-    lcd.print("Starting...");
+    lcd.print(F("Starting..."));
   }
 
+  // Boards that don't start are left out, so the clock and outputs still
+  // run with part or all of the grid gone
   inline void initTrellis() {
-    if (!trellis.begin()) {
-      lcd.setCursor(0, 0);
-      lcd.print("Start failed!    ");
-      while (true)
-        delay(1);
+    Wire.setWireTimeout(WIRE_TIMEOUT_US, true);
+
+    uint8_t missing = 0;
+    for (uint8_t r = 0; r < Geometry::BOARD_ROWS; r++) {
+      for (uint8_t c = 0; c < Geometry::BOARD_COLS; c++) {
+        FastTrellis &t = trellisArray[r][c];
+        if (!t.begin(Geometry::boardAddress(r, c))) {
+          trellis.setMissing(r, c);
+          missing++;
+          continue;
+        }
+        for (uint8_t key = 0; key < NEO_TRELLIS_NUM_KEYS; key++) {
+          t.activateKey(key, SEESAW_KEYPAD_EDGE_RISING,  true);
+          t.activateKey(key, SEESAW_KEYPAD_EDGE_FALLING, true);
+        }
+      }
     }
 
-    for (uint8_t x = 0; x < TRELLIS_WIDTH; x++) {
-      for (uint8_t y = 0; y < TRELLIS_HEIGHT; y++) {
-        trellis.activateKey(x, y, SEESAW_KEYPAD_EDGE_RISING,  true);
-        trellis.activateKey(x, y, SEESAW_KEYPAD_EDGE_FALLING, true);
+    for (uint8_t x = 0; x < GRID_WIDTH; x++)
+      for (uint8_t y = 0; y < GRID_HEIGHT; y++)
         trellis.registerCallback(x, y, buttonCallback);
-      }
+
+    if (missing) {
+      lcd.setCursor(0, 0);
+      lcd.print(F("Boards missing: "));
+      lcd.setCursor(0, 1);
+      lcd.print(missing);
+      lcd.print(F(" of "));
+      lcd.print(Geometry::BOARD_COUNT);
+      lcd.print(F("         "));
+      delay(MISSING_MESSAGE_MS);
     }
+
+    // Wire is done with the boards from here on
+    Twi::init();
   }
 
   inline void initEncoders() {
@@ -173,20 +249,20 @@ namespace Hardware {
   }
 
   inline void initClock() {
-    prevTime = millis();
+    prevTime = micros();
     clockEdge = false;
 
-    softwareClockEnabled = true;
-    setClockBPM(DEFAULT_BPM);
+    clockSource = CLOCK_SOFTWARE;
+    setClockTempo(DEFAULT_BPM * TEMPO_SCALE);
 
     prevHwClock = false;
     prevReset = false;
   }
 
+  // Link::init() starts the port, this only waits for a host to open it
   inline void initSerial() {
-    Serial.begin(9600);
     lcd.setCursor(0, 0);
-    lcd.print("Awaiting serial ");
+    lcd.print(F("Awaiting serial "));
     while (!Serial)
       delay(1);
   }
@@ -201,18 +277,24 @@ namespace Hardware {
     prevRead = millis();
   }
 
-  void outputTriggers(uint8_t out) {
-    digitalWrite(SHIFT_CLK, LOW);
-    shiftOut(SHIFT_DATA, SHIFT_CLK, MSBFIRST, out);
+  // One register per eight rows, the last register in the chain first
+  // shiftOut() leaves the clock low, and init left it low before that
+  void shiftOutputByte(uint8_t bits) {
+    shiftOut(SHIFT_DATA, SHIFT_CLK, MSBFIRST, bits);
+  }
+
+  void latchOutputs() {
     digitalWrite(SHIFT_LATCH, HIGH);
     digitalWrite(SHIFT_LATCH, LOW);
   }
 
   TrellisCallback buttonCallback(keyEvent evt) {
     if (evt.bit.EDGE == SEESAW_KEYPAD_EDGE_RISING) {
-      Controller::onButtonPress(evt.bit.NUM % TRELLIS_WIDTH, evt.bit.NUM / TRELLIS_WIDTH);
+      RECORD(EVENT_PRESS, evt.bit.NUM, getButtonEventTime());
+      Controller::onButtonPress(Geometry::keyX(evt.bit.NUM), Geometry::keyY(evt.bit.NUM));
     } else if (evt.bit.EDGE == SEESAW_KEYPAD_EDGE_FALLING) {
-      Controller::onButtonRelease(evt.bit.NUM % TRELLIS_WIDTH, evt.bit.NUM / TRELLIS_WIDTH);
+      RECORD(EVENT_RELEASE, evt.bit.NUM, getButtonEventTime());
+      Controller::onButtonRelease(Geometry::keyX(evt.bit.NUM), Geometry::keyY(evt.bit.NUM));
     }
 
     return 0;
@@ -229,43 +311,135 @@ namespace Hardware {
   }
 
   void handleClockInterrupt() {
-    if (softwareClockEnabled)
+    if (clockSource != CLOCK_HARDWARE)
       return;
 
-    hwClockBuffer[hwClockWriteIdx++] = PIND;
-    if (hwClockWriteIdx >= INTERRUPT_BUF_SIZE)
-      hwClockWriteIdx -= INTERRUPT_BUF_SIZE;
+    hwClockBuffer[hwClockWriteIdx] = PIND;
+    hwClockTimes[hwClockWriteIdx++] = micros();
+    if (hwClockWriteIdx >= HW_CLOCK_BUF_SIZE)
+      hwClockWriteIdx -= HW_CLOCK_BUF_SIZE;
   }
 
-  uint16_t getClockBPM() {
-    return bpm;
+  uint32_t getClockEventTime() {
+    return clockEventTime;
   }
 
-  void setClockBPM(uint16_t newBPM) {
-    if (newBPM < MIN_TEMPO) newBPM = MIN_TEMPO;
-    if (newBPM > MAX_TEMPO) newBPM = MAX_TEMPO;
+  void getFaults(Protocol::FaultImage &image) {
+    Twi::Faults faults = Twi::getFaults();
+    image.nacks = faults.nacks;
+    image.busErrors = faults.busErrors;
+    image.timeouts = faults.timeouts;
+    image.offlineBoards = trellis.getOffline();
+    image.missingBoards = trellis.getMissing();
+  }
 
-    bpm = newBPM;  
-    secondsPerPhase = 30.0 / (double) (bpm * TICKS_PER_BEAT);
+  uint16_t getClockTempo() {
+    return tempo;
   }
 
-  void setClockInterval(uint64_t intervalMs) {
-    double secPerPhase = intervalMs / 2000.0;
-    setClockBPM((uint16_t) (30.0 / secPerPhase));
+  void setClockTempo(uint16_t newTempo) {
+    if (newTempo < MIN_TEMPO * TEMPO_SCALE) newTempo = MIN_TEMPO * TEMPO_SCALE;
+    if (newTempo > MAX_TEMPO * TEMPO_SCALE) newTempo = MAX_TEMPO * TEMPO_SCALE;
+    tempo = newTempo;
+
+    // phaseUnits is already the same fraction of the new phase, only the MIDI
+    // ticks still to come need spreading over what's left of it
+    if (clockSource == CLOCK_SOFTWARE) {
+      phaseLength = PHASE_UNITS / tempo;
+      phaseStart = micros() - phaseUnits / tempo;
+    }
   }
 
-  bool isSoftwareClockEnabled() {
-    return softwareClockEnabled;
+  void setClockInterval(uint32_t beatUs) {
+    uint64_t newTempo = beatUs ? (60000000ULL * TEMPO_SCALE + beatUs / 2) / beatUs : 0xFFFF;
+    setClockTempo(min(newTempo, 0xFFFF));
   }
 
-  void setSoftwareClockEnabled(bool enabled) {
-    softwareClockEnabled = enabled;
+  ClockSource getClockSource() {
+    return clockSource;
   }
 
-  void tickClock() {
-    trellis.read(1);
+  void setClockSource(ClockSource source) {
+    clockSource = source;
+    midiFollower.reset();
+  }
 
+  // Starts spreading MIDI ticks over the phase that began at clockEventTime
+  void startMidiPhase(bool rising) {
+    // An early edge must not swallow the ticks still owed for the last phase
+    while (midiTicksSent < MIDI_TICKS_PER_PHASE) {
+      Midi::sendRealtime(Midi::CLOCK);
+      midiTicksSent++;
+    }
+
+    if (clockSource == CLOCK_SOFTWARE) {
+      phaseLength = PHASE_UNITS / tempo;
+    } else if (rising) {
+      // External clocks can have any duty cycle, so use half the period
+      phaseLength = (clockEventTime - prevRisingTime) / 2;
+      prevRisingTime = clockEventTime;
+    }
+    phaseStart = clockEventTime;
+    midiTicksSent = 0;
+  }
+
+  // Ticks are placed relative to when the edge was due rather than when it
+  // got processed, so loop() latency doesn't add up across a phase
+  void sendMidiClock() {
+    uint32_t elapsed = micros() - phaseStart;
+    uint32_t spacing = phaseLength / MIDI_TICKS_PER_PHASE;
+    while (midiTicksSent < MIDI_TICKS_PER_PHASE && elapsed >= midiTicksSent * spacing) {
+      Midi::sendRealtime(Midi::CLOCK);
+      midiTicksSent++;
+    }
+  }
+
+  // Every clock edge goes through these, whatever the source. An edge
+  // latched too long after it was due is a missed deadline for tickClock().
+  inline void clockRising() {
+    RECORD(EVENT_CLOCK_RISING, clockSource, clockEventTime);
+    Controller::onClockRising();
+    Scheduler::due(clockEventTime);
+  }
+
+  inline void clockFalling() {
+    RECORD(EVENT_CLOCK_FALLING, clockSource, clockEventTime);
+    Controller::onClockFalling();
+    Scheduler::due(clockEventTime);
+  }
+
+  inline void clockPhase() {
+    if (clockEdge) {
+      clockRising();
+    } else {
+      clockFalling();
+    }
+    clockEdge = !clockEdge;
+  }
+
+  // Transport only counts while slaved, so a DAW can't stop the internal clock
+  void readMidi() {
+    while (uint8_t status = Midi::readRealtime()) {
+      if (clockSource != CLOCK_MIDI)
+        continue;
+
+      if (status == Midi::CLOCK) {
+        midiFollower.tick(micros());
+      } else if (status == Midi::STOP) {
+        Controller::onTransportStop();
+      } else if (status == Midi::START || status == Midi::CONTINUE) {
+        // Next tick starts a step
+        midiFollower.reset();
+        clockEdge = true;
+        Controller::onTransportStart(status == Midi::START);
+      }
+    }
+  }
+
+  // Only turns are counted here, the handlers wait for pollEncoders()
+  void tickClock() {
     // Encoders & reset
+    HIGH_WATER(MARK_INTERRUPT_QUEUE, (uint8_t) (interruptWriteIdx - interruptReadIdx) % INTERRUPT_BUF_SIZE);
     while (interruptReadIdx != interruptWriteIdx) {
       uint8_t state = interruptBuffer[interruptReadIdx++];
       if (interruptReadIdx >= INTERRUPT_BUF_SIZE)
@@ -275,100 +449,288 @@ namespace Hardware {
       rightEncoder.handlePins((state & 0b10000000) != 0, (state & 0b01000000) != 0);
 
       bool reset = state & 1;
-      if (reset && !prevReset)
+      if (reset && !prevReset) {
+        RECORD(EVENT_RESET, 0, micros());
         Controller::onReset();
+      }
       prevReset = reset;
     }
     
-    leftEncoder.callHandlers();
-    rightEncoder.callHandlers();
+    readMidi();
 
-    if (softwareClockEnabled) {
+    if (clockSource == CLOCK_SOFTWARE) {
       // Software clock
-      uint64_t time = millis();
-      uint64_t passedTime = time - prevTime;
+      uint32_t time = micros();
+      uint32_t passedTime = time - prevTime;
       prevTime = time;
-      unprocessedTime += passedTime / 1000.0;
-      while (unprocessedTime > secondsPerPhase) {
-        if (clockEdge) {
-          Controller::onClockRising();    
-        } else {
-          Controller::onClockFalling();
+      while (passedTime) {
+        uint32_t chunk = min(passedTime, PHASE_CHUNK_US);
+        passedTime -= chunk;
+        phaseUnits += chunk * tempo;
+        while (phaseUnits >= PHASE_UNITS) {
+          // What is left over is how long ago this edge was due
+          phaseUnits -= PHASE_UNITS;
+          clockEventTime = time - passedTime - phaseUnits / tempo;
+
+          // Outputs first, MIDI can wait
+          bool rising = clockEdge;
+          clockPhase();
+          startMidiPhase(rising);
         }
-        clockEdge = !clockEdge;
-        unprocessedTime -= secondsPerPhase;
       }
 
       // Ignore hardware clock
       hwClockReadIdx = hwClockWriteIdx;
+    } else if (clockSource == CLOCK_MIDI) {
+      while (midiFollower.poll(micros(), clockEventTime))
+        clockPhase();
+
+      phaseUnits = 0;
+      prevTime = micros();
+      hwClockReadIdx = hwClockWriteIdx;
     } else {
       // No software clock
       if (!clockEdge) {
-        Controller::onClockFalling();
+        clockEventTime = micros();
+        clockFalling();
         clockEdge = true;
       }
-      unprocessedTime = 0;
-      prevTime = millis();
+      phaseUnits = 0;
+      prevTime = micros();
 
       // Handle hardware clocks
+      HIGH_WATER(MARK_CLOCK_QUEUE, (uint8_t) (hwClockWriteIdx - hwClockReadIdx) % HW_CLOCK_BUF_SIZE);
       while (hwClockReadIdx != hwClockWriteIdx) {
-        uint8_t pindAtEdge = hwClockBuffer[hwClockReadIdx++];
-        if (hwClockReadIdx >= INTERRUPT_BUF_SIZE)
-          hwClockReadIdx -= INTERRUPT_BUF_SIZE;
+        uint8_t pindAtEdge = hwClockBuffer[hwClockReadIdx];
+        clockEventTime = hwClockTimes[hwClockReadIdx++];
+        if (hwClockReadIdx >= HW_CLOCK_BUF_SIZE)
+          hwClockReadIdx -= HW_CLOCK_BUF_SIZE;
 
         bool state = (pindAtEdge & (1 << 2)) != 0;
 
         if (state && !prevHwClock)
-          Controller::onClockRising();
+          clockRising();
         if (!state && prevHwClock)
-          Controller::onClockFalling();
+          clockFalling();
+        if (state != prevHwClock)
+          startMidiPhase(state);
 
         prevHwClock = state;
       }
     }
+
+    if (clockSource != CLOCK_MIDI)
+      sendMidiClock();
+    Midi::flush();
+  }
+
+  void pollEncoders() {
+    leftEncoder.callHandlers();
+    rightEncoder.callHandlers();
+  }
+
+  bool FastTrellis::requestKeypadCount(uint8_t *count, Twi::Callback callback, uint8_t tag) {
+    Twi::Job job(_addr, SEESAW_KEYPAD_BASE, SEESAW_KEYPAD_COUNT);
+    job.read = true;
+    job.data = count;
+    job.length = 1;
+    job.readDelay = KEYPAD_COUNT_DELAY;
+    job.callback = callback;
+    job.tag = tag;
+    return Twi::submit(job);
+  }
+
+  bool FastTrellis::requestKeypadEvents(keyEventRaw *events, uint8_t count, Twi::Callback callback, uint8_t tag) {
+    Twi::Job job(_addr, SEESAW_KEYPAD_BASE, SEESAW_KEYPAD_FIFO);
+    job.read = true;
+    job.data = (uint8_t *) events;
+    job.length = count;
+    job.readDelay = KEYPAD_FIFO_DELAY;
+    job.callback = callback;
+    job.tag = tag;
+    return Twi::submit(job);
+  }
+
+  // The writes point straight into the pixel buffer. A pixel changed before
+  // it goes out is marked dirty again, so the board ends up right either way.
+  bool FastTrellis::sendPixels(uint8_t from, uint8_t to, Twi::Callback shown, uint8_t tag) {
+    uint8_t writes = (to - from) / PIXELS_PER_WRITE + 1;
+    if (Twi::space() < writes + 1 + KEYPAD_SLOTS)
+      return false;
+
+    uint8_t *buffer = pixels.getPixels();
+    for (; from <= to; from += PIXELS_PER_WRITE) {
+      uint8_t count = min(PIXELS_PER_WRITE, to + 1 - from);
+      uint16_t offset = from * 3;
+      Twi::Job job(_addr, SEESAW_NEOPIXEL_BASE, SEESAW_NEOPIXEL_BUF);
+      job.header[2] = offset >> 8;
+      job.header[3] = offset;
+      job.headerLength = 4;
+      job.data = buffer + offset;
+      job.length = count * 3;
+      Twi::submit(job);
+    }
+    Twi::Job show(_addr, SEESAW_NEOPIXEL_BASE, SEESAW_NEOPIXEL_SHOW);
+    show.callback = shown;
+    show.tag = tag;
+    Twi::submit(show);
+    return true;
+  }
+
+  void FastMultiTrellis::update() {
+    Twi::poll();
+    if (showPending)
+      show();
+    read();
+  }
+
+  // A read that failed left the board's events where they were, so this
+  // poll doesn't count as the last one for timing them
+  void FastMultiTrellis::setOffline(uint8_t board) {
+    offline |= boardBit(board);
+    polledThisRound &= ~boardBit(board);
+  }
+
+  // Whatever the board was sent while it was gone is lost, and it may have
+  // been reset, so all of it gets sent again
+  void FastMultiTrellis::setOnline(uint8_t board) {
+    if (!(offline & boardBit(board)))
+      return;
+    offline &= ~boardBit(board);
+    uint8_t r = board / Geometry::BOARD_COLS, c = board % Geometry::BOARD_COLS;
+    dirtyFrom[r][c] = 0;
+    dirtyTo[r][c] = NEO_TRELLIS_NUM_KEYS - 1;
+    showPending = true;
   }
 
-  void FastMultiTrellis::read(uint8_t count) {
-    for (uint8_t i = 0; i < count; i++) {
-      row++;
-      if (row >= _rows) {
-        row = 0;
-        col++;
-        if (col >= _cols)
-          col = 0;
+  // Asks the next board how many events it has. Nothing blocks, the rest
+  // happens in the callbacks as the reads finish. Boards that are off the
+  // bus are only asked every BOARD_RETRY_MS.
+  void FastMultiTrellis::read() {
+    if (polling)
+      return;
+
+    bool retry = millis() - retryTime >= BOARD_RETRY_MS;
+    uint8_t nextRow = row, nextCol = col, board;
+    bool newRound = false;
+    for (uint8_t i = 0; ; i++) {
+      if (i == Geometry::BOARD_COUNT)
+        return;
+      nextRow++;
+      if (nextRow >= Geometry::BOARD_ROWS) {
+        nextRow = 0;
+        nextCol++;
+        if (nextCol >= Geometry::BOARD_COLS) {
+          nextCol = 0;
+          newRound = true;
+        }
       }
+      board = boardIndex(nextRow, nextCol);
+      if (!(missing & boardBit(board)) && (retry || !(offline & boardBit(board))))
+        break;
+    }
+
+    if (!trellisArray[nextRow][nextCol].requestKeypadCount(&keyCount, onKeypadCount, board))
+      return;
+    if (offline & boardBit(board))
+      retryTime = millis();
+    row = nextRow;
+    col = nextCol;
+    polling = true;
+    PROBE(PROBE_TRELLIS_READ);
+
+    if (newRound) {
+      polledLastRound = polledThisRound;
+      polledThisRound = 0;
+    }
+    uint32_t now = micros();
+    uint32_t prevPoll = pollTimes[row][col];
+    pollTimes[row][col] = now;
+    eventTime = polledLastRound & boardBit(board) ? prevPoll + (now - prevPoll) / 2 : now;
+    polledThisRound |= boardBit(board);
+  }
+
+  void FastMultiTrellis::onKeypadCount(uint8_t board, bool ok) {
+    if (!ok) {
+      trellis.setOffline(board);
+      trellis.polling = false;
+      return;
+    }
+    trellis.setOnline(board);
+    if (trellis.keyCount == 0) {
+      trellis.polling = false;
+      return;
+    }
+
+    // Events can come in between the count and the read, like
+    // Adafruit_MultiTrellis.read() takes two more than it was told
+    uint8_t count = min(trellis.keyCount + 2, KEY_EVENTS_PER_READ);
+    FastTrellis &t = trellisArray[trellis.row][trellis.col];
+    if (!t.requestKeypadEvents(trellis.keyEvents, count, onKeypadEvents, board)) {
+      trellis.polling = false;
+      return;
+    }
+    trellis.keyCount = count;
+  }
+
+  void FastMultiTrellis::onKeypadEvents(uint8_t board, bool ok) {
+    trellis.polling = false;
+    if (!ok) {
+      trellis.setOffline(board);
+      return;
+    }
 
-      FastTrellis* t = (FastTrellis*) ((_trelli + row * _cols) + col);
+    uint8_t col = trellis.col, row = trellis.row;
+    keyEventRaw *e = trellis.keyEvents;
+    // Modified here since t->_callbacks is protected
+    TrellisCallbackArray callbacks = trellisArray[row][col].getCallbacks();
+    for (uint8_t i = 0; i < trellis.keyCount; i++) {
+      // call any callbacks associated with the key
+      e[i].bit.NUM = NEO_TRELLIS_SEESAW_KEY(e[i].bit.NUM);
 
-      // From Adafruit_MultiTrellis.read()
-      uint8_t count = t->getKeypadCount();
-      delayMicroseconds(500);
-      if (count > 0) {
-        count = count + 2;
-        keyEventRaw e[count];
-        t->readKeypad(e, count);
-        for (int i = 0; i < count; i++) {
-          // call any callbacks associated with the key
-          e[i].bit.NUM = NEO_TRELLIS_SEESAW_KEY(e[i].bit.NUM);
+      if (e[i].bit.NUM < NEO_TRELLIS_NUM_KEYS &&
+          callbacks[e[i].bit.NUM] != NULL) {
+        // update the event with the multitrellis number
+        keyEvent evt = {e[i].bit.EDGE, e[i].bit.NUM};
+        int x = NEO_TRELLIS_X(e[i].bit.NUM);
+        int y = NEO_TRELLIS_Y(e[i].bit.NUM);
 
-          // Modified here since t->_callbacks is protected
-          TrellisCallbackArray callbacks = t->getCallbacks();
+        x = x + (col << Geometry::BOARD_SHIFT);
+        y = y + (row << Geometry::BOARD_SHIFT);
 
-          if (e[i].bit.NUM < NEO_TRELLIS_NUM_KEYS &&
-              callbacks[e[i].bit.NUM] != NULL) {
-            // update the event with the multitrellis number
-            keyEvent evt = {e[i].bit.EDGE, e[i].bit.NUM};
-            int x = NEO_TRELLIS_X(e[i].bit.NUM);
-            int y = NEO_TRELLIS_Y(e[i].bit.NUM);
+        evt.bit.NUM = y << Geometry::WIDTH_SHIFT | x;
 
-            x = x + col * NEO_TRELLIS_NUM_COLS;
-            y = y + row * NEO_TRELLIS_NUM_ROWS;
+        callbacks[e[i].bit.NUM](evt);
+      }
+    }
+  }
 
-            evt.bit.NUM = y * NEO_TRELLIS_NUM_COLS * _cols + x;
+  void FastMultiTrellis::onShown(uint8_t board, bool ok) {
+    if (!ok)
+      trellis.setOffline(board);
+  }
+
+  void FastMultiTrellis::setColumn(uint8_t x, uint8_t fromY, const uint32_t *colors) {
+    uint8_t boardCol = x >> Geometry::BOARD_SHIFT;
+    uint8_t tileX = x & 3;
+    for (uint8_t y = fromY; y < GRID_HEIGHT; y++)
+      setBoardPixel(y >> Geometry::BOARD_SHIFT, boardCol, NEO_TRELLIS_XY(tileX, y & 3), colors[y]);
+  }
 
-            callbacks[e[i].bit.NUM](evt);
-          }
+  // Boards that don't fit in the queue stay dirty, update() tries them again
+  void FastMultiTrellis::show() {
+    showPending = false;
+    for (uint8_t r = 0; r < Geometry::BOARD_ROWS; r++) {
+      for (uint8_t c = 0; c < Geometry::BOARD_COLS; c++) {
+        // Boards off the bus keep their changes for when they're back
+        if (dirtyFrom[r][c] > dirtyTo[r][c] || ((offline | missing) & boardBit(boardIndex(r, c))))
+          continue;
+        if (!trellisArray[r][c].sendPixels(dirtyFrom[r][c], dirtyTo[r][c], onShown, boardIndex(r, c))) {
+          showPending = true;
+          return;
         }
+        dirtyFrom[r][c] = NEO_TRELLIS_NUM_KEYS;
+        dirtyTo[r][c] = 0;
       }
     }
   }
@@ -27,10 +27,10 @@
 #include <Arduino.h>
 #include <LiquidCrystal.h>
 #include <Adafruit_NeoTrellis.h>
-
-// Size of the NeoTrellis array
-#define TRELLIS_WIDTH 16
-#define TRELLIS_HEIGHT 8
+#include "telemetry.h"
+#include "recorder.h"
+#include "geometry.h"
+#include "twi.h"
 
 // Constants for BPM calculation
 #define TICKS_PER_BEAT 4
@@ -39,11 +39,19 @@
 #define MIN_TEMPO 2
 #define MAX_TEMPO 250
 
+// Tempos are kept in hundredths of a BPM
+#define TEMPO_SCALE 100
+
+// Most key events taken from a board in one poll, the rest wait for the next
+#define KEY_EVENTS_PER_READ 16
+
 // Shorter way to define a color
 #define COLOR(r, g, b) seesaw_NeoPixel::Color((r), (g), (b))
 
 namespace Hardware {
   typedef TrellisCallback (**TrellisCallbackArray)(keyEvent);
+  // Adafruit_MultiTrellis steps through the array as Adafruit_NeoTrellis,
+  // so this can't add data members
   class FastTrellis : public Adafruit_NeoTrellis {
   public:
     FastTrellis(uint8_t addr): Adafruit_NeoTrellis(addr) {}
@@ -51,47 +59,199 @@ namespace Hardware {
     inline TrellisCallbackArray getCallbacks() {
       return _callbacks;
     }
+
+    // Keypad reads go through the Twi queue, false if it was full
+    bool requestKeypadCount(uint8_t *count, Twi::Callback callback, uint8_t tag);
+    bool requestKeypadEvents(keyEventRaw *events, uint8_t count, Twi::Callback callback, uint8_t tag);
+
+    // Only writes the local copy of the pixels, false if it was already
+    // that color. The seesaw library would send every pixel in its own I2C
+    // transaction.
+    inline bool setPixel(uint8_t key, uint32_t color) {
+      uint8_t *p = pixels.getPixels() + key * 3;
+      uint8_t r = color >> 16, g = color >> 8, b = color;
+      if (p[0] == g && p[1] == r && p[2] == b)
+        return false;
+      p[0] = g; // NeoTrellis pixels are GRB
+      p[1] = r;
+      p[2] = b;
+      return true;
+    }
+
+    // Queues pixels from through to in as few writes as the seesaw takes,
+    // then a show that calls back. False with nothing queued if there isn't
+    // room for all of it.
+    bool sendPixels(uint8_t from, uint8_t to, Twi::Callback shown, uint8_t tag);
   };
+  static_assert(sizeof(FastTrellis) == sizeof(Adafruit_NeoTrellis), "FastTrellis can't have data members");
+  extern FastTrellis trellisArray[Geometry::BOARD_ROWS][Geometry::BOARD_COLS];
+
+  // Bit per board, row by row from the top left
+  typedef uint16_t BoardMask;
+  static_assert(Geometry::BOARD_COUNT <= 16, "BoardMask needs a bit per board");
 
   class FastMultiTrellis : public Adafruit_MultiTrellis {
   public:
     FastMultiTrellis(FastTrellis* trellisArray, uint8_t rows, uint8_t cols)
-      : Adafruit_MultiTrellis((Adafruit_NeoTrellis*) trellisArray, rows, cols), row(0), col(0) {};
+      : Adafruit_MultiTrellis((Adafruit_NeoTrellis*) trellisArray, rows, cols), row(0), col(0), polling(false), showPending(false),
+        offline(0), missing(0), retryTime(0), polledThisRound(0), polledLastRound(0), eventTime(0) {
+      memset(pollTimes, 0, sizeof(pollTimes));
+      memset(dirtyFrom, NEO_TRELLIS_NUM_KEYS, sizeof(dirtyFrom));
+      memset(dirtyTo, 0, sizeof(dirtyTo));
+    };
+
+    // Once per loop: finishes transfers, then carries on polling the boards
+    // round-robin and sending pixels a full queue held back
+    void update();
 
-    void read(uint8_t count);
+    // Estimated micros() of the key event being dispatched
+    inline uint32_t getEventTime() { return eventTime; }
+
+    inline void setPixel(uint8_t x, uint8_t y, uint32_t color) {
+      setBoardPixel(y >> Geometry::BOARD_SHIFT, x >> Geometry::BOARD_SHIFT, NEO_TRELLIS_XY(x & 3, y & 3), color);
+    }
+
+    // Rows fromY and down of column x, colors indexed by row
+    void setColumn(uint8_t x, uint8_t fromY, const uint32_t *colors);
+
+    // Sends and shows only the boards with changed pixels
+    void show();
+
+    // A board that didn't start is left out until a restart. One that stops
+    // answering later is asked again now and then, and redrawn when it's back.
+    inline void setMissing(uint8_t boardRow, uint8_t boardCol) { missing |= boardBit(boardIndex(boardRow, boardCol)); }
+    inline BoardMask getMissing() { return missing; }
+    inline BoardMask getOffline() { return offline; }
   private:
     uint8_t row, col;
+
+    // A board is being read, one at a time
+    bool polling;
+    uint8_t keyCount;
+    keyEventRaw keyEvents[KEY_EVENTS_PER_READ];
+    bool showPending;
+
+    BoardMask offline, missing;
+    uint32_t retryTime;
+
+    static inline uint8_t boardIndex(uint8_t boardRow, uint8_t boardCol) { return boardRow * Geometry::BOARD_COLS + boardCol; }
+    static inline BoardMask boardBit(uint8_t board) { return (BoardMask) 1 << board; }
+    void setOffline(uint8_t board);
+    void setOnline(uint8_t board);
+
+    void read();
+    static void onKeypadCount(uint8_t board, bool ok);
+    static void onKeypadEvents(uint8_t board, bool ok);
+    static void onShown(uint8_t board, bool ok);
+
+    // Pixels changed since the last show(), none if from > to
+    uint8_t dirtyFrom[Geometry::BOARD_ROWS][Geometry::BOARD_COLS];
+    uint8_t dirtyTo[Geometry::BOARD_ROWS][Geometry::BOARD_COLS];
+
+    inline void setBoardPixel(uint8_t boardRow, uint8_t boardCol, uint8_t key, uint32_t color) {
+      if (!trellisArray[boardRow][boardCol].setPixel(key, color))
+        return;
+      if (key < dirtyFrom[boardRow][boardCol])
+        dirtyFrom[boardRow][boardCol] = key;
+      if (key > dirtyTo[boardRow][boardCol])
+        dirtyTo[boardRow][boardCol] = key;
+    }
+
+    // Boards are polled round-robin, so an event happened somewhere between
+    // the board's previous poll and the poll that found it. That only holds
+    // if the previous poll was in the last round: a board's first poll, or
+    // its first since coming back online, has nothing recent to go on.
+    uint32_t pollTimes[Geometry::BOARD_ROWS][Geometry::BOARD_COLS];
+    BoardMask polledThisRound, polledLastRound;
+    uint32_t eventTime;
   };
-  extern FastTrellis trellisArray[TRELLIS_HEIGHT / 4][TRELLIS_WIDTH / 4];
   extern FastMultiTrellis trellis;
 
-  extern LiquidCrystal lcd;
+#if TELEMETRY_ENABLED
+  // Times every character written
+  class ProfiledLCD : public LiquidCrystal {
+  public:
+    using LiquidCrystal::LiquidCrystal;
+
+    size_t write(uint8_t value) override {
+      PROBE(PROBE_LCD);
+      return LiquidCrystal::write(value);
+    }
+  };
+  typedef ProfiledLCD LCD;
+#else
+  typedef LiquidCrystal LCD;
+#endif
+  extern LCD lcd;
 
   enum Encoder : uint8_t {
     LEFT = 0,
     RIGHT = 1
   };
+
+  enum ClockSource : uint8_t {
+    CLOCK_SOFTWARE, // Internal tempo, also sent out as MIDI clock
+    CLOCK_HARDWARE, // CLOCK_INTERRUPT pin, also sent out as MIDI clock
+    CLOCK_MIDI      // Slaved to USB-MIDI clock and transport
+  };
   
   void init();
 
   // Outputs
-  inline void setPixel(uint8_t x, uint8_t y, uint32_t color) { trellis.setPixelColor(x, y, color); }
-  inline void updateTrellis() { trellis.show(); }
-  void outputTriggers(uint8_t out);
+  inline void setPixel(uint8_t x, uint8_t y, uint32_t color) { trellis.setPixel(x, y, color); }
+  inline void setColumn(uint8_t x, uint8_t fromY, const uint32_t *colors) { trellis.setColumn(x, fromY, colors); }
+  inline void updateTrellis() {
+    PROBE(PROBE_TRELLIS_SHOW);
+    trellis.show();
+  }
+  // The trigger outputs are a chain of 8 bit shift registers. Each byte of
+  // out goes to one, furthest first, then one latch edge switches all the
+  // outputs together, so a longer chain adds time but no skew.
+  void shiftOutputByte(uint8_t bits);
+  void latchOutputs();
+
+  template<uint8_t Registers, typename Mask>
+  void shiftOutputs(Mask out) {
+    static_assert(Registers >= 1 && Registers <= sizeof(Mask), "The mask has a byte per register");
+    PROBE(PROBE_SHIFT_OUT);
+    for (uint8_t i = Registers; i--; )
+      shiftOutputByte(out >> (i * 8));
+    latchOutputs();
+  }
+
+  // Output 0 is the clock and output y is channel row y
+  inline void outputTriggers(Geometry::RowMask out) {
+    RECORD(EVENT_OUTPUTS, out, micros());
+    shiftOutputs<GRID_ROW_BYTES>(out);
+  }
+
+  // Event times in micros(), for latency compensation. Only valid inside
+  // Controller::onButtonPress/onButtonRelease and onClockRising/onClockFalling.
+  inline uint32_t getButtonEventTime() { return trellis.getEventTime(); }
+  uint32_t getClockEventTime();
+
+  // I2C fault counts and the boards that are off the bus
+  void getFaults(Protocol::FaultImage &image);
 
   // Interrupt handlers
   TrellisCallback buttonCallback(keyEvent event);
   void handleInterrupt();
   void handleClockInterrupt();
 
-  bool isSoftwareClockEnabled();
-  void setSoftwareClockEnabled(bool enabled);
+  ClockSource getClockSource();
+  void setClockSource(ClockSource source);
+  inline bool isSoftwareClockEnabled() { return getClockSource() == CLOCK_SOFTWARE; }
 
-  uint16_t getClockBPM();
-  void setClockBPM(uint16_t bpm);
-  void setClockInterval(uint64_t interval);
+  // Tempo in hundredths of a BPM. A change keeps the clock where it is in
+  // the current phase, so the next edge isn't early or late.
+  uint16_t getClockTempo();
+  void setClockTempo(uint16_t tempo);
+  void setClockInterval(uint32_t beatUs);
   
+  // Scheduler tasks. tickClock() is the only one outputs depend on.
   void tickClock();
+  inline void pollTrellis() { trellis.update(); }
+  void pollEncoders();
 }
 
 #endif
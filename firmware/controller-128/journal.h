@@ -0,0 +1,182 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef journal_h
+#define journal_h
+
+#include <Arduino.h>
+#include "geometry.h"
+
+// Records kept for undo and redo, 3 bytes each (4 with 16 rows)
+#define JOURNAL_RECORDS 64
+
+namespace Journal {
+  enum Flags : uint8_t {
+    TARGET_MASK = 0x0F,
+    KIND_SHIFT = 4,
+    KIND_MASK = 0x70,
+    GROUP_START = 0x80 // First record of a gesture, undo stops here
+  };
+
+  // One change to one byte or row mask. Most kinds store old ^ new, so undo
+  // and redo are the same operation and a record never needs the old value.
+  struct Record {
+    uint8_t target; // GROUP_START | kind << KIND_SHIFT | target id
+    uint8_t index;
+    Geometry::RowMask mask;
+
+    inline uint8_t getTarget() const { return target & TARGET_MASK; }
+    inline uint8_t getKind() const { return (target & KIND_MASK) >> KIND_SHIFT; }
+  };
+
+  // Fixed ring of records. Recording is O(1); when the ring is full the
+  // oldest whole gesture is dropped. A gesture larger than the ring can't be
+  // undone, so it empties the journal rather than keep half of it.
+  struct Ring {
+    Record records[JOURNAL_RECORDS];
+    uint8_t cursor = 0; // Where the next record goes
+    uint8_t undoCount = 0; // Records before cursor
+    uint8_t redoCount = 0; // Records from cursor on
+    uint8_t groupCount = 0; // Records in the gesture being recorded
+    bool groupPending = false;
+    bool overflowed = false;
+    uint8_t gestures = 0; // Counts begin(), for telling if a gesture is still the newest
+
+    // Starts a new gesture, which throws away anything left to redo
+    void begin() {
+      gestures++;
+      redoCount = 0;
+      groupCount = 0;
+      groupPending = true;
+      overflowed = false;
+    }
+
+    void clear() {
+      undoCount = redoCount = groupCount = 0;
+      groupPending = overflowed = false;
+    }
+
+    void record(uint8_t target, uint8_t kind, uint8_t index, Geometry::RowMask mask) {
+      if (!mask || overflowed)
+        return;
+
+      if (undoCount == JOURNAL_RECORDS) {
+        if (groupCount == JOURNAL_RECORDS) {
+          undoCount = 0;
+          overflowed = true;
+          return;
+        }
+        uint8_t oldest = cursor; // The ring is full, so the oldest is under the cursor
+        do {
+          undoCount--;
+          oldest = next(oldest);
+        } while (!(records[oldest].target & GROUP_START));
+      }
+
+      Record *r = &records[cursor];
+      r->target = target | kind << KIND_SHIFT | (groupPending ? GROUP_START : 0);
+      r->index = index;
+      r->mask = mask;
+      groupPending = false;
+      groupCount++;
+      cursor = next(cursor);
+      undoCount++;
+    }
+
+    // Calls apply(record) for each record of the newest gesture, newest
+    // first. Returns false if there was nothing to undo.
+    template<typename F>
+    bool undo(F apply) {
+      if (!undoCount)
+        return false;
+      groupPending = false;
+      Record *r;
+      do {
+        cursor = prev(cursor);
+        undoCount--;
+        redoCount++;
+        r = &records[cursor];
+        apply(*r);
+      } while (!(r->target & GROUP_START));
+      return true;
+    }
+
+    // Calls apply(record) for each record of the next undone gesture, in
+    // the order they were recorded
+    template<typename F>
+    bool redo(F apply) {
+      if (!redoCount)
+        return false;
+      groupPending = false;
+      do {
+        apply(records[cursor]);
+        cursor = next(cursor);
+        undoCount++;
+        redoCount--;
+      } while (redoCount && !(records[cursor].target & GROUP_START));
+      return true;
+    }
+
+    inline uint8_t size() const { return undoCount; }
+
+    // Whether the gesture begun when gestures was newest is what undo
+    // would take back next
+    inline bool isNewest(uint8_t gesture) const {
+      return gesture == gestures && undoCount && !redoCount && !overflowed;
+    }
+
+    // Whether anything left to undo or redo changes the target
+    bool refersTo(uint8_t target) const {
+      return any([target](const Record &r) { return r.getTarget() == target; });
+    }
+
+    // Whether anything left to undo or redo is of the kind
+    bool holds(uint8_t kind) const {
+      return any([kind](const Record &r) { return r.getKind() == kind; });
+    }
+
+  private:
+    template<typename F>
+    bool any(F matches) const {
+      uint8_t i = cursor;
+      for (uint8_t n = 0; n < undoCount; n++) {
+        i = prev(i);
+        if (matches(records[i]))
+          return true;
+      }
+      i = cursor;
+      for (uint8_t n = 0; n < redoCount; n++, i = next(i))
+        if (matches(records[i]))
+          return true;
+      return false;
+    }
+
+    static inline uint8_t next(uint8_t i) { return i + 1 == JOURNAL_RECORDS ? 0 : i + 1; }
+    static inline uint8_t prev(uint8_t i) { return (i ? i : JOURNAL_RECORDS) - 1; }
+  };
+
+  // SRAM taken by the journal, shown on the undo popup
+  static const uint16_t RAM_BYTES = sizeof(Ring);
+}
+
+#endif
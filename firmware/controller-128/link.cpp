@@ -0,0 +1,239 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "link.h"
+#include "protocol.h"
+#include "controller.h"
+#include "telemetry.h"
+#include "recorder.h"
+#include "hardware.h"
+
+#define LINK_BAUD 115200 // Ignored by USB CDC, but kept sensible for other boards
+#define LINK_BYTES_PER_POLL 32
+
+namespace Link {
+  enum ParseState : uint8_t {
+    WAIT_SYNC,
+    READ_TYPE,
+    READ_LENGTH,
+    READ_INDEX,
+    READ_PAYLOAD,
+    READ_CRC_LOW,
+    READ_CRC_HIGH
+  };
+
+  // --- RECEIVE ---
+  ParseState parseState = WAIT_SYNC;
+  uint8_t frameType;
+  uint8_t payloadLeft;
+  uint8_t frameIndex;
+  uint16_t crc;
+  uint16_t receivedCrc;
+
+  // Payloads are unpacked as they arrive, so a frame never needs buffering
+  uint8_t image[Protocol::MAX_IMAGE_SIZE];
+  Protocol::Unpacker unpacker;
+
+  // --- SEND ---
+  int8_t dumpNext = -1; // Next pattern to send, BANK_PATTERNS: the song, -1: not dumping
+  int8_t ackType = -1; // -1: nothing to acknowledge
+  Protocol::Status ackStatus;
+#if TELEMETRY_ENABLED
+  bool telemetryRequested = false;
+#endif
+  bool faultsRequested = false;
+#if RECORDER_ENABLED
+  int8_t recordingNext = -1; // Next chunk to send, -1: not sending
+#endif
+
+  struct CountSink {
+    uint8_t count = 0;
+    inline void operator()(uint8_t) { count++; }
+  };
+
+  struct SerialSink {
+    uint16_t crc = 0xFFFF;
+    inline void operator()(uint8_t b) {
+      Serial.write(b);
+      crc = Protocol::crcUpdate(crc, b);
+    }
+  };
+
+  // Packs the payload twice, once to count it for the header and once to send
+  void sendImage(uint8_t type, int16_t index, const uint8_t *data, uint8_t size) {
+    CountSink counter;
+    Protocol::pack(data, size, counter);
+
+    Serial.write(PROTOCOL_SYNC);
+    SerialSink sink;
+    sink(type);
+    sink(counter.count + (index >= 0));
+    if (index >= 0)
+      sink((uint8_t) index);
+    Protocol::pack(data, size, sink);
+    Serial.write(sink.crc & 0xFF);
+    Serial.write(sink.crc >> 8);
+  }
+
+  void sendAck(uint8_t type, Protocol::Status status) {
+    Serial.write(PROTOCOL_SYNC);
+    SerialSink sink;
+    sink(Protocol::ACK);
+    sink(2);
+    sink(type);
+    sink(status);
+    Serial.write(sink.crc & 0xFF);
+    Serial.write(sink.crc >> 8);
+  }
+
+  void frameComplete() {
+    using namespace Protocol;
+
+    if (crc != receivedCrc) {
+      ackType = frameType;
+      ackStatus = BAD_CRC;
+      return;
+    }
+
+    switch (frameType) {
+      case DUMP:
+        dumpNext = 0;
+        return;
+#if TELEMETRY_ENABLED
+      case TELEMETRY:
+        telemetryRequested = true;
+        return;
+#endif
+      case FAULTS:
+        faultsRequested = true;
+        return;
+#if RECORDER_ENABLED
+      case RECORDING:
+        recordingNext = 0;
+        Recorder::hold(true);
+        return;
+#endif
+      case PATTERN:
+        ackStatus = unpacker.complete() ? Controller::loadPatternImage(frameIndex, image) : BAD_IMAGE;
+        break;
+      case SONG:
+        ackStatus = unpacker.complete() ? Controller::loadSongImage(image) : BAD_IMAGE;
+        break;
+      default:
+        ackStatus = UNKNOWN;
+        break;
+    }
+    ackType = frameType;
+  }
+
+  void receive(uint8_t b) {
+    switch (parseState) {
+      case WAIT_SYNC:
+        if (b == PROTOCOL_SYNC) {
+          crc = 0xFFFF;
+          parseState = READ_TYPE;
+        }
+        return;
+      case READ_TYPE:
+        frameType = b;
+        parseState = READ_LENGTH;
+        break;
+      case READ_LENGTH:
+        payloadLeft = b;
+        unpacker.begin(image, frameType == Protocol::PATTERN ? Protocol::PATTERN_IMAGE_SIZE
+                            : frameType == Protocol::SONG ? Protocol::SONG_IMAGE_SIZE : 0);
+        if (!payloadLeft)
+          parseState = READ_CRC_LOW;
+        else
+          parseState = frameType == Protocol::PATTERN ? READ_INDEX : READ_PAYLOAD;
+        break;
+      case READ_INDEX:
+        frameIndex = b;
+        parseState = --payloadLeft ? READ_PAYLOAD : READ_CRC_LOW;
+        break;
+      case READ_PAYLOAD:
+        unpacker.push(b);
+        if (!--payloadLeft)
+          parseState = READ_CRC_LOW;
+        break;
+      case READ_CRC_LOW:
+        receivedCrc = b;
+        parseState = READ_CRC_HIGH;
+        return;
+      case READ_CRC_HIGH:
+        receivedCrc |= (uint16_t) b << 8;
+        parseState = WAIT_SYNC;
+        frameComplete();
+        return;
+    }
+    crc = Protocol::crcUpdate(crc, b);
+  }
+
+  void init() {
+    Serial.begin(LINK_BAUD);
+  }
+
+  void poll() {
+    PROBE(PROBE_LINK);
+    HIGH_WATER(MARK_SERIAL_RX, min(Serial.available(), 255));
+    for (uint8_t i = 0; i < LINK_BYTES_PER_POLL && Serial.available() > 0; i++)
+      receive(Serial.read());
+
+    if (ackType >= 0) {
+      sendAck(ackType, ackStatus);
+      ackType = -1;
+#if TELEMETRY_ENABLED
+    } else if (telemetryRequested) {
+      const Protocol::TelemetryImage &stats = Telemetry::snapshot();
+      sendImage(Protocol::TELEMETRY, -1, (const uint8_t *) &stats, sizeof(stats));
+      telemetryRequested = false;
+#endif
+    } else if (faultsRequested) {
+      Protocol::FaultImage faults;
+      Hardware::getFaults(faults);
+      sendImage(Protocol::FAULTS, -1, (const uint8_t *) &faults, sizeof(faults));
+      faultsRequested = false;
+#if RECORDER_ENABLED
+    } else if (recordingNext >= 0) {
+      Protocol::Event chunk[RECORDER_CHUNK];
+      Recorder::getChunk(recordingNext, chunk);
+      sendImage(Protocol::RECORDING, recordingNext, (const uint8_t *) chunk, sizeof(chunk));
+      if (++recordingNext == RECORDER_CHUNKS) {
+        recordingNext = -1;
+        Recorder::hold(false);
+      }
+#endif
+    } else if (dumpNext >= 0) {
+      uint8_t out[Protocol::MAX_IMAGE_SIZE];
+      if (dumpNext < Protocol::BANK_PATTERNS) {
+        Controller::getPatternImage(dumpNext, out);
+        sendImage(Protocol::PATTERN, dumpNext, out, Protocol::PATTERN_IMAGE_SIZE);
+        dumpNext++;
+      } else {
+        Controller::getSongImage(out);
+        sendImage(Protocol::SONG, -1, out, Protocol::SONG_IMAGE_SIZE);
+        dumpNext = -1;
+      }
+    }
+  }
+}
@@ -0,0 +1,85 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "midi.h"
+#include <MIDIUSB.h>
+
+// USB-MIDI event packets: cable 0, code index number in the low nibble
+#define CIN_NOTE_OFF 0x08
+#define CIN_NOTE_ON 0x09
+#define CIN_SINGLE_BYTE 0x0F
+
+namespace Midi {
+  // MIDIUSB keeps its endpoint numbers to itself
+  struct Endpoint : MIDI_ {
+    static inline uint8_t tx() { return static_cast<Endpoint &>(MidiUSB).pluggedEndpoint + 1; }
+  };
+
+  bool unflushed = false;
+
+  // USB_Send() waits up to 250 ms for the host to make room, which it never
+  // does while no app has the port open. That would hold up the outputs, so
+  // a packet without room is dropped instead.
+  void send(midiEventPacket_t packet) {
+    if (USB_SendSpace(Endpoint::tx()) < sizeof(packet))
+      return;
+    MidiUSB.sendMIDI(packet);
+    unflushed = true;
+  }
+
+  void sendRealtime(uint8_t status) {
+    send({ CIN_SINGLE_BYTE, status, 0, 0 });
+  }
+
+  void sendNote(uint8_t note, bool on) {
+    if (on)
+      send({ CIN_NOTE_ON, (uint8_t) (0x90 | MIDI_CHANNEL), note, 100 });
+    else
+      send({ CIN_NOTE_OFF, (uint8_t) (0x80 | MIDI_CHANNEL), note, 0 });
+  }
+
+  void flush() {
+    if (!unflushed)
+      return;
+    MidiUSB.flush();
+    unflushed = false;
+  }
+
+  uint8_t readRealtime() {
+    for (;;) {
+      midiEventPacket_t packet = MidiUSB.read();
+      if (!packet.header)
+        return 0;
+      if ((packet.header & 0x0F) != CIN_SINGLE_BYTE)
+        continue;
+      // Active sensing, system reset and the undefined bytes go too
+      switch (packet.byte1) {
+        case CLOCK:
+        case START:
+        case CONTINUE:
+        case STOP:
+          return packet.byte1;
+      }
+    }
+  }
+}
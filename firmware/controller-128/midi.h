@@ -0,0 +1,54 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef midi_h
+#define midi_h
+
+#include <Arduino.h>
+#include "tempo_follower.h"
+
+// Set to 1 to also send each channel's triggers as notes
+#define MIDI_MIRROR_NOTES 0
+#define MIDI_CHANNEL 9 // 0-based, so 10: drums
+#define MIDI_FIRST_NOTE 36 // Row 1, upward
+
+namespace Midi {
+  enum Realtime : uint8_t {
+    CLOCK = 0xF8,
+    START = 0xFA,
+    CONTINUE = 0xFB,
+    STOP = 0xFC
+  };
+
+  // Packets are dropped while the host isn't taking them, rather than wait
+  void sendRealtime(uint8_t status);
+  void sendNote(uint8_t note, bool on);
+  // Sends off what's been queued, if anything
+  void flush();
+
+  // Next clock or transport byte received over USB, 0 if there is none.
+  // Everything else is dropped.
+  uint8_t readRealtime();
+}
+
+#endif
@@ -0,0 +1,287 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef protocol_h
+#define protocol_h
+
+// Wire format of the serial link. Plain C++ with no Arduino dependency, so
+// host tools can include it as is.
+
+#include <stdint.h>
+#include "geometry.h"
+
+// Frame: SYNC, type, payload length, payload, CRC-16 (low byte first) of
+// everything between SYNC and the CRC
+#define PROTOCOL_SYNC 0xA5
+#define PROTOCOL_VERSION 5
+
+namespace Protocol {
+  enum FrameType : uint8_t {
+    DUMP = 'D',    // Host asks for every pattern then the song, no payload
+    PATTERN = 'P', // Pattern index, then the packed pattern image
+    SONG = 'S',    // Packed song image
+    ACK = 'A',     // Device answers a load: frame type, Status
+    TELEMETRY = 'T', // Host asks with no payload, device answers with a packed TelemetryImage
+    FAULTS = 'F',    // Host asks with no payload, device answers with a packed FaultImage
+    RECORDING = 'R'  // Host asks with no payload, device answers with RECORDER_CHUNKS frames
+  };
+
+  enum Status : uint8_t {
+    OK,
+    BAD_CRC,
+    BAD_IMAGE, // Didn't unpack to the right size or failed validation
+    BUSY,      // A song load is still waiting for the pattern boundary, or the
+               // pattern is being paged in from the bank. Send it again.
+    UNKNOWN
+  };
+
+  // Pattern image: length, offset, then state, chance and channel
+  // conditions as stored. Steps stay rotated by offset. Row masks are
+  // GRID_ROW_BYTES each, low byte first, so images only load into a build
+  // of the same geometry.
+  enum PatternImage : uint8_t {
+    PATTERN_LENGTH = 0,
+    PATTERN_OFFSET = 1,
+    PATTERN_STATE = 2,
+    PATTERN_CHANCE = PATTERN_STATE + 32 * GRID_ROW_BYTES,
+    PATTERN_CONDITIONS = PATTERN_CHANCE + 32 * GRID_ROW_BYTES,
+    PATTERN_IMAGE_SIZE = PATTERN_CONDITIONS + GRID_HEIGHT
+  };
+
+  // Song image: length and offset in runs, the runs as stored (pattern << 4 |
+  // repeats - 1), gate mask, tempo (hundredths of a BPM, low byte first),
+  // chance seed (low byte first). A seed of 0 rolls new chances each play,
+  // any other replays that run exactly.
+  enum SongImage : uint8_t {
+    SONG_LENGTH = 0,
+    SONG_OFFSET = 1,
+    SONG_RUNS = 2,
+    SONG_GATES = SONG_RUNS + 32,
+    SONG_TEMPO = SONG_GATES + GRID_ROW_BYTES,
+    SONG_SEED = SONG_TEMPO + 2,
+    SONG_IMAGE_SIZE = SONG_SEED + 4
+  };
+
+  static const uint8_t MAX_IMAGE_SIZE = PATTERN_IMAGE_SIZE;
+
+  // Patterns in the EEPROM bank, each kept as its image: as many as fit in
+  // the 32U4's 1 KB, no more than a song run or the pattern pads can pick
+  #define BANK_EEPROM_BYTES 1024
+  constexpr uint16_t fewest(uint16_t a, uint16_t b) { return a < b ? a : b; }
+  static const uint8_t BANK_PATTERNS = fewest(fewest(BANK_EEPROM_BYTES / PATTERN_IMAGE_SIZE, 16),
+                                              PATTERN_COUNT * PATTERN_COUNT);
+  static_assert(BANK_PATTERNS >= PATTERN_COUNT, "The bank can't fill the pattern pads");
+
+  // Timed sections, see telemetry.h
+  enum Probe : uint8_t {
+    PROBE_BUTTON,       // Controller::onButtonPress/Release
+    PROBE_ENCODER,      // Controller::onEncoderTurn/Press/Release
+    PROBE_CLOCK,        // Controller::onClockRising/Falling
+    PROBE_RESET,        // Controller::onReset
+    PROBE_TICK,         // Controller::tick
+    PROBE_TRELLIS_READ, // One board polled, including its button handlers
+    PROBE_TRELLIS_SHOW,
+    PROBE_LCD,          // One character
+    PROBE_SHIFT_OUT,
+    PROBE_LINK,         // Link::poll
+    PROBE_COUNT
+  };
+
+  // Queues with a high-water mark
+  enum Mark : uint8_t {
+    MARK_INTERRUPT_QUEUE, // Encoder and reset pin snapshots
+    MARK_CLOCK_QUEUE,     // Hardware clock edges
+    MARK_SERIAL_RX,       // Bytes waiting for Link::poll
+    MARK_COUNT
+  };
+
+  // Saturating event counts
+  enum Tally : uint8_t {
+    TALLY_BANK_HIT,   // A pattern was wanted and already in RAM
+    TALLY_BANK_MISS,  // It had to wait to be paged in
+    TALLY_BANK_LOAD,  // Patterns read in from EEPROM
+    TALLY_BANK_WRITE, // Bytes written back
+    TALLY_COUNT
+  };
+
+  // Tasks loop() runs, see scheduler.h
+  enum TaskId : uint8_t {
+    TASK_CLOCK,    // Clock, reset and trigger outputs
+    TASK_TRELLIS,  // Keypad polling and I2C completions, including button handlers
+    TASK_ENCODERS, // Encoder handlers
+    TASK_PIXELS,   // Redrawing changed columns
+    TASK_DISPLAY,  // LCD popups and debug pages
+    TASK_LINK,     // Serial link
+    TASK_BANK,     // Paging patterns in and writing them back to EEPROM
+    TASK_COUNT
+  };
+
+  struct TaskStats {
+    uint16_t missed;   // Ran, or for the clock latched an edge, later than its period allows
+    uint16_t overruns; // Took longer than its budget
+    uint16_t maxMicros;
+  };
+
+  // Loop times are bucketed by power of two, bucket i: [2^i, 2^(i+1)) us
+  #define LOOP_BUCKETS 16
+
+  struct ProbeStats {
+    uint32_t calls;
+    uint32_t cycles; // Total
+    uint32_t maxCycles;
+  };
+
+  // Sent as is, so fixed-width fields only. Both ends are little endian.
+  struct TelemetryImage {
+    uint32_t cpuHz;
+    ProbeStats probes[PROBE_COUNT];
+    uint16_t loopHistogram[LOOP_BUCKETS]; // Saturating counts
+    uint8_t marks[MARK_COUNT];
+    uint16_t stackFree; // Bytes of stack never touched since power on
+    TaskStats tasks[TASK_COUNT]; // Saturating counts
+    uint16_t tallies[TALLY_COUNT];
+  } __attribute__((packed));
+
+  // I2C health, counted since power on and saturating. Board masks have a
+  // bit per Trellis board, row by row from the top left.
+  struct FaultImage {
+    uint16_t nacks;
+    uint16_t busErrors;
+    uint16_t timeouts;      // Bus stuck and cleared
+    uint16_t offlineBoards; // Stopped answering, retried until they do
+    uint16_t missingBoards; // Didn't start, left out until a restart
+  } __attribute__((packed));
+
+  // Flight recorder, see recorder.h. A RECORDING frame is a chunk index then
+  // RECORDER_CHUNK packed Events. Chunks are sent in order and the events in
+  // them go oldest first. Slots not recorded into yet are EVENT_NONE.
+  #define RECORDER_EVENTS 64
+  #define RECORDER_CHUNK 16
+  #define RECORDER_CHUNKS (RECORDER_EVENTS / RECORDER_CHUNK)
+
+  enum EventKind : uint8_t {
+    EVENT_NONE,
+    EVENT_POWER_ON,      // Recorded first, so a recording that has it has everything
+    EVENT_PRESS,         // Value: pad, y * GRID_WIDTH + x
+    EVENT_RELEASE,
+    EVENT_TURN,          // Value: encoder << 7 | detents, 7 bit two's complement
+    EVENT_PUSH,          // Value: encoder
+    EVENT_LET,
+    EVENT_CLOCK_RISING,  // Value: clock source
+    EVENT_CLOCK_FALLING,
+    EVENT_RESET,
+    EVENT_OUTPUTS,       // Value: the outputs latched
+    EVENT_KIND_COUNT
+  };
+
+  // Times are micros() on the device: when the Trellis saw a pad, when a
+  // clock edge was due, and when anything else was handled
+  struct Event {
+    uint32_t time;
+    uint8_t kind;
+    Geometry::RowMask value;
+  } __attribute__((packed));
+
+  // CRC-16/CCITT-FALSE, start from 0xFFFF
+  inline uint16_t crcUpdate(uint16_t crc, uint8_t data) {
+    crc ^= (uint16_t) data << 8;
+    for (uint8_t i = 0; i < 8; i++)
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    return crc;
+  }
+
+  // Images are PackBits encoded: a control byte c < 128 is followed by c + 1
+  // literal bytes, c > 128 by one byte repeated 257 - c times. Mostly empty
+  // patterns shrink to a few bytes. Calls sink(byte) for every packed byte,
+  // so it can count the size first and then send without a buffer.
+  template<typename Sink>
+  void pack(const uint8_t *in, uint8_t len, Sink &sink) {
+    uint8_t i = 0;
+    while (i < len) {
+      uint8_t run = 1;
+      while (i + run < len && run < 128 && in[i + run] == in[i])
+        run++;
+      if (run >= 2) {
+        sink((uint8_t) (257 - run));
+        sink(in[i]);
+        i += run;
+        continue;
+      }
+
+      uint8_t start = i;
+      while (i < len && i - start < 128 && !(i + 1 < len && in[i] == in[i + 1]))
+        i++;
+      sink((uint8_t) (i - start - 1));
+      for (; start < i; start++)
+        sink(in[start]);
+    }
+  }
+
+  // Unpacks one byte at a time, for parsing as bytes arrive
+  struct Unpacker {
+    uint8_t *out;
+    uint8_t size;
+    uint8_t pos;
+    uint8_t count; // Bytes left in the current literal or run, 0: expecting a control byte
+    bool repeat;
+    bool overflow;
+
+    void begin(uint8_t *into, uint8_t intoSize) {
+      out = into;
+      size = intoSize;
+      pos = count = 0;
+      overflow = false;
+    }
+
+    void push(uint8_t b) {
+      if (!count) {
+        repeat = b > 128;
+        count = repeat ? 257 - b : (b < 128 ? b + 1 : 0);
+        return;
+      }
+      if (repeat) {
+        while (count) {
+          put(b);
+          count--;
+        }
+      } else {
+        put(b);
+        count--;
+      }
+    }
+
+    inline bool complete() const {
+      return pos == size && !count && !overflow;
+    }
+
+  private:
+    inline void put(uint8_t b) {
+      if (pos < size)
+        out[pos++] = b;
+      else
+        overflow = true;
+    }
+  };
+}
+
+#endif
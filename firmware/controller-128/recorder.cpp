@@ -0,0 +1,73 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "recorder.h"
+
+#if RECORDER_ENABLED
+
+namespace Recorder {
+  // Zeroed at startup, so unused slots are EVENT_NONE
+  Protocol::Event events[RECORDER_EVENTS];
+  uint8_t next = 0; // Oldest once the ring has wrapped
+  bool held = false;
+  bool frozen = false;
+
+  void init() {
+    record(Protocol::EVENT_POWER_ON, 0, micros());
+  }
+
+  void record(uint8_t kind, Geometry::RowMask value, uint32_t time) {
+    uint8_t sreg = SREG;
+    cli();
+    if (!held && !frozen) {
+      Protocol::Event &event = events[next];
+      event.time = time;
+      event.kind = kind;
+      event.value = value;
+      next = next + 1 == RECORDER_EVENTS ? 0 : next + 1;
+    }
+    SREG = sreg;
+  }
+
+  void hold(bool _held) {
+    held = _held;
+  }
+
+  void freeze(bool _frozen) {
+    frozen = _frozen;
+  }
+
+  bool isFrozen() {
+    return frozen;
+  }
+
+  // Until the ring wraps, the slots from next on are still empty and come
+  // out first, which a reader skips
+  void getChunk(uint8_t chunk, Protocol::Event *out) {
+    uint8_t i = next + chunk * RECORDER_CHUNK;
+    for (uint8_t n = 0; n < RECORDER_CHUNK; n++, i++)
+      out[n] = events[i % RECORDER_EVENTS];
+  }
+}
+
+#endif
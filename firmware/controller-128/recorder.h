@@ -0,0 +1,66 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef recorder_h
+#define recorder_h
+
+#include <Arduino.h>
+#include "protocol.h"
+
+// Set to 1 here or with -DRECORDER_ENABLED=1 to build in the flight recorder:
+// the last RECORDER_EVENTS inputs and output latches, kept in RAM (7 bytes each
+// with 16 rows, 6 with 8) and read with `c128link record`. At 0 RECORD compiles
+// to nothing.
+#ifndef RECORDER_ENABLED
+#define RECORDER_ENABLED 0
+#endif
+
+#if RECORDER_ENABLED
+  #define RECORD(kind, value, time) Recorder::record(Protocol::kind, value, time)
+#else
+  #define RECORD(kind, value, time)
+#endif
+
+#if RECORDER_ENABLED
+// A ring that always holds the newest events. Recording is O(1) and safe
+// from an interrupt.
+namespace Recorder {
+  // Starts the ring with EVENT_POWER_ON
+  void init();
+
+  void record(uint8_t kind, Geometry::RowMask value, uint32_t time);
+
+  // A held ring keeps still for a dump, anything recorded meanwhile is lost
+  void hold(bool held);
+
+  // A frozen ring keeps what led up to the freeze until it's thawed, so an
+  // incident isn't overwritten before someone gets to dump it
+  void freeze(bool frozen);
+  bool isFrozen();
+
+  // Chunk of the ring, oldest first
+  void getChunk(uint8_t chunk, Protocol::Event *out);
+}
+#endif
+
+#endif
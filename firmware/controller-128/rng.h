@@ -0,0 +1,78 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef rng_h
+#define rng_h
+
+#include <Arduino.h>
+
+#define RNG_DEFAULT_SEED 0x2545F491UL
+
+namespace Rng {
+  // Marsaglia xorshift32. Every draw is three shifts and three xors, and
+  // range reduction is a multiply instead of a modulo, so the cost is fixed
+  // no matter the range. Safe to call from clock edge handlers.
+  struct Generator {
+    uint32_t state;
+
+    Generator(uint32_t seed = RNG_DEFAULT_SEED) {
+      setSeed(seed);
+    }
+
+    // The whole state is the seed, so saving it and setting it back later
+    // replays the exact same sequence of draws
+    inline uint32_t getSeed() const {
+      return state;
+    }
+
+    inline void setSeed(uint32_t seed) {
+      // Zero is the one state xorshift can never leave
+      state = seed ? seed : RNG_DEFAULT_SEED;
+    }
+
+    inline uint32_t next() {
+      uint32_t x = state;
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      state = x;
+      return x;
+    }
+
+    // Uniform value in [0, n), or 0 if n is 0
+    inline uint16_t below(uint16_t n) {
+      return ((uint32_t) (uint16_t) next() * n) >> 16;
+    }
+
+    // Uniform byte, for comparing against 8-bit thresholds
+    inline uint8_t byte() {
+      return next() >> 24;
+    }
+
+    inline bool bit() {
+      return (next() >> 31) != 0;
+    }
+  };
+}
+
+#endif
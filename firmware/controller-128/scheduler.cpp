@@ -0,0 +1,122 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "scheduler.h"
+
+namespace Scheduler {
+  Task *tasks;
+  uint8_t taskCount;
+  uint32_t passStart;
+  Task *running = NULL;
+
+  void init(Task *_tasks, uint8_t count) {
+    tasks = _tasks;
+    taskCount = count;
+    uint32_t now = micros();
+    for (uint8_t i = 0; i < count; i++)
+      tasks[i].lastRun = now;
+  }
+
+  inline void count(uint16_t &counter) {
+    if (counter < 0xFFFF)
+      counter++;
+  }
+
+  void start(Task &task) {
+    uint32_t begin = micros();
+    if (begin - task.lastRun > task.period)
+      count(task.missed);
+
+    running = &task;
+    task.run();
+    running = NULL;
+
+    uint32_t elapsed = micros() - begin;
+    task.lastRun = begin;
+    task.ran = true;
+    if (elapsed > task.budget)
+      count(task.overruns);
+    if (elapsed > task.maxTime)
+      task.maxTime = min(elapsed, 0xFFFFUL);
+  }
+
+  // The task of this priority still to run this pass that's closest to its
+  // deadline, out of the ones that fit or are already late
+  Task *pick(Priority priority) {
+    uint32_t now = micros();
+    uint16_t room = left();
+    Task *best = NULL;
+    int32_t bestSlack = 0;
+    for (uint8_t i = 0; i < taskCount; i++) {
+      Task &task = tasks[i];
+      if (task.priority != priority || task.ran)
+        continue;
+      int32_t slack = (int32_t) (task.lastRun + task.period - now);
+      if (slack > 0 && task.budget > room)
+        continue;
+      if (!best || slack < bestSlack) {
+        best = &task;
+        bestSlack = slack;
+      }
+    }
+    return best;
+  }
+
+  void runCritical() {
+    for (uint8_t i = 0; i < taskCount; i++)
+      if (tasks[i].priority == CRITICAL)
+        start(tasks[i]);
+  }
+
+  // A clock edge that comes due during a slow task waits for that task
+  // alone, not for everything after it in the pass
+  void run() {
+    passStart = micros();
+    for (uint8_t i = 0; i < taskCount; i++)
+      tasks[i].ran = false;
+
+    for (;;) {
+      runCritical();
+      Task *task = pick(NORMAL);
+      if (!task)
+        task = pick(IDLE);
+      if (!task)
+        return;
+      start(*task);
+    }
+  }
+
+  uint16_t left() {
+    uint32_t used = micros() - passStart;
+    return used >= SCHEDULER_PASS_US ? 0 : SCHEDULER_PASS_US - used;
+  }
+
+  void due(uint32_t time) {
+    if (running && micros() - time > running->period)
+      count(running->missed);
+  }
+
+  const Task &getTask(uint8_t index) {
+    return tasks[index];
+  }
+}
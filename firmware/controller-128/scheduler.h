@@ -0,0 +1,77 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef scheduler_h
+#define scheduler_h
+
+#include <Arduino.h>
+
+// Critical tasks come round again this often, unless another task runs over
+#define SCHEDULER_PASS_US 1000
+
+// Cooperative tasks for loop(). Each pass runs every other task at most
+// once, most urgent first, if its budget fits in what's left of the pass, and
+// the critical tasks before each of them. A task past its deadline runs even
+// without room, so nothing starves, and the miss is counted.
+namespace Scheduler {
+  enum Priority : uint8_t {
+    CRITICAL, // Every pass, first and between every other task
+    NORMAL,   // Share the rest of the pass
+    IDLE      // Only what NORMAL leaves
+  };
+
+  struct Task {
+    void (*run)();
+    Priority priority;
+    uint16_t period; // us it can go without running before it's a miss
+    uint16_t budget; // us it's expected to take
+
+    // Kept by the scheduler, counts saturate
+    uint32_t lastRun;
+    bool ran; // This pass
+    uint16_t missed;
+    uint16_t overruns;
+    uint16_t maxTime;
+
+    Task(void (*_run)(), Priority _priority, uint16_t _period, uint16_t _budget)
+      : run(_run), priority(_priority), period(_period), budget(_budget),
+        lastRun(0), ran(false), missed(0), overruns(0), maxTime(0) {}
+  };
+
+  void init(Task *tasks, uint8_t count);
+
+  // One pass, from loop()
+  void run();
+
+  // us left in this pass, for tasks that do their work in pieces
+  uint16_t left();
+
+  // For the running task to say when the work it just did was due. Done more
+  // than the task's period late, it counts as a miss, as does the task going
+  // that long without running at all.
+  void due(uint32_t time);
+
+  const Task &getTask(uint8_t index);
+}
+
+#endif
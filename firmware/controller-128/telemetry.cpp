@@ -0,0 +1,123 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "telemetry.h"
+#include "scheduler.h"
+
+#if TELEMETRY_ENABLED
+
+#define STACK_PAINT 0xC5
+
+extern uint8_t _end;
+extern uint8_t __heap_start;
+extern char *__brkval;
+
+// Fills all free RAM before main() runs, so later scans can see how deep the
+// stack has ever gone. Runs before the stack pointer is in use by C code.
+void paintStack() __attribute__((naked, used, section(".init3")));
+void paintStack() {
+  for (uint8_t *p = &_end; p <= (uint8_t *) RAMEND; p++)
+    *p = STACK_PAINT;
+}
+
+namespace Telemetry {
+  Protocol::TelemetryImage stats;
+  volatile uint16_t timerOverflows = 0;
+  uint32_t prevLoop = 0;
+
+  void init() {
+    reset();
+
+    // Timer1 free running at the CPU clock, overflows extend it to 32 bits
+    TCCR1A = 0;
+    TCCR1B = _BV(CS10);
+    TCNT1 = 0;
+    TIMSK1 = _BV(TOIE1);
+  }
+
+  void reset() {
+    memset(&stats, 0, sizeof(stats));
+    stats.cpuHz = F_CPU;
+    prevLoop = micros();
+  }
+
+  uint32_t cycles() {
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t low = TCNT1;
+    uint16_t high = timerOverflows;
+    // Overflowed since interrupts went off, but the ISR hasn't run yet
+    if ((TIFR1 & _BV(TOV1)) && low < 0x8000)
+      high++;
+    SREG = sreg;
+    return (uint32_t) high << 16 | low;
+  }
+
+  void record(uint8_t probe, uint32_t elapsed) {
+    // Indexed in place: the image is packed, so no pointers into it
+    stats.probes[probe].calls++;
+    stats.probes[probe].cycles += elapsed;
+    if (elapsed > stats.probes[probe].maxCycles)
+      stats.probes[probe].maxCycles = elapsed;
+  }
+
+  void loopTick() {
+    uint32_t now = micros();
+    uint32_t elapsed = now - prevLoop;
+    prevLoop = now;
+
+    uint8_t bucket = 0;
+    while (elapsed > 1 && bucket < LOOP_BUCKETS - 1) {
+      elapsed >>= 1;
+      bucket++;
+    }
+    if (stats.loopHistogram[bucket] != 0xFFFF)
+      stats.loopHistogram[bucket]++;
+  }
+
+  // Free stack is the run of untouched paint between the heap and the deepest the stack got
+  uint16_t scanStack() {
+    uint8_t *p = __brkval ? (uint8_t *) __brkval : &__heap_start;
+    uint16_t untouched = 0;
+    while (p <= (uint8_t *) RAMEND && *p++ == STACK_PAINT)
+      untouched++;
+    return untouched;
+  }
+
+  const Protocol::TelemetryImage &snapshot() {
+    stats.stackFree = scanStack();
+    for (uint8_t i = 0; i < Protocol::TASK_COUNT; i++) {
+      const Scheduler::Task &task = Scheduler::getTask(i);
+      stats.tasks[i].missed = task.missed;
+      stats.tasks[i].overruns = task.overruns;
+      stats.tasks[i].maxMicros = task.maxTime;
+    }
+    return stats;
+  }
+}
+
+ISR(TIMER1_OVF_vect) {
+  Telemetry::timerOverflows++;
+}
+
+#endif
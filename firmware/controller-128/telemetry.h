@@ -0,0 +1,88 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef telemetry_h
+#define telemetry_h
+
+#include <Arduino.h>
+#include "protocol.h"
+
+// Set to 1 here or with -DTELEMETRY_ENABLED=1 to build in profiling. Timer1 is
+// taken over as a cycle counter, and the stats are read with `c128link stats`
+// or on the LCD debug page (hold settings, press clear). At 0 every macro
+// below compiles to nothing.
+#ifndef TELEMETRY_ENABLED
+#define TELEMETRY_ENABLED 0
+#endif
+
+#if TELEMETRY_ENABLED
+  // Times the rest of the enclosing scope
+  #define PROBE(probe) Telemetry::Scope telemetryScope(Protocol::probe)
+  #define HIGH_WATER(mark, value) Telemetry::highWater(Protocol::mark, value)
+  #define TALLY(event) Telemetry::tally(Protocol::event)
+  // Call once per loop()
+  #define LOOP_TIMED() Telemetry::loopTick()
+#else
+  #define PROBE(probe)
+  #define HIGH_WATER(mark, value)
+  #define TALLY(event)
+  #define LOOP_TIMED()
+#endif
+
+#if TELEMETRY_ENABLED
+namespace Telemetry {
+  void init();
+
+  // CPU cycles since init(), wraps after about 4.5 minutes at 16 MHz
+  uint32_t cycles();
+
+  void record(uint8_t probe, uint32_t elapsed);
+  void loopTick();
+
+  // Current stats, with the stack scanned again
+  const Protocol::TelemetryImage &snapshot();
+  void reset();
+
+  struct Scope {
+    uint8_t probe;
+    uint32_t start;
+
+    Scope(uint8_t p): probe(p), start(cycles()) {}
+    ~Scope() { record(probe, cycles() - start); }
+  };
+
+  extern Protocol::TelemetryImage stats;
+
+  inline void highWater(uint8_t mark, uint8_t value) {
+    if (value > stats.marks[mark])
+      stats.marks[mark] = value;
+  }
+
+  inline void tally(uint8_t tally) {
+    if (stats.tallies[tally] != 0xFFFF)
+      stats.tallies[tally]++;
+  }
+}
+#endif
+
+#endif
@@ -0,0 +1,115 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef tempo_follower_h
+#define tempo_follower_h
+
+// Plain C++ with no Arduino dependency, so it can be exercised on a host
+
+#include <stdint.h>
+
+// MIDI clock is 24 ticks per quarter note, and a beat is TICKS_PER_BEAT
+// steps of two clock phases each
+#define MIDI_TICKS_PER_PHASE 3
+
+// Edges are scheduled this long after the smoothed tick times, so ticks read
+// off USB up to this early or late still give evenly spaced edges
+#define FOLLOWER_LATENCY_US 2000
+
+namespace Midi {
+  // Turns MIDI clock ticks, timestamped when they were read, into evenly
+  // spaced clock phase edges. The tick period is smoothed, edges run off it,
+  // and each phase's first tick only nudges the schedule a quarter of the
+  // way, so USB polling jitter mostly disappears. Edges never get ahead of
+  // the ticks that start their phase.
+  struct TempoFollower {
+    uint32_t tickPeriod16 = 0; // Smoothed tick period, micros * 16
+    uint32_t lastTick = 0;
+    uint32_t nextEdge = 0; // When the next edge is due
+    uint8_t tickInPhase = 0;
+    uint8_t pendingEdges = 0; // Phases started by ticks but not emitted yet
+    uint8_t intervals = 0; // Tick intervals seen since reset, counts up to 2
+    bool scheduled = false; // nextEdge was predicted from the previous edge
+
+    // On MIDI start or continue, the next tick starts a phase
+    void reset() {
+      tickInPhase = 0;
+      pendingEdges = 0;
+      intervals = 0;
+      scheduled = false;
+    }
+
+    inline uint32_t getPhasePeriod() const {
+      return (tickPeriod16 * MIDI_TICKS_PER_PHASE) >> 4;
+    }
+
+    void tick(uint32_t time) {
+      if (intervals) {
+        uint32_t interval16 = (time - lastTick) << 4;
+        if (intervals == 1)
+          tickPeriod16 = interval16;
+        else
+          tickPeriod16 += (int32_t) (interval16 - tickPeriod16) >> 3;
+      }
+      if (intervals < 2)
+        intervals++;
+      lastTick = time;
+
+      if (tickInPhase == 0) {
+        uint32_t due = time + FOLLOWER_LATENCY_US;
+        int32_t error = due - nextEdge;
+        int32_t limit = getPhasePeriod() / 2;
+        if (pendingEdges) {
+          // Behind already, poll() is catching up
+        } else if (!scheduled || error > limit || error < -limit) {
+          nextEdge = due;
+        } else {
+          nextEdge += error / 4;
+        }
+        pendingEdges++;
+      }
+      if (++tickInPhase >= MIDI_TICKS_PER_PHASE)
+        tickInPhase = 0;
+    }
+
+    // True if an edge is due by now, with the time it was due
+    bool poll(uint32_t now, uint32_t &edgeTime) {
+      if (!pendingEdges || (int32_t) (now - nextEdge) < 0)
+        return false;
+
+      edgeTime = nextEdge;
+      pendingEdges--;
+      if (pendingEdges) {
+        // More phases have started than were emitted, catch up right away
+        nextEdge = now;
+        scheduled = false;
+      } else {
+        nextEdge += getPhasePeriod();
+        scheduled = intervals >= 2;
+      }
+      return true;
+    }
+  };
+}
+
+#endif
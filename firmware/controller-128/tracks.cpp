@@ -0,0 +1,517 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+// The track sequencer from controller-128-no-clock, as an engine on the
+// shared Hardware layer. Each row below the control row is a free-running
+// track of up to 64 steps with its own length, reset phase and arp. Clock
+// and reset come in through the Hardware interrupts and all outputs latch
+// together in one shift register write.
+
+#include "controller.h"
+#if CONTROLLER_ENGINE == ENGINE_TRACKS
+#include "rng.h"
+#include "telemetry.h"
+#include "geometry.h"
+
+#define TRACK_SIZE 64 // One bit per step
+#define TRACK_COUNT (GRID_HEIGHT - 1)
+#define DEFAULT_TRACK_LEN 16
+#define VIEW_PAGE_COUNT (TRACK_SIZE / GRID_WIDTH)
+#define RESEED_HOLD_MS 1000 // Holding reset this long rolls a new arp seed
+
+namespace Controller {
+  using namespace Geometry;
+
+  static_assert(GRID_WIDTH == 16, "The track engine's control row needs 16 pads");
+
+  enum Arp : uint8_t {
+    ARP_UP,
+    ARP_DOWN,
+    ARP_UP_DOWN,
+    ARP_REPEAT_LAST, // Up and down, playing both ends twice
+    ARP_RANDOM,      // Any step but the current one
+    ARP_RANDOM_WALK,
+    ARP_WRAPPING_WALK,
+    ARP_WRAPPING_WALK_RIGHT, // Steps right 60% of the time
+    ARP_COUNT
+  };
+
+  // Padded to the width they take on the LCD
+  static const char ARP_NAMES[ARP_COUNT][9] PROGMEM = {
+    "Up      ", "Down    ", "Up-down ", "Repeat  ", "Random  ", "Walk    ", "Wrap    ", "Wrap>   "
+  };
+
+  // Control row, left to right
+  enum TrackControl : uint8_t {
+    TRACK_CLOCK,
+    TRACK_RESET,
+    TRACK_CLEAR,
+    TRACK_PHASE_DOWN,
+    TRACK_PHASE_UP,
+    TRACK_LENGTH_DOWN,
+    TRACK_LENGTH_UP,
+    TRACK_ARP_DOWN,
+    TRACK_ARP_UP,
+    TRACK_FOCUS,
+    TRACK_FOCUS_DOWN,
+    TRACK_FOCUS_UP,
+    TRACK_EUCLID,
+    TRACK_COPY,
+    TRACK_VIEW_DOWN,
+    TRACK_VIEW_UP
+  };
+
+  // --- COLORS ---
+  static const uint32_t HIGHLIGHTED = COLOR(107, 174, 214);
+  static const uint32_t SELECTED    = COLOR( 66, 146, 198);
+  static const uint32_t PRESSED     = COLOR( 33, 113, 181);
+  static const uint32_t DESELECTED  = COLOR(  8,  48, 107);
+  static const uint32_t OFF         = COLOR(  0,   0,   1);
+
+  // The focused track
+  static const uint32_t FOCUS_HIGHLIGHTED = COLOR(102, 194, 164);
+  static const uint32_t FOCUS_SELECTED    = COLOR( 65, 174, 118);
+  static const uint32_t FOCUS_DESELECTED  = COLOR(  0,  68,  27);
+
+  static const uint32_t VIEW_PAGES[VIEW_PAGE_COUNT] = {
+    COLOR(255, 255, 178), COLOR(254, 204, 92), COLOR(253, 141, 60), COLOR(240, 59, 32)
+  };
+
+  // Reseeded on reset, so random arps replay exactly until reset is held
+  // for a new seed
+  Rng::Generator arpRandom;
+  uint32_t arpSeed = RNG_DEFAULT_SEED;
+  uint32_t resetPressTime = 0;
+
+  // --- TRACKS ---
+  inline uint64_t stepsBelow(uint8_t length) {
+    return length >= TRACK_SIZE ? ~(uint64_t) 0 : ((uint64_t) 1 << length) - 1;
+  }
+
+  struct Track {
+    uint64_t steps = 0; // Step i is bit i
+    uint8_t length = DEFAULT_TRACK_LEN;
+    int8_t current = 0; // Step playing
+    uint8_t phase = 0;  // Step that reset goes back to
+    uint8_t arp = ARP_UP;
+    int8_t direction = 1; // Of the up-down arps
+
+    inline bool get(uint8_t i) const {
+      return (steps >> i) & 1;
+    }
+
+    inline void set(uint8_t i, bool on) {
+      uint64_t bit = (uint64_t) 1 << i;
+      if (on)
+        steps |= bit;
+      else
+        steps &= ~bit;
+    }
+
+    inline void toggle(uint8_t i) {
+      steps ^= (uint64_t) 1 << i;
+    }
+
+    void step() {
+      int8_t last = length - 1;
+      switch (arp) {
+        case ARP_UP:
+          if (++current > last)
+            current = 0;
+          break;
+
+        case ARP_DOWN:
+          if (--current < 0)
+            current = last;
+          break;
+
+        case ARP_UP_DOWN:
+          if (direction > 0) {
+            if (++current >= last) {
+              direction = -1;
+              current = last;
+            }
+          } else if (--current <= 0) {
+            direction = 1;
+            current = 0;
+          }
+          break;
+
+        case ARP_REPEAT_LAST:
+          if (direction > 0) {
+            if (++current > last) {
+              direction = -1;
+              current = last;
+            }
+          } else if (--current < 0) {
+            direction = 1;
+            current = 0;
+          }
+          break;
+
+        case ARP_RANDOM:
+          // Draw from the other length - 1 steps, then skip over current
+          if (length > 1) {
+            int8_t next = arpRandom.below(length - 1);
+            current = next >= current ? next + 1 : next;
+          }
+          break;
+
+        case ARP_RANDOM_WALK:
+          if (arpRandom.bit()) {
+            if (++current > last)
+              current = last;
+          } else if (--current < 0) {
+            current = 0;
+          }
+          break;
+
+        case ARP_WRAPPING_WALK:
+        case ARP_WRAPPING_WALK_RIGHT:
+          if (arp == ARP_WRAPPING_WALK ? arpRandom.bit() : arpRandom.below(100) < 60) {
+            if (++current > last)
+              current = 0;
+          } else if (--current < 0) {
+            current = last;
+          }
+          break;
+      }
+    }
+
+    inline void reset() {
+      current = phase;
+    }
+
+    inline void clear() {
+      steps &= ~stepsBelow(length);
+    }
+
+    void phaseDown() { phase = phase ? phase - 1 : length - 1; }
+    void phaseUp() { phase = phase + 1 < length ? phase + 1 : 0; }
+    void arpDown() { arp = arp ? arp - 1 : ARP_COUNT - 1; }
+    void arpUp() { arp = arp + 1 < ARP_COUNT ? arp + 1 : 0; }
+
+    void lengthDown() {
+      if (length > 1)
+        length--;
+      if (phase >= length)
+        phase = length - 1;
+    }
+
+    void lengthUp() {
+      if (length < TRACK_SIZE)
+        length++;
+    }
+
+    // Copies width steps from one place to another, growing the track to fit
+    void copy(int8_t from, int8_t width, int8_t to) {
+      if (to + width > length)
+        length = min(to + width, TRACK_SIZE);
+      for (int8_t i = 0; i < width && to + i < length; i++)
+        set(to + i, get(from + i));
+    }
+
+    // Spreads pulses over the track, the first on step 0
+    void euclid(uint8_t pulses) {
+      if (pulses == 0) {
+        clear();
+        return;
+      }
+      if (pulses >= length) {
+        steps |= stepsBelow(length);
+        return;
+      }
+
+      uint8_t x = 0;
+      uint8_t pauses = length - pulses;
+      if (pauses >= pulses) {
+        // Each pulse followed by its share of the pauses
+        uint8_t per = pauses / pulses, rem = pauses % pulses;
+        for (uint8_t i = 0; i < pulses; i++) {
+          set(x++, true);
+          for (uint8_t j = 0; j < per + (i < rem); j++)
+            set(x++, false);
+        }
+      } else {
+        // Each pause preceded by one pulse and followed by the rest
+        uint8_t per = (pulses - pauses) / pauses, rem = (pulses - pauses) % pauses;
+        for (uint8_t i = 0; i < pauses; i++) {
+          set(x++, true);
+          set(x++, false);
+          for (uint8_t j = 0; j < per + (i < rem); j++)
+            set(x++, true);
+        }
+      }
+    }
+  };
+
+  Track tracks[TRACK_COUNT];
+
+  // --- VIEW ---
+  bool focusMode = false; // Edits go to the focused track only
+  uint8_t focusIndex = 0;
+  uint8_t view = 0; // First step shown
+  uint8_t euclidPulses = 1;
+
+  RowMask dirtyRows = (RowMask) ~(RowMask) 1;
+  bool controlsChanged = false;
+
+  inline void setControlPixel(uint8_t control, uint32_t color) {
+    Hardware::setPixel(control, 0, color);
+    controlsChanged = true;
+  }
+
+  inline void redrawTracks() {
+    dirtyRows = (RowMask) ~(RowMask) 1;
+  }
+
+  void drawTrack(uint8_t y) {
+    const Track &track = tracks[y - 1];
+    bool focused = focusMode && focusIndex == y - 1;
+    for (uint8_t x = 0; x < GRID_WIDTH; x++) {
+      uint8_t i = view + x;
+      uint32_t color;
+      if (i == track.current)
+        color = focused ? FOCUS_HIGHLIGHTED : HIGHLIGHTED;
+      else if (i >= track.length)
+        color = OFF;
+      else if (track.get(i))
+        color = focused ? FOCUS_SELECTED : SELECTED;
+      else
+        color = focused ? FOCUS_DESELECTED : DESELECTED;
+      Hardware::setPixel(x, y, color);
+    }
+  }
+
+  void updateLCD() {
+    const Track &track = tracks[focusMode ? focusIndex : 0];
+    Hardware::lcd.setCursor(0, 0);
+    if (focusMode) {
+      Hardware::lcd.print(F("Track "));
+      Hardware::lcd.print(focusIndex + 1);
+      Hardware::lcd.print(F("        "));
+    } else {
+      Hardware::lcd.print(F("All tracks      "));
+    }
+
+    Hardware::lcd.setCursor(0, 1);
+    Hardware::lcd.print((const __FlashStringHelper *) ARP_NAMES[track.arp]);
+    Hardware::lcd.print(F("Len "));
+    Hardware::lcd.print(track.length);
+    Hardware::lcd.print(F("  "));
+  }
+
+  // Edits the focused track, or every track outside focus mode
+  void editTracks(void (Track::*edit)()) {
+    for (uint8_t i = 0; i < TRACK_COUNT; i++)
+      if (!focusMode || i == focusIndex)
+        (tracks[i].*edit)();
+    redrawTracks();
+    updateLCD();
+  }
+
+  void euclidTracks() {
+    for (uint8_t i = 0; i < TRACK_COUNT; i++)
+      if (!focusMode || i == focusIndex)
+        tracks[i].euclid(euclidPulses % tracks[i].length);
+    euclidPulses++;
+    redrawTracks();
+  }
+
+  // Copies the page in view onto the next one, on every track
+  void copyView() {
+    for (uint8_t i = 0; i < TRACK_COUNT; i++) {
+      int8_t width = min(tracks[i].length - view, GRID_WIDTH);
+      tracks[i].copy(view, width, view + width);
+    }
+    redrawTracks();
+    updateLCD();
+  }
+
+  void init() {
+    Hardware::setClockSource(Hardware::CLOCK_HARDWARE);
+    arpRandom.setSeed(arpSeed);
+    for (uint8_t x = 0; x < GRID_WIDTH; x++)
+      setControlPixel(x, OFF);
+    updateLCD();
+  }
+
+  void tick() {
+    for (uint8_t y = 1; y < GRID_HEIGHT; y++)
+      if (dirtyRows & rowBit(y))
+        drawTrack(y);
+
+    if (dirtyRows || controlsChanged)
+      Hardware::updateTrellis();
+    dirtyRows = 0;
+    controlsChanged = false;
+  }
+
+  // The LCD is written as things change
+  void tickDisplay() {}
+
+  // Tracks aren't kept in EEPROM
+  void tickBank() {}
+
+
+  // Output 1 is the clock, like the pattern engine, then one per track
+  void onClockRising() {
+    PROBE(PROBE_CLOCK);
+    RowMask outputs = 1;
+    for (uint8_t i = 0; i < TRACK_COUNT; i++) {
+      tracks[i].step();
+      if (tracks[i].get(tracks[i].current))
+        outputs |= rowBit(i + 1);
+    }
+    Hardware::outputTriggers(outputs);
+
+    setControlPixel(TRACK_CLOCK, SELECTED);
+    redrawTracks();
+  }
+
+  void onClockFalling() {
+    PROBE(PROBE_CLOCK);
+    Hardware::outputTriggers(0);
+    setControlPixel(TRACK_CLOCK, OFF);
+  }
+
+  void onReset() {
+    for (uint8_t i = 0; i < TRACK_COUNT; i++)
+      tracks[i].reset();
+    arpRandom.setSeed(arpSeed);
+    redrawTracks();
+  }
+
+  // How long reset was held is a random number of microseconds
+  void reseedArps() {
+    arpSeed = Rng::Generator(arpSeed ^ micros()).next();
+    Hardware::lcd.setCursor(0, 0);
+    Hardware::lcd.print(F("Arp     "));
+    for (int8_t shift = 28; shift >= 0; shift -= 4) {
+      uint8_t digit = arpSeed >> shift & 0xF;
+      Hardware::lcd.print((char) (digit < 10 ? '0' + digit : 'A' + digit - 10));
+    }
+  }
+
+  void onTransportStart(bool rewind) {
+    if (rewind)
+      onReset();
+  }
+
+  void onTransportStop() {
+    Hardware::outputTriggers(0);
+  }
+
+  void onButtonPress(uint8_t x, uint8_t y) {
+    if (y > 0) {
+      tracks[y - 1].toggle(view + x);
+      dirtyRows |= rowBit(y);
+      return;
+    }
+
+    if (x == TRACK_VIEW_DOWN || x == TRACK_VIEW_UP) {
+      int8_t page = view / GRID_WIDTH + (x == TRACK_VIEW_UP ? 1 : -1);
+      setControlPixel(x, VIEW_PAGES[constrain(page, 0, VIEW_PAGE_COUNT - 1)]);
+      return;
+    }
+
+    setControlPixel(x, PRESSED);
+    if (x == TRACK_RESET)
+      resetPressTime = millis();
+    if (x == TRACK_CLOCK)
+      onClockRising();
+    if (x == TRACK_FOCUS) {
+      focusMode = !focusMode;
+      redrawTracks();
+      updateLCD();
+    }
+  }
+
+  void onButtonRelease(uint8_t x, uint8_t y) {
+    if (y > 0)
+      return;
+
+    setControlPixel(x, x == TRACK_FOCUS && focusMode ? SELECTED : OFF);
+    switch (x) {
+      case TRACK_CLOCK:       onClockFalling(); break;
+      case TRACK_RESET:
+        if (millis() - resetPressTime >= RESEED_HOLD_MS)
+          reseedArps();
+        onReset();
+        break;
+      case TRACK_CLEAR:       editTracks(&Track::clear); break;
+      case TRACK_PHASE_DOWN:  editTracks(&Track::phaseDown); break;
+      case TRACK_PHASE_UP:    editTracks(&Track::phaseUp); break;
+      case TRACK_LENGTH_DOWN: editTracks(&Track::lengthDown); break;
+      case TRACK_LENGTH_UP:   editTracks(&Track::lengthUp); break;
+      case TRACK_ARP_DOWN:    editTracks(&Track::arpDown); break;
+      case TRACK_ARP_UP:      editTracks(&Track::arpUp); break;
+      case TRACK_FOCUS_DOWN:
+        focusIndex = focusIndex ? focusIndex - 1 : TRACK_COUNT - 1;
+        redrawTracks();
+        updateLCD();
+        break;
+      case TRACK_FOCUS_UP:
+        focusIndex = focusIndex + 1 < TRACK_COUNT ? focusIndex + 1 : 0;
+        redrawTracks();
+        updateLCD();
+        break;
+      case TRACK_EUCLID:      euclidTracks(); break;
+      case TRACK_COPY:        copyView(); break;
+      case TRACK_VIEW_DOWN:
+        if (view >= GRID_WIDTH)
+          view -= GRID_WIDTH;
+        redrawTracks();
+        break;
+      case TRACK_VIEW_UP:
+        if (view + GRID_WIDTH < TRACK_SIZE)
+          view += GRID_WIDTH;
+        redrawTracks();
+        break;
+    }
+  }
+
+  // Every control is on the grid, as on the original hardware
+  void onEncoderTurn(Hardware::Encoder, int16_t) {}
+  void onEncoderPress(Hardware::Encoder) {}
+  void onEncoderRelease(Hardware::Encoder) {}
+
+  // Tracks have no image format on the serial link
+  void getPatternImage(uint8_t, uint8_t *image) {
+    memset(image, 0, Protocol::PATTERN_IMAGE_SIZE);
+  }
+
+  Protocol::Status loadPatternImage(uint8_t, const uint8_t *) {
+    return Protocol::UNKNOWN;
+  }
+
+  void getSongImage(uint8_t *image) {
+    memset(image, 0, Protocol::SONG_IMAGE_SIZE);
+  }
+
+  Protocol::Status loadSongImage(const uint8_t *) {
+    return Protocol::UNKNOWN;
+  }
+}
+
+#endif
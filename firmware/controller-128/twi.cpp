@@ -0,0 +1,291 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "twi.h"
+#include <util/twi.h>
+
+// Timer3 ticks this often while jobs are queued. A byte takes 90 us at
+// 100 kHz, so the bus is never kept waiting long.
+#define TWI_TICK_US 50
+#define TWI_QUEUE_MASK (TWI_QUEUE_SIZE - 1)
+
+// Ticks the bus can go without moving before it's cleared. The seesaw
+// stretches the clock for a few hundred us at most.
+#define TWI_TIMEOUT_TICKS 100
+
+// SCL and SDA are PD0 and PD1 on the 32U4
+#define TWI_SCL _BV(0)
+#define TWI_SDA _BV(1)
+
+// Clocks that get any device out of the middle of a byte
+#define TWI_CLEAR_CLOCKS 9
+
+namespace Twi {
+  enum Phase : uint8_t {
+    IDLE,
+    WRITING,  // Address, header, then data for a write
+    WAITING,  // Register sent, giving the device time before the read
+    READING,
+    CLEARING  // Clocking SCL by hand after a timeout
+  };
+
+  Job jobs[TWI_QUEUE_SIZE];
+
+  // Free running indices: jobs from finished up to active are done and
+  // waiting for poll(), active is on the bus, and the rest up to queued
+  // are waiting for it
+  volatile uint8_t queued = 0;
+  volatile uint8_t active = 0;
+  uint8_t finished = 0;
+
+  // Only touched by the timer interrupt
+  Phase phase = IDLE;
+  uint8_t position;
+  uint32_t waitUntil;
+  uint8_t ticks;     // Since the bus last moved
+  uint8_t clearStep; // Half clocks so far while CLEARING
+  Faults faults;
+
+  void init() {
+    // CTC on OCR3A, CPU clock / 8, compare interrupt off until there's a job
+    TIMSK3 = 0;
+    TCCR3A = 0;
+    TCCR3B = _BV(WGM32) | _BV(CS31);
+    OCR3A = TWI_TICK_US * (F_CPU / 8000000UL) - 1;
+  }
+
+  bool submit(const Job &job) {
+    if (!space())
+      return false;
+    jobs[queued & TWI_QUEUE_MASK] = job;
+
+    // cli() is also a memory barrier, so the job is written before the
+    // interrupt can see it
+    noInterrupts();
+    queued++;
+    TIMSK3 |= _BV(OCIE3A);
+    interrupts();
+    return true;
+  }
+
+  uint8_t space() {
+    return TWI_QUEUE_SIZE - (uint8_t) (queued - finished);
+  }
+
+  bool idle() {
+    return queued == finished;
+  }
+
+  void poll() {
+    while (finished != active) {
+      Job &job = jobs[finished & TWI_QUEUE_MASK];
+      if (job.callback)
+        job.callback(job.tag, job.ok);
+      finished++;
+    }
+  }
+
+  Faults getFaults() {
+    noInterrupts();
+    Faults copy = faults;
+    interrupts();
+    return copy;
+  }
+
+  // TWIE stays clear, so Wire's interrupt never runs again
+  inline void start() { TWCR = _BV(TWINT) | _BV(TWSTA) | _BV(TWEN); }
+  inline void stop()  { TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN); }
+  inline void next(bool ack) { TWCR = _BV(TWINT) | _BV(TWEN) | (ack ? _BV(TWEA) : 0); }
+
+  inline void count(uint16_t &fault) {
+    if (fault < 0xFFFF)
+      fault++;
+  }
+
+  inline bool stalled() {
+    return ++ticks > TWI_TIMEOUT_TICKS;
+  }
+
+  inline void done(Job &job, bool ok) {
+    job.ok = ok;
+    // Read data has to be in memory before poll() can see the job done
+    asm volatile("" ::: "memory");
+    active++;
+  }
+
+  inline void finish(Job &job, bool ok) {
+    stop();
+    phase = IDLE;
+    done(job, ok);
+  }
+
+  // The TWI unit lets go of the pins, which are then driven open drain by
+  // hand: low is an output at 0, high is an input left to the pull-ups
+  inline void timeout(Job *job) {
+    TWCR = 0;
+    PORTD &= ~(TWI_SCL | TWI_SDA);
+    count(faults.timeouts);
+    if (job)
+      done(*job, false);
+    clearStep = 0;
+    phase = CLEARING;
+  }
+
+  // One half clock per tick until whoever holds SDA lets go, then a stop
+  inline void clearBus() {
+    if (clearStep < TWI_CLEAR_CLOCKS * 2) {
+      if (clearStep & 1) {
+        DDRD &= ~TWI_SCL;
+        if (PIND & TWI_SDA)
+          clearStep = TWI_CLEAR_CLOCKS * 2 - 1;
+      } else {
+        DDRD |= TWI_SCL;
+      }
+      clearStep++;
+      return;
+    }
+
+    switch (clearStep++ - TWI_CLEAR_CLOCKS * 2) {
+      case 0:
+        DDRD |= TWI_SCL | TWI_SDA;
+        break;
+      case 1:
+        DDRD &= ~TWI_SCL;
+        break;
+      default:
+        // SDA rising while SCL is high is the stop
+        DDRD &= ~TWI_SDA;
+        PORTD |= TWI_SCL | TWI_SDA;
+        TWCR = _BV(TWEN);
+        ticks = 0;
+        phase = IDLE;
+        break;
+    }
+  }
+
+  // One step of the job on the bus per tick
+  inline void step() {
+    if (phase == CLEARING) {
+      clearBus();
+      return;
+    }
+
+    if (phase == IDLE) {
+      if (active == queued) {
+        TIMSK3 &= ~_BV(OCIE3A);
+        return;
+      }
+      // The last stop condition is still going out
+      if (TWCR & _BV(TWSTO)) {
+        if (stalled())
+          timeout(NULL);
+        return;
+      }
+      position = 0;
+      ticks = 0;
+      phase = WRITING;
+      start();
+      return;
+    }
+
+    Job &job = jobs[active & TWI_QUEUE_MASK];
+    if (phase == WAITING) {
+      if (TWCR & _BV(TWSTO)) {
+        if (stalled())
+          timeout(&job);
+        return;
+      }
+      if ((int32_t) (micros() - waitUntil) < 0)
+        return;
+      position = 0;
+      ticks = 0;
+      phase = READING;
+      start();
+      return;
+    }
+
+    if (!(TWCR & _BV(TWINT))) {
+      if (stalled())
+        timeout(&job);
+      return;
+    }
+    ticks = 0;
+
+    switch (TW_STATUS) {
+      case TW_START:
+      case TW_REP_START:
+        TWDR = job.address << 1 | (phase == READING ? TW_READ : TW_WRITE);
+        next(false);
+        break;
+
+      case TW_MT_SLA_ACK:
+      case TW_MT_DATA_ACK:
+        if (position < job.headerLength) {
+          TWDR = job.header[position++];
+          next(false);
+        } else if (job.read) {
+          // The seesaw wants a stop and some time before the read
+          stop();
+          waitUntil = micros() + job.readDelay;
+          phase = WAITING;
+        } else if (position < job.headerLength + job.length) {
+          TWDR = job.data[position++ - job.headerLength];
+          next(false);
+        } else {
+          finish(job, true);
+        }
+        break;
+
+      case TW_MR_SLA_ACK:
+        next(job.length > 1);
+        break;
+
+      case TW_MR_DATA_ACK:
+        job.data[position++] = TWDR;
+        next(position + 1 < job.length);
+        break;
+
+      case TW_MR_DATA_NACK:
+        job.data[position] = TWDR;
+        finish(job, true);
+        break;
+
+      case TW_MT_SLA_NACK:
+      case TW_MT_DATA_NACK:
+      case TW_MR_SLA_NACK:
+        count(faults.nacks);
+        finish(job, false);
+        break;
+
+      default:
+        // Lost arbitration or a bus error, a stop gets the unit going again
+        count(faults.busErrors);
+        finish(job, false);
+        break;
+    }
+  }
+}
+
+ISR(TIMER3_COMPA_vect) {
+  Twi::step();
+}
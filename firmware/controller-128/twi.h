@@ -0,0 +1,85 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef twi_h
+#define twi_h
+
+#include <Arduino.h>
+
+// Jobs waiting or in flight, a power of two
+#define TWI_QUEUE_SIZE 8
+#define TWI_HEADER_SIZE 4
+
+// Background I2C transfers. Jobs go out in order, a byte at a time from a
+// timer interrupt, so the loop never waits on the bus. Wire stays in charge
+// of TWI_vect, so it is only for setting the boards up before init().
+//
+// Every step has a timeout. A bus that stops moving fails the job, then gets
+// cleared by clocking SCL by hand, so a stuck device can't stop the queue.
+namespace Twi {
+  // Runs from poll(), so it can touch anything the loop can. The tag is the
+  // job's, for telling apart jobs that share a callback.
+  typedef void (*Callback)(uint8_t tag, bool ok);
+
+  struct Job {
+    uint8_t address;
+    uint8_t header[TWI_HEADER_SIZE]; // Register and anything else sent first
+    uint8_t headerLength;
+    uint8_t *data;                   // Sent after the header, or read into
+    uint8_t length;
+    bool read;
+    uint16_t readDelay;              // us between the register and the read
+    Callback callback;
+    uint8_t tag;
+    bool ok;
+
+    Job(uint8_t _address = 0, uint8_t base = 0, uint8_t function = 0)
+      : address(_address), headerLength(2), data(NULL), length(0), read(false), readDelay(0), callback(NULL), tag(0), ok(false) {
+      header[0] = base;
+      header[1] = function;
+    }
+  };
+
+  void init();
+
+  // Copies the job into the queue, false if the queue is full. Data isn't
+  // copied, it has to stay put until the callback.
+  bool submit(const Job &job);
+
+  // Jobs that can still be submitted
+  uint8_t space();
+  bool idle();
+
+  // Calls back for finished jobs, from the loop
+  void poll();
+
+  // Saturating counts since power on
+  struct Faults {
+    uint16_t nacks;     // Nobody at the address, or a byte refused
+    uint16_t busErrors; // Lost arbitration or an illegal start or stop
+    uint16_t timeouts;  // The bus stopped moving and had to be cleared
+  };
+  Faults getFaults();
+}
+
+#endif
@@ -0,0 +1,568 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+// Runs the AVR build of the firmware under simavr and counts ATmega32U4
+// cycles: from a clock input edge to the shift register latch, through
+// named firmware functions, and through every interrupt handler. Also
+// reports flash and SRAM use. The Trellis boards are stood in for by a
+// seesaw responder on the TWI bus.
+//
+//   avrbench [-n edges] [-p period ms] [-f function]... [-c pin] [-l pin] <firmware.elf>
+
+#include <elf.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <sim_avr.h>
+#include <sim_elf.h>
+#include <sim_io.h>
+#include <sim_irq.h>
+#include <sim_interrupts.h>
+#include <avr_ioport.h>
+#include <avr_twi.h>
+
+#include "geometry.h"
+
+#define MCU "atmega32u4"
+#define CPU_FREQUENCY 16000000UL
+#define FLASH_AVAILABLE 28672 // 32 KB less the bootloader
+#define SRAM_START 0x100
+#define SRAM_SIZE 2560
+#define VECTOR_COUNT 43
+
+// From hardware.cpp
+#define CLOCK_INTERRUPT 7
+#define SHIFT_LATCH 19
+#define CLOCK_HARDWARE 1
+
+#define BOOT_MS 1500
+#define KEY_MS 40
+#define DEFAULT_EDGES 64
+#define DEFAULT_PERIOD_MS 20
+
+// The seesaw registers the NeoTrellis library reads
+#define SEESAW_STATUS_BASE 0x00
+#define SEESAW_STATUS_HW_ID 0x01
+#define SEESAW_HW_ID_CODE 0x55
+#define SEESAW_KEYPAD_BASE 0x10
+#define SEESAW_KEYPAD_COUNT 0x04
+#define SEESAW_KEYPAD_FIFO 0x10
+#define SEESAW_KEYPAD_EDGE_FALLING 2
+#define SEESAW_KEYPAD_EDGE_RISING 3
+
+#define ELF_DATA_OFFSET 0x800000
+
+static avr_t *avr;
+
+static inline double cyclesToMicros(uint64_t cycles) {
+  return cycles * 1000000.0 / CPU_FREQUENCY;
+}
+
+struct Stats {
+  uint32_t count = 0;
+  uint64_t min = 0, max = 0, total = 0;
+
+  void add(uint64_t cycles) {
+    if (!count || cycles < min)
+      min = cycles;
+    if (cycles > max)
+      max = cycles;
+    total += cycles;
+    count++;
+  }
+
+  void print(const char *name) const {
+    if (!count) {
+      printf("  %-32s %6s\n", name, "-");
+      return;
+    }
+    printf("  %-32s %6u %8llu %8llu %8llu %9.1f\n", name, count, (unsigned long long) min,
+      (unsigned long long) (total / count), (unsigned long long) max, cyclesToMicros(max));
+  }
+};
+
+// --- FIRMWARE IMAGE ---
+
+struct Image {
+  std::vector<Elf32_Sym> symbols;
+  std::vector<std::string> names;
+  uint32_t text = 0, data = 0, bss = 0, noinit = 0;
+};
+
+// Only symbols and section sizes are needed, simavr loads the image itself
+static bool readImage(const char *path, Image &image) {
+  FILE *in = fopen(path, "rb");
+  if (!in) {
+    perror(path);
+    return false;
+  }
+  std::vector<uint8_t> file;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    file.insert(file.end(), buffer, buffer + n);
+  fclose(in);
+
+  const Elf32_Ehdr *header = (const Elf32_Ehdr *) file.data();
+  if (file.size() < sizeof(Elf32_Ehdr) || memcmp(header->e_ident, ELFMAG, SELFMAG)
+      || header->e_ident[EI_CLASS] != ELFCLASS32 || header->e_machine != EM_AVR
+      || header->e_shoff + (uint64_t) header->e_shnum * sizeof(Elf32_Shdr) > file.size()) {
+    fprintf(stderr, "%s: not an AVR image\n", path);
+    return false;
+  }
+
+  const Elf32_Shdr *sections = (const Elf32_Shdr *) (file.data() + header->e_shoff);
+  const char *sectionNames = (const char *) file.data() + sections[header->e_shstrndx].sh_offset;
+  for (uint16_t i = 0; i < header->e_shnum; i++) {
+    const Elf32_Shdr &section = sections[i];
+    const char *name = sectionNames + section.sh_name;
+    if (!strcmp(name, ".text"))
+      image.text = section.sh_size;
+    else if (!strcmp(name, ".data"))
+      image.data = section.sh_size;
+    else if (!strcmp(name, ".bss"))
+      image.bss = section.sh_size;
+    else if (!strcmp(name, ".noinit"))
+      image.noinit = section.sh_size;
+
+    if (section.sh_type != SHT_SYMTAB)
+      continue;
+    const char *strings = (const char *) file.data() + sections[section.sh_link].sh_offset;
+    const Elf32_Sym *symbols = (const Elf32_Sym *) (file.data() + section.sh_offset);
+    for (uint32_t j = 0; j < section.sh_size / sizeof(Elf32_Sym); j++) {
+      uint8_t type = ELF32_ST_TYPE(symbols[j].st_info);
+      if (type != STT_FUNC && type != STT_OBJECT)
+        continue;
+      image.symbols.push_back(symbols[j]);
+      image.names.push_back(strings + symbols[j].st_name);
+    }
+  }
+  if (image.symbols.empty()) {
+    fprintf(stderr, "%s: no symbols, don't strip the image\n", path);
+    return false;
+  }
+  return true;
+}
+
+// Takes a C name or a qualified C++ name like Controller::onClockRising.
+// C++ names are matched on the mangled prefix, so parameter types and LTO
+// suffixes don't matter, and with or without internal linkage.
+static const Elf32_Sym *findSymbol(const Image &image, const std::string &name) {
+  std::string prefix = "_ZN", local;
+  size_t start = 0, end;
+  while ((end = name.find("::", start)) != std::string::npos) {
+    prefix += std::to_string(end - start) + name.substr(start, end - start);
+    start = end + 2;
+  }
+  std::string last = std::to_string(name.size() - start) + name.substr(start) + "E";
+  local = prefix + "L" + last;
+  prefix += last;
+
+  for (size_t i = 0; i < image.symbols.size(); i++) {
+    const std::string &symbol = image.names[i];
+    if (start ? !symbol.compare(0, prefix.size(), prefix) || !symbol.compare(0, local.size(), local)
+              : symbol == name)
+      return &image.symbols[i];
+  }
+  return nullptr;
+}
+
+// --- PINS ---
+
+struct Pin {
+  char port = 0;
+  uint8_t bit = 0;
+};
+
+static bool parsePin(const char *text, Pin &pin) {
+  if (strlen(text) != 2 || text[0] < 'A' || text[0] > 'F' || text[1] < '0' || text[1] > '7')
+    return false;
+  pin.port = text[0];
+  pin.bit = text[1] - '0';
+  return true;
+}
+
+// Arduino pin numbers depend on the board variant, so they are looked up in
+// the variant's own tables in the image
+static bool lookUpPin(const Image &image, uint8_t number, Pin &pin) {
+  const Elf32_Sym *ports = findSymbol(image, "digital_pin_to_port_PGM");
+  const Elf32_Sym *masks = findSymbol(image, "digital_pin_to_bit_mask_PGM");
+  if (!ports || !masks || number >= ports->st_size)
+    return false;
+  uint8_t port = avr->flash[ports->st_value + number];
+  uint8_t mask = avr->flash[masks->st_value + number];
+  if (!port || !mask)
+    return false;
+  pin.port = 'A' + port - 1; // PA is 1 in the Arduino core
+  pin.bit = __builtin_ctz(mask);
+  return true;
+}
+
+static avr_irq_t *pinIRQ(const Pin &pin) {
+  return avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(pin.port), pin.bit);
+}
+
+// --- TRELLIS BOARDS ---
+
+struct Seesaw {
+  uint8_t address;
+  std::deque<uint8_t> events;
+};
+
+static Seesaw boards[Geometry::BOARD_COUNT];
+static Seesaw *selectedBoard;
+static uint8_t twiRegister[2];
+static uint8_t twiWritten;
+static avr_irq_t *twiIRQ;
+
+static uint8_t seesawRead(Seesaw &board) {
+  if (twiRegister[0] == SEESAW_STATUS_BASE && twiRegister[1] == SEESAW_STATUS_HW_ID)
+    return SEESAW_HW_ID_CODE;
+  if (twiRegister[0] == SEESAW_KEYPAD_BASE && twiRegister[1] == SEESAW_KEYPAD_COUNT)
+    return board.events.size();
+  if (twiRegister[0] == SEESAW_KEYPAD_BASE && twiRegister[1] == SEESAW_KEYPAD_FIFO && !board.events.empty()) {
+    uint8_t event = board.events.front();
+    board.events.pop_front();
+    return event;
+  }
+  return 0;
+}
+
+// Every write is acknowledged and dropped, pixels aren't looked at
+static void onTWI(avr_irq_t *, uint32_t value, void *) {
+  avr_twi_msg_irq_t message;
+  message.u.v = value;
+
+  if (message.u.twi.msg & TWI_COND_STOP)
+    selectedBoard = nullptr;
+  if (message.u.twi.msg & TWI_COND_START) {
+    selectedBoard = nullptr;
+    twiWritten = 0;
+    for (Seesaw &board : boards)
+      if (board.address == message.u.twi.addr >> 1)
+        selectedBoard = &board;
+    if (selectedBoard)
+      avr_raise_irq(twiIRQ + TWI_IRQ_INPUT, avr_twi_irq_msg(TWI_COND_ACK, message.u.twi.addr, 1));
+  }
+  if (!selectedBoard)
+    return;
+  if (message.u.twi.msg & TWI_COND_WRITE) {
+    if (twiWritten < sizeof(twiRegister))
+      twiRegister[twiWritten] = message.u.twi.data;
+    twiWritten++;
+    avr_raise_irq(twiIRQ + TWI_IRQ_INPUT, avr_twi_irq_msg(TWI_COND_ACK, message.u.twi.addr, 1));
+  }
+  if (message.u.twi.msg & TWI_COND_READ)
+    avr_raise_irq(twiIRQ + TWI_IRQ_INPUT, avr_twi_irq_msg(TWI_COND_READ, message.u.twi.addr, seesawRead(*selectedBoard)));
+}
+
+static void initBoards() {
+  for (uint8_t row = 0; row < Geometry::BOARD_ROWS; row++)
+    for (uint8_t col = 0; col < Geometry::BOARD_COLS; col++)
+      boards[row * Geometry::BOARD_COLS + col].address = Geometry::boardAddress(row, col);
+
+  static const char *names[] = { "seesaw.in", "seesaw.out" };
+  twiIRQ = avr_alloc_irq(&avr->irq_pool, 0, 2, names);
+  avr_irq_register_notify(twiIRQ + TWI_IRQ_OUTPUT, onTWI, nullptr);
+  avr_connect_irq(twiIRQ + TWI_IRQ_INPUT, avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_INPUT));
+  avr_connect_irq(avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_OUTPUT), twiIRQ + TWI_IRQ_OUTPUT);
+}
+
+// Key events are queued in seesaw numbering, four keys to a board row of
+// eight, with the edge in the low two bits
+static void queueKey(uint8_t x, uint8_t y, uint8_t edge) {
+  Seesaw &board = boards[(y >> Geometry::BOARD_SHIFT) * Geometry::BOARD_COLS + (x >> Geometry::BOARD_SHIFT)];
+  uint8_t key = (y & 3) * 8 + (x & 3);
+  board.events.push_back(key << 2 | edge);
+}
+
+// --- MEASUREMENTS ---
+
+static Stats risingToLatch, fallingToLatch;
+static uint64_t edgeCycle;
+static bool edgePending, edgeRising;
+static uint32_t edgesMissed;
+
+static void onLatch(avr_irq_t *irq, uint32_t value, void *) {
+  if (!value || irq->value || !edgePending)
+    return;
+  (edgeRising ? risingToLatch : fallingToLatch).add(avr->cycle - edgeCycle);
+  edgePending = false;
+}
+
+static void clockEdge(const Pin &pin, bool rising) {
+  if (edgePending)
+    edgesMissed++;
+  avr_raise_irq(pinIRQ(pin), rising);
+  edgeCycle = avr->cycle;
+  edgePending = true;
+  edgeRising = rising;
+}
+
+// A function is timed from its entry to the return to the address its
+// caller pushed, interrupts included
+struct Probe {
+  std::string name;
+  const Elf32_Sym *symbol = nullptr;
+  bool active = false;
+  uint64_t start = 0;
+  uint16_t sp = 0;
+  uint32_t ret = 0;
+  Stats stats;
+};
+
+static inline uint16_t stackPointer() {
+  return avr->data[R_SPL] | avr->data[R_SPH] << 8;
+}
+
+static void checkProbe(Probe &probe) {
+  if (!probe.active) {
+    if (avr->pc != probe.symbol->st_value)
+      return;
+    probe.active = true;
+    probe.start = avr->cycle;
+    probe.sp = stackPointer();
+    probe.ret = (avr->data[probe.sp + 1] << 8 | avr->data[probe.sp + 2]) * 2;
+  } else if (avr->pc == probe.ret && stackPointer() == probe.sp + 2) {
+    probe.stats.add(avr->cycle - probe.start);
+    probe.active = false;
+  }
+}
+
+static Stats interrupts[VECTOR_COUNT];
+static uint64_t interruptStart[VECTOR_COUNT];
+
+static void onInterrupt(avr_irq_t *, uint32_t value, void *param) {
+  uintptr_t vector = (uintptr_t) param;
+  if (value)
+    interruptStart[vector] = avr->cycle;
+  else
+    interrupts[vector].add(avr->cycle - interruptStart[vector]);
+}
+
+static const char *vectorName(uint8_t vector) {
+  switch (vector) {
+    case 1: return "INT0";
+    case 2: return "INT1";
+    case 3: return "INT2";
+    case 4: return "INT3";
+    case 7: return "INT6";
+    case 10: return "USB_GEN";
+    case 11: return "USB_COM";
+    case 23: return "TIMER0_OVF";
+    case 25: return "USART1_RX";
+    case 36: return "TWI";
+    default: return nullptr;
+  }
+}
+
+// --- RUN ---
+
+static inline uint64_t msToCycles(uint32_t ms) {
+  return (uint64_t) ms * (CPU_FREQUENCY / 1000);
+}
+
+struct Event {
+  uint64_t cycle;
+  enum { KEY, CLOCK_SOURCE, EDGE, END } kind;
+  uint8_t x, y, edge;
+};
+
+// Software clock to hardware, a diagonal of steps so every row fires, then
+// play and clock edges
+static std::vector<Event> buildEvents(uint32_t edges, uint32_t periodMs) {
+  std::vector<Event> events;
+  uint64_t at = msToCycles(BOOT_MS);
+  events.push_back({ at, Event::CLOCK_SOURCE, 0, 0, 0 });
+
+  auto tap = [&](uint8_t x, uint8_t y) {
+    events.push_back({ at += msToCycles(KEY_MS), Event::KEY, x, y, SEESAW_KEYPAD_EDGE_RISING });
+    events.push_back({ at += msToCycles(KEY_MS), Event::KEY, x, y, SEESAW_KEYPAD_EDGE_FALLING });
+  };
+  for (uint8_t x = 0; x < Geometry::WIDTH; x++)
+    tap(x, 1 + x % (Geometry::HEIGHT - 1));
+  tap(Geometry::controlX(Geometry::CONTROL_PLAY_PATTERN), 0);
+
+  for (uint32_t i = 0; i < edges * 2; i++)
+    events.push_back({ at += msToCycles(periodMs) / 2, Event::EDGE, 0, 0, (uint8_t) !(i & 1) });
+  events.push_back({ at + msToCycles(periodMs), Event::END, 0, 0, 0 });
+  return events;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-n edges] [-p period ms] [-f function]... [-c pin] [-l pin] <firmware.elf>\n", name);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  uint32_t edges = DEFAULT_EDGES, periodMs = DEFAULT_PERIOD_MS;
+  std::vector<Probe> probes;
+  Pin clockPin, latchPin;
+  int option;
+  while ((option = getopt(argc, argv, "n:p:f:c:l:")) != -1) {
+    switch (option) {
+      case 'n': edges = atoi(optarg); break;
+      case 'p': periodMs = atoi(optarg); break;
+      case 'f': probes.push_back(Probe()); probes.back().name = optarg; break;
+      case 'c': if (!parsePin(optarg, clockPin)) usage(argv[0]); break;
+      case 'l': if (!parsePin(optarg, latchPin)) usage(argv[0]); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || !edges || periodMs < 2)
+    usage(argv[0]);
+  const char *path = argv[optind];
+
+  if (probes.empty()) {
+    for (const char *name : { "Controller::onClockRising", "Controller::onClockFalling", "Controller::tick",
+                              "Controller::writeOutputs", "Hardware::outputTriggers", "Hardware::tickClock" }) {
+      probes.push_back(Probe());
+      probes.back().name = name;
+    }
+  }
+
+  Image image;
+  if (!readImage(path, image))
+    return 1;
+
+  elf_firmware_t firmware;
+  memset(&firmware, 0, sizeof(firmware));
+  if (elf_read_firmware(path, &firmware)) {
+    fprintf(stderr, "%s: simavr can't load it\n", path);
+    return 1;
+  }
+  avr = avr_make_mcu_by_name(MCU);
+  if (!avr) {
+    fprintf(stderr, "simavr has no %s\n", MCU);
+    return 1;
+  }
+  avr_init(avr);
+  firmware.frequency = CPU_FREQUENCY;
+  avr_load_firmware(avr, &firmware);
+  avr->frequency = CPU_FREQUENCY;
+
+  if (!clockPin.port && !lookUpPin(image, CLOCK_INTERRUPT, clockPin)) {
+    fprintf(stderr, "can't find pin %d in the image, give it with -c\n", CLOCK_INTERRUPT);
+    return 1;
+  }
+  if (!latchPin.port && !lookUpPin(image, SHIFT_LATCH, latchPin)) {
+    fprintf(stderr, "can't find pin %d in the image, give it with -l\n", SHIFT_LATCH);
+    return 1;
+  }
+  const Elf32_Sym *clockSource = findSymbol(image, "Hardware::clockSource");
+  if (!clockSource) {
+    fprintf(stderr, "can't find Hardware::clockSource in the image\n");
+    return 1;
+  }
+
+  initBoards();
+  avr_irq_register_notify(pinIRQ(latchPin), onLatch, nullptr);
+  for (uintptr_t vector = 1; vector < VECTOR_COUNT; vector++) {
+    avr_irq_t *irq = avr_get_interrupt_irq(avr, vector);
+    if (irq)
+      avr_irq_register_notify(irq + AVR_INT_IRQ_RUNNING, onInterrupt, (void *) vector);
+  }
+
+  std::vector<Probe *> active;
+  for (Probe &probe : probes) {
+    probe.symbol = findSymbol(image, probe.name);
+    if (probe.symbol)
+      active.push_back(&probe);
+  }
+
+  std::vector<Event> events = buildEvents(edges, periodMs);
+  size_t next = 0;
+  uint16_t lowestSP = 0xFFFF;
+  while (next < events.size()) {
+    int state = avr_run(avr);
+    if (state == cpu_Done || state == cpu_Crashed) {
+      fprintf(stderr, "the firmware stopped at %06X\n", avr->pc);
+      return 1;
+    }
+
+    for (Probe *probe : active)
+      checkProbe(*probe);
+    uint16_t sp = stackPointer();
+    if (sp < lowestSP)
+      lowestSP = sp;
+
+    for (; next < events.size() && avr->cycle >= events[next].cycle; next++) {
+      const Event &event = events[next];
+      switch (event.kind) {
+        case Event::KEY:
+          queueKey(event.x, event.y, event.edge);
+          break;
+        case Event::CLOCK_SOURCE:
+          // The firmware switches with a pad, but where that pad is depends
+          // on the layout
+          avr->data[clockSource->st_value - ELF_DATA_OFFSET] = CLOCK_HARDWARE;
+          break;
+        case Event::EDGE:
+          clockEdge(clockPin, event.edge);
+          break;
+        case Event::END:
+          break;
+      }
+    }
+  }
+
+  uint32_t staticRAM = image.data + image.bss + image.noinit;
+  uint32_t stack = avr->ramend - lowestSP;
+  printf("%s, %dx%d grid, %u edges every %u ms\n\n", path, GRID_WIDTH, GRID_HEIGHT, edges, periodMs);
+  printf("flash  %5u of %u bytes\n", image.text + image.data, FLASH_AVAILABLE);
+  printf("sram   %5u static + %u stack peak of %u bytes, %d free\n\n", staticRAM, stack, SRAM_SIZE,
+    (int) (lowestSP + 1) - (int) (SRAM_START + staticRAM));
+
+  printf("  %-32s %6s %8s %8s %8s %9s\n", "cycles", "count", "min", "mean", "max", "max us");
+  printf("clock pin %c%u to latch %c%u\n", clockPin.port, clockPin.bit, latchPin.port, latchPin.bit);
+  risingToLatch.print("rising");
+  fallingToLatch.print("falling");
+  if (edgesMissed)
+    printf("  %u edges had no latch before the next edge\n", edgesMissed);
+
+  printf("functions\n");
+  for (const Probe &probe : probes) {
+    if (probe.symbol)
+      probe.stats.print(probe.name.c_str());
+    else
+      printf("  %-32s not in the image, inlined?\n", probe.name.c_str());
+  }
+
+  printf("interrupts, vector to reti\n");
+  for (uint8_t vector = 1; vector < VECTOR_COUNT; vector++) {
+    if (!interrupts[vector].count)
+      continue;
+    char name[16];
+    if (vectorName(vector))
+      snprintf(name, sizeof(name), "%s", vectorName(vector));
+    else
+      snprintf(name, sizeof(name), "vector %u", vector);
+    interrupts[vector].print(name);
+  }
+  return 0;
+}
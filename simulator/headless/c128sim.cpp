@@ -0,0 +1,376 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+// Runs the real firmware against the simulated board in machine.cpp,
+// faster than real time, and writes a trace of everything it outputs.
+// Traces from two firmware versions can then be diffed.
+//
+//   c128sim run <script> [trace]
+//   c128sim diff <golden trace> <trace>
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "machine.h"
+
+#define TRACE_HEADER "# c128sim trace 2"
+#define DEFAULT_LOOP_US 200 // Loop time besides the firmware's own delays
+#define STEP_TIMEOUT_US 10000000ULL
+#define KEY_TIMEOUT_US 100000
+#define MAX_DIFFS 10
+
+void setup();
+void loop();
+
+// Trace lines: kind, steps so far, microseconds, then
+//   O outputs         each latch of the shift registers, hex
+//   M packet          each USB-MIDI packet sent, hex
+//   F rows...         the grid, when a step starts or a command ends and it changed
+//   L "line" "line"   the LCD, same
+//   P x y, R x y      a pad the script pressed or released
+class Tracer : public Machine::Listener {
+public:
+  explicit Tracer(FILE *out) : out(out) {
+    fprintf(out, "%s\n", TRACE_HEADER);
+  }
+
+  uint32_t getSteps() const { return steps; }
+
+  // Steps so far that started with the output on
+  uint32_t getHits(uint8_t output) const { return hits[output]; }
+
+  void onOutputs(uint32_t outputs) override {
+    if ((outputs & 1) && !(prevOutputs & 1)) {
+      steps++;
+      stepStarted = true;
+      for (uint8_t i = 0; i < GRID_ROW_BYTES * 8; i++)
+        hits[i] += (outputs >> i) & 1;
+    }
+    prevOutputs = outputs;
+    line('O', "%0*X", GRID_ROW_BYTES * 2, outputs & ((1UL << (GRID_ROW_BYTES * 8)) - 1));
+  }
+
+  void onPad(uint8_t x, uint8_t y, bool pressed) {
+    line(pressed ? 'P' : 'R', "%u %u", x, y);
+  }
+
+  void onMidi(const uint8_t packet[4]) override {
+    line('M', "%02X%02X%02X%02X", packet[0], packet[1], packet[2], packet[3]);
+  }
+
+  // Called after every loop, so a step's frame shows that loop's drawing
+  void afterLoop() {
+    if (stepStarted)
+      snapshot();
+    stepStarted = false;
+  }
+
+  void snapshot() {
+    std::string frame;
+    char pixel[8];
+    for (uint8_t y = 0; y < Geometry::HEIGHT; y++) {
+      frame += ' ';
+      for (uint8_t x = 0; x < Geometry::WIDTH; x++) {
+        snprintf(pixel, sizeof(pixel), "%06X", Machine::shownPixel(x, y) & 0xFFFFFF);
+        frame += pixel;
+      }
+    }
+    if (frame != prevFrame)
+      line('F', "%s", frame.c_str() + 1);
+    prevFrame = frame;
+
+    std::string lcd = std::string("\"") + Machine::lcdLine(0) + "\" \"" + Machine::lcdLine(1) + "\"";
+    if (lcd != prevLCD)
+      line('L', "%s", lcd.c_str());
+    prevLCD = lcd;
+  }
+
+private:
+  FILE *out;
+  uint32_t steps = 0;
+  uint32_t prevOutputs = 0;
+  uint32_t hits[GRID_ROW_BYTES * 8] = {};
+  bool stepStarted = false;
+  std::string prevFrame, prevLCD;
+
+  void line(char kind, const char *format, ...) {
+    fprintf(out, "%c %u %llu ", kind, steps, (unsigned long long) Machine::now());
+    va_list args;
+    va_start(args, format);
+    vfprintf(out, format, args);
+    va_end(args);
+    fputc('\n', out);
+  }
+};
+
+static uint32_t loopMicros = DEFAULT_LOOP_US;
+
+static void runLoop(Tracer &tracer) {
+  loop();
+  Machine::advance(loopMicros);
+  tracer.afterLoop();
+}
+
+static void runFor(Tracer &tracer, uint64_t us) {
+  uint64_t end = Machine::now() + us;
+  while (Machine::now() < end)
+    runLoop(tracer);
+}
+
+// False if the clock stops before the tracer has seen target steps
+static bool runToStep(Tracer &tracer, uint32_t target) {
+  uint64_t deadline = Machine::now() + STEP_TIMEOUT_US;
+  while (tracer.getSteps() < target) {
+    if (Machine::now() >= deadline)
+      return false;
+    runLoop(tracer);
+  }
+  return true;
+}
+
+static bool parseEncoder(const std::string &name, Machine::Encoder &encoder) {
+  if (name == "left")
+    encoder = Machine::LEFT;
+  else if (name == "right")
+    encoder = Machine::RIGHT;
+  else
+    return false;
+  return true;
+}
+
+// One command per line, # starts a comment:
+//   loop <us>                 time per loop on top of the firmware's delays
+//   press|release|tap <x> <y> pads, tap is a press and release together
+//   turn left|right <n>       n detents, negative to turn back
+//   push|let|click left|right encoder switch
+//   reset                     a pulse on the reset input
+//   unplug|plug <x> <y>       the Trellis board with that pad leaves or rejoins the bus
+//   midi <hex>                a received USB-MIDI packet, e.g. midi 0F FA 00 00
+//   wait <ms>
+//   at <us>                   run until that long after power on
+//   steps <n>                 until the clock output has started n more steps
+//   expect <out> <n> <steps>  output out starts on with n of the next steps,
+//                             or the run fails
+static bool runScript(const char *path, Tracer &tracer) {
+  std::ifstream in(path);
+  if (!in) {
+    perror(path);
+    return false;
+  }
+
+  std::string text;
+  for (int lineNumber = 1; std::getline(in, text); lineNumber++) {
+    text = text.substr(0, text.find('#'));
+    std::istringstream words(text);
+    std::string command, arg;
+    if (!(words >> command))
+      continue;
+
+    bool ok = true;
+    if (command == "loop") {
+      ok = (bool) (words >> loopMicros);
+    } else if (command == "press" || command == "release" || command == "tap") {
+      int x, y;
+      ok = (bool) (words >> x >> y) && x >= 0 && x < Geometry::WIDTH && y >= 0 && y < Geometry::HEIGHT;
+      if (ok && command != "release") {
+        Machine::pressPad(x, y);
+        tracer.onPad(x, y, true);
+      }
+      if (ok && command != "press") {
+        Machine::releasePad(x, y);
+        tracer.onPad(x, y, false);
+      }
+    } else if (command == "unplug" || command == "plug") {
+      int x, y;
+      ok = (bool) (words >> x >> y) && x >= 0 && x < Geometry::WIDTH && y >= 0 && y < Geometry::HEIGHT;
+      if (ok)
+        Machine::plugBoard(x, y, command == "plug");
+    } else if (command == "turn") {
+      Machine::Encoder encoder;
+      int detents;
+      ok = (bool) (words >> arg >> detents) && parseEncoder(arg, encoder);
+      for (int i = 0; ok && i < abs(detents); i++) {
+        Machine::turnEncoder(encoder, detents > 0);
+        runLoop(tracer);
+      }
+    } else if (command == "push" || command == "let" || command == "click") {
+      Machine::Encoder encoder;
+      ok = (bool) (words >> arg) && parseEncoder(arg, encoder);
+      if (ok && command != "let") {
+        Machine::setEncoderPressed(encoder, true);
+        runLoop(tracer);
+      }
+      if (ok && command != "push") {
+        Machine::setEncoderPressed(encoder, false);
+        runLoop(tracer);
+      }
+    } else if (command == "reset") {
+      Machine::setResetInput(true);
+      runLoop(tracer);
+      Machine::setResetInput(false);
+    } else if (command == "midi") {
+      uint8_t packet[4];
+      for (int i = 0; ok && i < 4; i++) {
+        unsigned value;
+        ok = (bool) (words >> std::hex >> value) && value <= 0xFF;
+        packet[i] = value;
+      }
+      if (ok)
+        Machine::receiveMidi(packet);
+    } else if (command == "wait") {
+      unsigned ms;
+      ok = (bool) (words >> ms);
+      if (ok)
+        runFor(tracer, (uint64_t) ms * 1000);
+    } else if (command == "at") {
+      unsigned long long us;
+      ok = (bool) (words >> us);
+      if (ok && us > Machine::now())
+        runFor(tracer, us - Machine::now());
+    } else if (command == "steps") {
+      unsigned count;
+      ok = (bool) (words >> count);
+      if (ok && !runToStep(tracer, tracer.getSteps() + count)) {
+        fprintf(stderr, "%s:%d: the clock stopped\n", path, lineNumber);
+        return false;
+      }
+    } else if (command == "expect") {
+      unsigned output, want, count;
+      ok = (bool) (words >> output >> want >> count) && output < GRID_ROW_BYTES * 8 && count > 0;
+      if (ok) {
+        uint32_t start = tracer.getHits(output);
+        if (!runToStep(tracer, tracer.getSteps() + count)) {
+          fprintf(stderr, "%s:%d: the clock stopped\n", path, lineNumber);
+          return false;
+        }
+        uint32_t got = tracer.getHits(output) - start;
+        if (got != want) {
+          fprintf(stderr, "%s:%d: output %u was on for %u of %u steps, not %u\n",
+                  path, lineNumber, output, got, count, want);
+          return false;
+        }
+      }
+    } else {
+      ok = false;
+    }
+
+    if (!ok) {
+      fprintf(stderr, "%s:%d: can't run \"%s\"\n", path, lineNumber, text.c_str());
+      return false;
+    }
+    // Presses and releases still queued on a board go out on the next polls
+    uint64_t deadline = Machine::now() + KEY_TIMEOUT_US;
+    for (uint8_t i = 0; i < Geometry::BOARD_COUNT || (Machine::keysWaiting() && Machine::now() < deadline); i++)
+      runLoop(tracer);
+    tracer.snapshot();
+  }
+  return true;
+}
+
+static bool readTrace(const char *path, std::vector<std::string> &lines) {
+  std::ifstream in(path);
+  if (!in) {
+    perror(path);
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line))
+    lines.push_back(line);
+  if (lines.empty() || lines[0] != TRACE_HEADER) {
+    fprintf(stderr, "%s: not a trace\n", path);
+    return false;
+  }
+  return true;
+}
+
+// Frame lines are long, so name the pads that differ instead of printing them
+static void describeFrames(const std::string &a, const std::string &b) {
+  std::istringstream wa(a), wb(b);
+  std::string skip, rowA, rowB;
+  for (int i = 0; i < 3; i++) {
+    wa >> skip;
+    wb >> skip;
+  }
+  for (int y = 0; wa >> rowA && wb >> rowB; y++)
+    for (size_t x = 0; x * 6 < rowA.size() && x * 6 < rowB.size(); x++)
+      if (rowA.compare(x * 6, 6, rowB, x * 6, 6))
+        printf("    pad %zu,%d: %s -> %s\n", x, y, rowA.substr(x * 6, 6).c_str(), rowB.substr(x * 6, 6).c_str());
+}
+
+// Traces are deterministic, so lines are compared in order and everything
+// after the first few differences is only counted
+static int diff(const char *goldenPath, const char *tracePath) {
+  std::vector<std::string> golden, trace;
+  if (!readTrace(goldenPath, golden) || !readTrace(tracePath, trace))
+    return 2;
+
+  size_t diffs = 0;
+  size_t common = std::min(golden.size(), trace.size());
+  for (size_t i = 1; i < common; i++) {
+    if (golden[i] == trace[i])
+      continue;
+    if (++diffs > MAX_DIFFS)
+      continue;
+    if (golden[i][0] == 'F' && trace[i][0] == 'F') {
+      printf("line %zu: frame at %.*s\n", i + 1, (int) golden[i].find(' ', golden[i].find(' ', 2) + 1), golden[i].c_str());
+      describeFrames(golden[i], trace[i]);
+    } else {
+      printf("line %zu:\n  - %.100s\n  + %.100s\n", i + 1, golden[i].c_str(), trace[i].c_str());
+    }
+  }
+  if (golden.size() != trace.size())
+    printf("%zu lines against %zu\n", golden.size(), trace.size());
+  if (!diffs && golden.size() == trace.size())
+    return 0;
+  printf("%zu lines differ\n", diffs);
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 4 && !strcmp(argv[1], "diff"))
+    return diff(argv[2], argv[3]);
+  if ((argc != 3 && argc != 4) || strcmp(argv[1], "run")) {
+    fprintf(stderr, "usage: %s run <script> [trace]\n       %s diff <golden trace> <trace>\n", argv[0], argv[0]);
+    return 2;
+  }
+
+  FILE *out = argc == 4 ? fopen(argv[3], "w") : stdout;
+  if (!out) {
+    perror(argv[3]);
+    return 1;
+  }
+
+  Tracer tracer(out);
+  Machine::setListener(&tracer);
+  setup();
+  tracer.snapshot();
+  bool ok = runScript(argv[2], tracer);
+  fclose(out);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,478 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <cstdio>
+#include <algorithm>
+#include <deque>
+
+#include "machine.h"
+#include <Arduino.h>
+#include <LiquidCrystal.h>
+#include <MIDIUSB.h>
+#include <Adafruit_NeoTrellis.h>
+#include <Wire.h>
+#include <twi.h>
+#include <avr/eeprom.h>
+
+#undef min
+#undef max
+
+// Pins from hardware.cpp
+#define L_ENCODER_S 18
+#define R_ENCODER_S 21
+#define SHIFT_LATCH 19
+#define COMMON_INTERRUPT 8
+
+// Bits of the pin change snapshot taken by Hardware::handleInterrupt
+#define PINB_L_ENCODER_A 0b00100000
+#define PINB_L_ENCODER_B 0b00010000
+#define PINB_R_ENCODER_B 0b01000000
+#define PINF_R_ENCODER_A 0b10000000
+#define PINC_RESET 0b01000000
+
+#define PIN_COUNT 32
+#define LCD_COLS 16
+#define LCD_ROWS 2
+#define SEESAW_BUFFER_SIZE 32
+#define TWI_BYTE_US 90 // Nine clocks at 100 kHz
+#define EEPROM_SIZE 1024
+#define EEPROM_WRITE_US 3400 // Erase and write, from the datasheet
+
+volatile uint8_t PINB = PINB_L_ENCODER_A | PINB_L_ENCODER_B | PINB_R_ENCODER_B;
+volatile uint8_t PINC = 0, PIND = 0, PINF = PINF_R_ENCODER_A, SREG = 0;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+volatile uint16_t TCNT1;
+
+Serial_ Serial;
+MIDI_ MidiUSB;
+TwoWire Wire;
+
+namespace Machine {
+  Listener *listener = nullptr;
+  uint64_t time = 0;
+
+  uint8_t pinLevels[PIN_COUNT];
+  void (*interruptHandlers[PIN_COUNT])(void);
+  uint32_t shiftChain = 0;
+
+  std::deque<uint8_t> keyEvents[Geometry::BOARD_COUNT]; // Raw seesaw events per board
+  bool boardUnplugged[Geometry::BOARD_COUNT];
+  uint8_t boardPixels[Geometry::BOARD_COUNT][NEO_TRELLIS_NUM_KEYS * 3]; // What each board was sent
+  uint32_t shownPixels[Geometry::HEIGHT][Geometry::WIDTH];
+  char lcdText[LCD_ROWS][LCD_COLS + 1];
+  std::deque<midiEventPacket_t> midiIn;
+  uint8_t eeprom[EEPROM_SIZE];
+  uint64_t eepromFree = 0; // When the last write is done
+
+  void setListener(Listener *l) {
+    listener = l;
+  }
+
+  uint64_t now() {
+    return time;
+  }
+
+  void advance(uint32_t us) {
+    time += us;
+  }
+
+  uint8_t boardAt(uint8_t x, uint8_t y) {
+    return (y >> Geometry::BOARD_SHIFT) * Geometry::BOARD_COLS + (x >> Geometry::BOARD_SHIFT);
+  }
+
+  void queueKey(uint8_t x, uint8_t y, uint8_t edge) {
+    uint8_t board = boardAt(x, y);
+    uint8_t key = NEO_TRELLIS_XY(x % NEO_TRELLIS_NUM_COLS, y % NEO_TRELLIS_NUM_ROWS);
+    keyEventRaw event;
+    event.bit.EDGE = edge;
+    event.bit.NUM = NEO_TRELLIS_KEY(key);
+    keyEvents[board].push_back(event.reg);
+  }
+
+  void pressPad(uint8_t x, uint8_t y) {
+    queueKey(x, y, SEESAW_KEYPAD_EDGE_RISING);
+  }
+
+  void releasePad(uint8_t x, uint8_t y) {
+    queueKey(x, y, SEESAW_KEYPAD_EDGE_FALLING);
+  }
+
+  // Unplugged boards hold on to theirs
+  bool keysWaiting() {
+    for (uint8_t board = 0; board < Geometry::BOARD_COUNT; board++)
+      if (!boardUnplugged[board] && !keyEvents[board].empty())
+        return true;
+    return false;
+  }
+
+  void plugBoard(uint8_t x, uint8_t y, bool plugged) {
+    boardUnplugged[boardAt(x, y)] = !plugged;
+  }
+
+  // Changes the snapshot bits and fires the shared pin change interrupt
+  void setPins(volatile uint8_t &port, uint8_t bits, bool high) {
+    if (high)
+      port |= bits;
+    else
+      port &= ~bits;
+    if (interruptHandlers[COMMON_INTERRUPT])
+      interruptHandlers[COMMON_INTERRUPT]();
+  }
+
+  void turnEncoder(Encoder encoder, bool clockwise) {
+    volatile uint8_t &portA = encoder == LEFT ? PINB : PINF;
+    uint8_t bitA = encoder == LEFT ? PINB_L_ENCODER_A : PINF_R_ENCODER_A;
+    uint8_t bitB = encoder == LEFT ? PINB_L_ENCODER_B : PINB_R_ENCODER_B;
+
+    // Pins idle high. Clockwise, B falls first and A rises last.
+    if (clockwise) {
+      setPins(PINB, bitB, false);
+      setPins(portA, bitA, false);
+      setPins(PINB, bitB, true);
+      setPins(portA, bitA, true);
+    } else {
+      setPins(portA, bitA, false);
+      setPins(PINB, bitB, false);
+      setPins(portA, bitA, true);
+      setPins(PINB, bitB, true);
+    }
+  }
+
+  void setEncoderPressed(Encoder encoder, bool pressed) {
+    pinLevels[encoder == LEFT ? L_ENCODER_S : R_ENCODER_S] = pressed ? LOW : HIGH;
+  }
+
+  void setResetInput(bool high) {
+    setPins(PINC, PINC_RESET, high);
+  }
+
+  void receiveMidi(const uint8_t packet[4]) {
+    midiIn.push_back({ packet[0], packet[1], packet[2], packet[3] });
+  }
+
+  uint32_t shownPixel(uint8_t x, uint8_t y) {
+    return shownPixels[y][x];
+  }
+
+  const char *lcdLine(uint8_t row) {
+    return lcdText[row];
+  }
+
+  struct PowerOn {
+    PowerOn() {
+      memset(pinLevels, HIGH, sizeof(pinLevels)); // Inputs are pulled up
+      for (uint8_t row = 0; row < LCD_ROWS; row++) {
+        memset(lcdText[row], ' ', LCD_COLS);
+        lcdText[row][LCD_COLS] = 0;
+      }
+      memset(eeprom, 0xFF, sizeof(eeprom)); // Erased
+    }
+  } powerOn;
+}
+
+// --- ARDUINO ---
+void pinMode(uint8_t, uint8_t) {}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  bool rising = value && !Machine::pinLevels[pin];
+  Machine::pinLevels[pin] = value;
+  if (pin == SHIFT_LATCH && rising && Machine::listener)
+    Machine::listener->onOutputs(Machine::shiftChain);
+}
+
+int digitalRead(uint8_t pin) {
+  return Machine::pinLevels[pin];
+}
+
+// Chained registers: earlier bytes move on to later registers
+void shiftOut(uint8_t, uint8_t, uint8_t bitOrder, uint8_t value) {
+  uint8_t ordered = value;
+  if (bitOrder == LSBFIRST) {
+    ordered = 0;
+    for (uint8_t i = 0; i < 8; i++)
+      if (value & (1 << i))
+        ordered |= 0x80 >> i;
+  }
+  Machine::shiftChain = Machine::shiftChain << 8 | ordered;
+}
+
+void attachInterrupt(uint8_t interrupt, void (*handler)(void), int) {
+  Machine::interruptHandlers[interrupt] = handler;
+}
+
+unsigned long millis() {
+  return (uint32_t) (Machine::time / 1000);
+}
+
+unsigned long micros() {
+  return (uint32_t) Machine::time;
+}
+
+void delay(unsigned long ms) {
+  Machine::time += (uint64_t) ms * 1000;
+}
+
+void delayMicroseconds(unsigned int us) {
+  Machine::time += us;
+}
+
+namespace Machine {
+  // Like avr-libc, reads and writes wait out a write in progress
+  uint8_t *eepromCell(const void *address) {
+    time = std::max(time, eepromFree);
+    return eeprom + (uintptr_t) address % EEPROM_SIZE;
+  }
+}
+
+uint8_t eeprom_read_byte(const uint8_t *address) {
+  return *Machine::eepromCell(address);
+}
+
+void eeprom_read_block(void *to, const void *address, size_t size) {
+  for (size_t i = 0; i < size; i++)
+    ((uint8_t *) to)[i] = eeprom_read_byte((const uint8_t *) address + i);
+}
+
+void eeprom_write_byte(uint8_t *address, uint8_t value) {
+  *Machine::eepromCell(address) = value;
+  Machine::eepromFree = Machine::time + EEPROM_WRITE_US;
+}
+
+bool eeprom_is_ready() {
+  return Machine::time >= Machine::eepromFree;
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+  size_t n = 0;
+  while (size--)
+    n += write(*buffer++);
+  return n;
+}
+
+size_t Print::print(const __FlashStringHelper *s) {
+  return print(reinterpret_cast<const char *>(s));
+}
+
+size_t Print::print(const char *s) {
+  return write((const uint8_t *) s, strlen(s));
+}
+
+size_t Print::print(char c) {
+  return write((uint8_t) c);
+}
+
+size_t Print::print(int n, int base) {
+  return print((long) n, base);
+}
+
+size_t Print::print(unsigned int n, int base) {
+  return print((unsigned long) n, base);
+}
+
+size_t Print::print(long n, int base) {
+  if (base == 10 && n < 0)
+    return print('-') + printNumber(-n, 10);
+  return printNumber(n, base);
+}
+
+size_t Print::print(unsigned long n, int base) {
+  return printNumber(n, base);
+}
+
+size_t Print::print(double n, int digits) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.*f", digits, n);
+  return print(buf);
+}
+
+size_t Print::println(const char *s) {
+  return print(s) + print("\r\n");
+}
+
+// 32 bits, like unsigned long on the board
+size_t Print::printNumber(unsigned long n, int base) {
+  char buf[33];
+  char *p = buf + sizeof(buf) - 1;
+  uint32_t value = n;
+  *p = 0;
+  do {
+    uint8_t digit = value % base;
+    *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    value /= base;
+  } while (value);
+  return print(p);
+}
+
+// --- LIBRARIES ---
+void LiquidCrystal::begin(uint8_t, uint8_t) {
+  clear();
+}
+
+void LiquidCrystal::clear() {
+  for (uint8_t r = 0; r < LCD_ROWS; r++)
+    memset(Machine::lcdText[r], ' ', LCD_COLS);
+  col = row = 0;
+}
+
+void LiquidCrystal::setCursor(uint8_t c, uint8_t r) {
+  col = c;
+  row = r < LCD_ROWS ? r : LCD_ROWS - 1;
+}
+
+// Past the end of a line, characters go nowhere visible
+size_t LiquidCrystal::write(uint8_t c) {
+  if (col < LCD_COLS)
+    Machine::lcdText[row][col] = c;
+  col++;
+  return 1;
+}
+
+midiEventPacket_t MIDI_::read() {
+  if (Machine::midiIn.empty())
+    return { 0, 0, 0, 0 };
+  midiEventPacket_t packet = Machine::midiIn.front();
+  Machine::midiIn.pop_front();
+  return packet;
+}
+
+void MIDI_::sendMIDI(midiEventPacket_t packet) {
+  uint8_t bytes[4] = { packet.header, packet.byte1, packet.byte2, packet.byte3 };
+  if (Machine::listener)
+    Machine::listener->onMidi(bytes);
+}
+
+Adafruit_NeoTrellis::Adafruit_NeoTrellis(uint8_t addr) : _addr(addr) {
+  memset(_callbacks, 0, sizeof(_callbacks));
+}
+
+bool Adafruit_NeoTrellis::begin(uint8_t addr, int8_t) {
+  _addr = addr;
+  return !Machine::boardUnplugged[addr - Geometry::FIRST_BOARD_ADDRESS];
+}
+
+void Adafruit_NeoTrellis::registerCallback(uint8_t key, TrellisCallback (*cb)(keyEvent)) {
+  _callbacks[key] = cb;
+}
+
+void Adafruit_MultiTrellis::registerCallback(uint8_t x, uint8_t y, TrellisCallback (*cb)(keyEvent)) {
+  Adafruit_NeoTrellis *t = _trelli + (y / NEO_TRELLIS_NUM_ROWS) * _cols + x / NEO_TRELLIS_NUM_COLS;
+  t->registerCallback(NEO_TRELLIS_XY(x % NEO_TRELLIS_NUM_COLS, y % NEO_TRELLIS_NUM_ROWS), cb);
+}
+
+// Seesaw registers as the boards answer them. Like the real device, a
+// write that doesn't fit its 32-byte I2C buffer is refused whole, and
+// slots past the queued key events read as empty.
+static bool seesawTransfer(Twi::Job &job) {
+  uint8_t board = job.address - Geometry::FIRST_BOARD_ADDRESS;
+  if (board >= Geometry::BOARD_COUNT || Machine::boardUnplugged[board] || job.headerLength < 2)
+    return false;
+  uint8_t base = job.header[0], function = job.header[1];
+  std::deque<uint8_t> &events = Machine::keyEvents[board];
+
+  if (job.read) {
+    if (base != SEESAW_KEYPAD_BASE)
+      return false;
+    if (function == SEESAW_KEYPAD_COUNT) {
+      memset(job.data, 0, job.length);
+      job.data[0] = std::min<size_t>(events.size(), 0xFF);
+    } else if (function == SEESAW_KEYPAD_FIFO) {
+      for (uint8_t i = 0; i < job.length; i++) {
+        if (events.empty()) {
+          job.data[i] = 0xFF;
+        } else {
+          job.data[i] = events.front();
+          events.pop_front();
+        }
+      }
+    }
+    return true;
+  }
+
+  if (base != SEESAW_NEOPIXEL_BASE)
+    return true;
+  if (function == SEESAW_NEOPIXEL_BUF) {
+    if (job.headerLength != 4 || job.headerLength + job.length > SEESAW_BUFFER_SIZE)
+      return false;
+    uint8_t *pixels = Machine::boardPixels[board];
+    uint16_t offset = job.header[2] << 8 | job.header[3];
+    for (uint8_t i = 0; i < job.length && offset < sizeof(Machine::boardPixels[0]); i++)
+      pixels[offset++] = job.data[i];
+  } else if (function == SEESAW_NEOPIXEL_SHOW) {
+    uint8_t left = (board % Geometry::BOARD_COLS) * NEO_TRELLIS_NUM_COLS;
+    uint8_t top = (board / Geometry::BOARD_COLS) * NEO_TRELLIS_NUM_ROWS;
+    for (uint8_t key = 0; key < NEO_TRELLIS_NUM_KEYS; key++) {
+      const uint8_t *p = Machine::boardPixels[board] + key * 3;
+      Machine::shownPixels[top + NEO_TRELLIS_Y(key)][left + NEO_TRELLIS_X(key)] = seesaw_NeoPixel::Color(p[1], p[0], p[2]);
+    }
+  }
+  return true;
+}
+
+// Stands in for twi.cpp. Each job takes as long on the virtual clock as it
+// would on the bus, and acts on the board when it finishes.
+namespace Twi {
+  struct Transfer {
+    Job job;
+    uint64_t done;
+  };
+  std::deque<Transfer> transfers; // Submitted and not called back yet
+  uint64_t busFree = 0;
+  Faults faults; // The simulated bus never hangs, boards only go missing
+
+  void init() {}
+
+  bool submit(const Job &job) {
+    if (!space())
+      return false;
+    uint32_t bytes = 1 + job.headerLength + (job.read ? 1 : 0) + job.length;
+    uint64_t start = std::max(Machine::time, busFree);
+    busFree = start + bytes * TWI_BYTE_US + (job.read ? job.readDelay : 0);
+    transfers.push_back({ job, busFree });
+    return true;
+  }
+
+  uint8_t space() {
+    return TWI_QUEUE_SIZE - transfers.size();
+  }
+
+  bool idle() {
+    return transfers.empty();
+  }
+
+  Faults getFaults() {
+    return faults;
+  }
+
+  // Like the firmware, a job keeps its slot until its callback returns
+  void poll() {
+    while (!transfers.empty() && transfers.front().done <= Machine::time) {
+      Job job = transfers.front().job;
+      job.ok = seesawTransfer(job);
+      if (!job.ok && faults.nacks < 0xFFFF)
+        faults.nacks++;
+      if (job.callback)
+        job.callback(job.tag, job.ok);
+      transfers.pop_front();
+    }
+  }
+}
@@ -0,0 +1,74 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef machine_h
+#define machine_h
+
+// The simulated board the Arduino shims act on: a virtual clock, the grid,
+// the LCD, the shift registers and USB-MIDI. The simulator drives inputs
+// through here and watches outputs through a Listener. Deliberately free of
+// Arduino.h, so it can sit next to the standard library.
+
+#include <stdint.h>
+#include "../../firmware/controller-128/geometry.h"
+
+namespace Machine {
+  enum Encoder : uint8_t { LEFT, RIGHT };
+
+  struct Listener {
+    // Shift registers latched, clock out is bit 0
+    virtual void onOutputs(uint32_t outputs) = 0;
+    virtual void onMidi(const uint8_t packet[4]) = 0;
+  };
+
+  void setListener(Listener *listener);
+
+  // Microseconds since power on, never wraps
+  uint64_t now();
+  void advance(uint32_t us);
+
+  // Key events wait on their board until the firmware polls it
+  void pressPad(uint8_t x, uint8_t y);
+  void releasePad(uint8_t x, uint8_t y);
+  bool keysWaiting();
+
+  // The board with pad x, y stops or starts answering on the bus. It keeps
+  // its pixels and key events while it's gone.
+  void plugBoard(uint8_t x, uint8_t y, bool plugged);
+
+  // One detent, as the four pin changes a real encoder makes. Each change
+  // goes through the pin change interrupt, and the queue only holds 32, so
+  // run the loop between detents.
+  void turnEncoder(Encoder encoder, bool clockwise);
+  void setEncoderPressed(Encoder encoder, bool pressed);
+  void setResetInput(bool high);
+
+  // One USB-MIDI packet waiting to be read
+  void receiveMidi(const uint8_t packet[4]);
+
+  // What the grid last showed, and the display
+  uint32_t shownPixel(uint8_t x, uint8_t y);
+  const char *lcdLine(uint8_t row);
+}
+
+#endif
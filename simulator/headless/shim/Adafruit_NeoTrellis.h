@@ -0,0 +1,120 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef Adafruit_NeoTrellis_h
+#define Adafruit_NeoTrellis_h
+
+// Enough of the NeoTrellis library for the firmware. The firmware talks to
+// the boards through twi.h, which the simulated bus in machine.cpp answers
+// by address with the seesaw registers.
+
+#include <Arduino.h>
+
+#define NEO_TRELLIS_NUM_ROWS 4
+#define NEO_TRELLIS_NUM_COLS 4
+#define NEO_TRELLIS_NUM_KEYS (NEO_TRELLIS_NUM_ROWS * NEO_TRELLIS_NUM_COLS)
+
+#define NEO_TRELLIS_X(k) ((k) % 4)
+#define NEO_TRELLIS_Y(k) ((k) / 4)
+#define NEO_TRELLIS_XY(x, y) ((y) * NEO_TRELLIS_NUM_COLS + (x))
+
+// Trellis key to seesaw key and back
+#define NEO_TRELLIS_KEY(x) (((x) / 4) * 8 + ((x) % 4))
+#define NEO_TRELLIS_SEESAW_KEY(x) (((x) / 8) * 4 + ((x) % 8))
+
+#define SEESAW_NEOPIXEL_BASE 0x0E
+#define SEESAW_NEOPIXEL_BUF 0x04
+#define SEESAW_NEOPIXEL_SHOW 0x05
+#define SEESAW_KEYPAD_BASE 0x10
+#define SEESAW_KEYPAD_COUNT 0x04
+#define SEESAW_KEYPAD_FIFO 0x10
+
+enum {
+  SEESAW_KEYPAD_EDGE_HIGH = 0,
+  SEESAW_KEYPAD_EDGE_LOW,
+  SEESAW_KEYPAD_EDGE_FALLING,
+  SEESAW_KEYPAD_EDGE_RISING
+};
+
+union keyEventRaw {
+  struct {
+    uint8_t EDGE : 2;
+    uint8_t NUM : 6;
+  } bit;
+  uint8_t reg;
+};
+
+union keyEvent {
+  struct {
+    uint16_t EDGE : 2;
+    uint16_t NUM : 14;
+  } bit;
+  uint16_t reg;
+};
+
+typedef void *TrellisCallback;
+
+// The local copy of a board's pixels, GRB
+class seesaw_NeoPixel {
+public:
+  static uint32_t Color(uint8_t r, uint8_t g, uint8_t b) {
+    return (uint32_t) r << 16 | (uint32_t) g << 8 | b;
+  }
+
+  uint8_t *getPixels() const { return pixels; }
+
+private:
+  mutable uint8_t pixels[NEO_TRELLIS_NUM_KEYS * 3] = {};
+};
+
+class Adafruit_NeoTrellis {
+public:
+  Adafruit_NeoTrellis(uint8_t addr = 0x2E);
+
+  // False for a board that's unplugged
+  bool begin(uint8_t addr = 0x2E, int8_t flow = -1);
+  void registerCallback(uint8_t key, TrellisCallback (*cb)(keyEvent));
+  void activateKey(uint8_t, uint8_t, bool = true) {}
+
+  seesaw_NeoPixel pixels;
+
+protected:
+  uint8_t _addr;
+  TrellisCallback (*_callbacks[NEO_TRELLIS_NUM_KEYS])(keyEvent);
+};
+
+class Adafruit_MultiTrellis {
+public:
+  Adafruit_MultiTrellis(Adafruit_NeoTrellis *trelli, uint8_t rows, uint8_t cols)
+    : _rows(rows), _cols(cols), _trelli(trelli) {}
+
+  bool begin() { return true; }
+  void registerCallback(uint8_t x, uint8_t y, TrellisCallback (*cb)(keyEvent));
+  void activateKey(uint8_t, uint8_t, uint8_t, bool = true) {}
+
+protected:
+  uint8_t _rows, _cols;
+  Adafruit_NeoTrellis *_trelli;
+};
+
+#endif
@@ -0,0 +1,142 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+// The part of the Arduino API the firmware uses, backed by the simulated
+// board in machine.cpp. Time only moves when the simulator or a delay moves
+// it. Unlike the ATmega32U4, int is 32 bits here.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+#define F_CPU 16000000UL
+#define clockCyclesPerMicrosecond() (F_CPU / 1000000L)
+
+// Macros as on the AVR core, so mixed argument types behave the same
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+// Flash is ordinary memory here, but F() strings keep their own type as on
+// the AVR core, so a flash string passed as a RAM one fails to build
+#define PROGMEM
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(s))
+#define pgm_read_byte(p) (*(const uint8_t *) (p))
+#define pgm_read_word(p) (*(const uint16_t *) (p))
+#define pgm_read_dword(p) (*(const uint32_t *) (p))
+
+// Interrupt numbers are pin numbers here
+#define digitalPinToInterrupt(pin) (pin)
+
+#define _BV(bit) (1 << (bit))
+#define ISR(vector) extern "C" void vector(void)
+#define RAMEND 0x0AFF
+
+// Port registers the firmware reads directly. PINx are driven by the
+// simulator, the rest are only written.
+extern volatile uint8_t PINB, PINC, PIND, PINF, SREG;
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+extern volatile uint16_t TCNT1;
+#define TOV1 0
+#define TOIE1 0
+#define CS10 0
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+void shiftOut(uint8_t dataPin, uint8_t clockPin, uint8_t bitOrder, uint8_t value);
+void attachInterrupt(uint8_t interrupt, void (*handler)(void), int mode);
+
+// 32 bits wide and wrapping, as on the board
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+inline void noInterrupts() {}
+inline void interrupts() {}
+#define cli() noInterrupts()
+#define sei() interrupts()
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  size_t write(const uint8_t *buffer, size_t size);
+
+  size_t print(const __FlashStringHelper *s);
+  size_t print(const char *s);
+  size_t print(char c);
+  size_t print(int n, int base = 10);
+  size_t print(unsigned int n, int base = 10);
+  size_t print(long n, int base = 10);
+  size_t print(unsigned long n, int base = 10);
+  size_t print(double n, int digits = 2);
+  size_t println(const char *s = "");
+  template<typename T> size_t println(T value) { return print(value) + println(); }
+
+private:
+  size_t printNumber(unsigned long n, int base);
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+};
+
+// Nothing is ever received, and whatever is sent is dropped
+class Serial_ : public Stream {
+public:
+  void begin(unsigned long) {}
+  operator bool() { return true; }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int availableForWrite() { return 64; }
+  size_t write(uint8_t) override { return 1; }
+  using Print::write;
+  void flush() {}
+};
+extern Serial_ Serial;
+
+#endif
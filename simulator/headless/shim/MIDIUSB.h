@@ -0,0 +1,51 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef MIDIUSB_h
+#define MIDIUSB_h
+
+#include <Arduino.h>
+
+typedef struct {
+  uint8_t header;
+  uint8_t byte1;
+  uint8_t byte2;
+  uint8_t byte3;
+} midiEventPacket_t;
+
+// Sent packets go to the trace, received ones come from the script
+class MIDI_ {
+public:
+  midiEventPacket_t read();
+  void sendMIDI(midiEventPacket_t packet);
+  void flush() {}
+
+protected:
+  uint8_t pluggedEndpoint = 4; // After the CDC serial port's
+};
+extern MIDI_ MidiUSB;
+
+// The host takes every packet, so there's always room
+inline uint8_t USB_SendSpace(uint8_t) { return 64; }
+
+#endif
@@ -0,0 +1,37 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef eeprom_h
+#define eeprom_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The 32U4's 1 KB, erased to 0xFF at power on. A write keeps it busy for
+// as long on the virtual clock as it would on the chip.
+uint8_t eeprom_read_byte(const uint8_t *address);
+void eeprom_read_block(void *to, const void *address, size_t size);
+void eeprom_write_byte(uint8_t *address, uint8_t value);
+bool eeprom_is_ready();
+
+#endif
@@ -0,0 +1,519 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+// Backs up and restores every pattern, the song, gates and tempo over the
+// controller's USB serial port.
+//
+//   c128link dump <port> <file>
+//   c128link load <port> <file>
+//   c128link stats <port>
+//   c128link faults <port>
+//   c128link record <port> <file>
+//   c128link replay <file>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "frames.h"
+
+#define SET_MAGIC "C128"
+#define RECORDING_MAGIC "C12R"
+#define TIMEOUT_MS 1000
+#define BUSY_RETRIES 50
+
+using namespace Protocol;
+using Clock = std::chrono::steady_clock;
+
+// A set file is the magic, the protocol version, every pattern image and the song image
+struct Set {
+  uint8_t patterns[BANK_PATTERNS][PATTERN_IMAGE_SIZE];
+  uint8_t song[SONG_IMAGE_SIZE];
+};
+
+// Bytes read past the end of a frame are kept for the next one
+struct Port {
+  int fd;
+  FrameParser parser;
+  uint8_t buf[256];
+  size_t pos = 0, len = 0;
+};
+
+static int openPort(const char *path) {
+  int fd = open(path, O_RDWR | O_NOCTTY);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+  termios tio;
+  if (tcgetattr(fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, B115200);
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+  tcflush(fd, TCIOFLUSH);
+  return fd;
+}
+
+static bool sendFrame(int fd, uint8_t type, const std::vector<uint8_t> &payload) {
+  std::vector<uint8_t> bytes = encodeFrame(type, payload);
+  return write(fd, bytes.data(), bytes.size()) == (ssize_t) bytes.size();
+}
+
+// Waits for the next good frame, false on timeout
+static bool readFrame(Port &port, Frame &frame) {
+  Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(TIMEOUT_MS);
+  for (;;) {
+    while (port.pos < port.len)
+      if (port.parser.push(port.buf[port.pos++], frame))
+        return true;
+
+    int left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+    if (left <= 0)
+      return false;
+    pollfd p = { port.fd, POLLIN, 0 };
+    if (poll(&p, 1, left) <= 0)
+      continue;
+    ssize_t n = read(port.fd, port.buf, sizeof(port.buf));
+    port.pos = 0;
+    port.len = n > 0 ? n : 0;
+  }
+}
+
+static bool dump(Port &port, Set &set) {
+  if (!sendFrame(port.fd, DUMP, {}))
+    return false;
+
+  Frame frame;
+  uint16_t received = 0;
+  bool gotSong = false;
+  while (!gotSong) {
+    if (!readFrame(port, frame)) {
+      fprintf(stderr, "timed out waiting for the dump\n");
+      return false;
+    }
+    if (frame.type == PATTERN && !frame.payload.empty() && frame.payload[0] < BANK_PATTERNS) {
+      if (!unpackImage(frame.payload, 1, set.patterns[frame.payload[0]], PATTERN_IMAGE_SIZE)) {
+        fprintf(stderr, "bad image for pattern %d\n", frame.payload[0] + 1);
+        return false;
+      }
+      received |= 1 << frame.payload[0];
+    } else if (frame.type == SONG) {
+      if (!unpackImage(frame.payload, 0, set.song, SONG_IMAGE_SIZE)) {
+        fprintf(stderr, "bad song image\n");
+        return false;
+      }
+      gotSong = true;
+    }
+  }
+  if (received != (1UL << BANK_PATTERNS) - 1) {
+    fprintf(stderr, "dump was missing patterns\n");
+    return false;
+  }
+  return true;
+}
+
+// Sends one frame and waits for its acknowledgement, retrying while the
+// device is busy or the frame got damaged
+static bool loadFrame(Port &port, uint8_t type, const std::vector<uint8_t> &payload) {
+  for (int attempt = 0; attempt < BUSY_RETRIES; attempt++) {
+    if (!sendFrame(port.fd, type, payload))
+      return false;
+
+    Frame frame;
+    do {
+      if (!readFrame(port, frame)) {
+        fprintf(stderr, "timed out waiting for an acknowledgement\n");
+        return false;
+      }
+    } while (frame.type != ACK || frame.payload.size() != 2 || frame.payload[0] != type);
+
+    switch (frame.payload[1]) {
+      case OK:
+        return true;
+      case BUSY:
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        // fall through
+      case BAD_CRC:
+        continue;
+      default:
+        fprintf(stderr, "device rejected the frame (status %d)\n", frame.payload[1]);
+        return false;
+    }
+  }
+  fprintf(stderr, "device stayed busy\n");
+  return false;
+}
+
+static bool load(Port &port, const Set &set) {
+  for (int i = 0; i < BANK_PATTERNS; i++)
+    if (!loadFrame(port, PATTERN, packImage(i, set.patterns[i], PATTERN_IMAGE_SIZE)))
+      return false;
+  // Song last: on a playing device it goes live with the playing pattern at its next wrap
+  return loadFrame(port, SONG, packImage(-1, set.song, SONG_IMAGE_SIZE));
+}
+
+static const char *const PROBE_NAMES[PROBE_COUNT] = {
+  "button", "encoder", "clock", "reset", "tick",
+  "trellis read", "trellis show", "lcd char", "shift out", "link"
+};
+static const char *const MARK_NAMES[MARK_COUNT] = {
+  "interrupt queue", "clock queue", "serial rx"
+};
+static const char *const TASK_NAMES[TASK_COUNT] = {
+  "clock", "trellis", "encoders", "pixels", "display", "link", "bank"
+};
+static const char *const TALLY_NAMES[TALLY_COUNT] = {
+  "bank hits", "bank misses", "bank loads", "bank writes"
+};
+
+// Only answered by firmware built with TELEMETRY_ENABLED
+static bool stats(Port &port) {
+  if (!sendFrame(port.fd, TELEMETRY, {}))
+    return false;
+
+  Frame frame;
+  do {
+    if (!readFrame(port, frame)) {
+      fprintf(stderr, "timed out waiting for telemetry\n");
+      return false;
+    }
+    if (frame.type == ACK && frame.payload.size() == 2 && frame.payload[0] == TELEMETRY) {
+      fprintf(stderr, "firmware was built without telemetry\n");
+      return false;
+    }
+  } while (frame.type != TELEMETRY);
+
+  TelemetryImage image;
+  if (!unpackImage(frame.payload, 0, (uint8_t *) &image, sizeof(image))) {
+    fprintf(stderr, "bad telemetry image\n");
+    return false;
+  }
+
+  double cyclesPerUs = image.cpuHz / 1e6;
+  printf("%-16s %10s %10s %10s\n", "probe", "calls", "avg us", "max us");
+  for (int i = 0; i < PROBE_COUNT; i++) {
+    const ProbeStats &p = image.probes[i];
+    printf("%-16s %10u %10.1f %10.1f\n", PROBE_NAMES[i], (unsigned) p.calls,
+      p.calls ? p.cycles / cyclesPerUs / p.calls : 0.0, p.maxCycles / cyclesPerUs);
+  }
+
+  printf("\nloop time\n");
+  for (int i = 0; i < LOOP_BUCKETS; i++)
+    if (image.loopHistogram[i])
+      printf("  %6lu-%-6lu us %6u\n", 1UL << i, (2UL << i) - 1, image.loopHistogram[i]);
+
+  printf("\nhigh water\n");
+  for (int i = 0; i < MARK_COUNT; i++)
+    printf("  %-16s %3u\n", MARK_NAMES[i], image.marks[i]);
+
+  printf("\n%-16s %10s %10s %10s\n", "task", "missed", "overruns", "max us");
+  for (int i = 0; i < TASK_COUNT; i++) {
+    const TaskStats &t = image.tasks[i];
+    printf("%-16s %10u %10u %10u\n", TASK_NAMES[i], t.missed, t.overruns, t.maxMicros);
+  }
+
+  printf("\ncounts\n");
+  for (int i = 0; i < TALLY_COUNT; i++)
+    printf("  %-16s %5u\n", TALLY_NAMES[i], image.tallies[i]);
+  printf("\nstack never used: %u bytes\n", image.stackFree);
+  return true;
+}
+
+// Prints a board mask as a grid, row by row from the top left
+static void printBoards(const char *name, uint16_t mask) {
+  printf("%s\n", name);
+  for (int r = 0; r < Geometry::BOARD_ROWS; r++) {
+    printf(" ");
+    for (int c = 0; c < Geometry::BOARD_COLS; c++)
+      printf(" %c", mask >> (r * Geometry::BOARD_COLS + c) & 1 ? 'X' : '.');
+    printf("\n");
+  }
+}
+
+static bool faults(Port &port) {
+  if (!sendFrame(port.fd, FAULTS, {}))
+    return false;
+
+  Frame frame;
+  do {
+    if (!readFrame(port, frame)) {
+      fprintf(stderr, "timed out waiting for fault counts\n");
+      return false;
+    }
+    if (frame.type == ACK && frame.payload.size() == 2 && frame.payload[0] == FAULTS) {
+      fprintf(stderr, "firmware doesn't count faults\n");
+      return false;
+    }
+  } while (frame.type != FAULTS);
+
+  FaultImage image;
+  if (!unpackImage(frame.payload, 0, (uint8_t *) &image, sizeof(image))) {
+    fprintf(stderr, "bad fault image\n");
+    return false;
+  }
+
+  printf("i2c nacks       %6u\n", image.nacks);
+  printf("i2c bus errors  %6u\n", image.busErrors);
+  printf("i2c timeouts    %6u\n", image.timeouts);
+  printBoards("\nboards offline", image.offlineBoards);
+  printBoards("\nboards missing since power on", image.missingBoards);
+  return true;
+}
+
+// Only answered by firmware built with RECORDER_ENABLED
+static bool record(Port &port, Event *events) {
+  if (!sendFrame(port.fd, RECORDING, {}))
+    return false;
+
+  uint32_t received = 0;
+  while (received != (1UL << RECORDER_CHUNKS) - 1) {
+    Frame frame;
+    if (!readFrame(port, frame)) {
+      fprintf(stderr, "timed out waiting for the recording\n");
+      return false;
+    }
+    if (frame.type == ACK && frame.payload.size() == 2 && frame.payload[0] == RECORDING) {
+      fprintf(stderr, "firmware was built without the recorder\n");
+      return false;
+    }
+    if (frame.type != RECORDING || frame.payload.empty() || frame.payload[0] >= RECORDER_CHUNKS)
+      continue;
+    uint8_t chunk = frame.payload[0];
+    if (!unpackImage(frame.payload, 1, (uint8_t *) (events + chunk * RECORDER_CHUNK),
+                     RECORDER_CHUNK * sizeof(Event))) {
+      fprintf(stderr, "bad recording chunk %d\n", chunk);
+      return false;
+    }
+    received |= 1UL << chunk;
+  }
+  return true;
+}
+
+static const char *const CLOCK_NAMES[] = { "software", "hardware", "midi" };
+static const char *const ENCODER_NAMES[] = { "left", "right" };
+
+// Events a replay feeds in, the rest are what the firmware made of them
+static bool isInput(uint8_t kind) {
+  return kind == EVENT_PRESS || kind == EVENT_RELEASE || kind == EVENT_TURN
+    || kind == EVENT_PUSH || kind == EVENT_LET || kind == EVENT_RESET;
+}
+
+// Writes the recording as a c128sim script. Inputs become commands at the
+// time they were recorded, everything else becomes a comment to compare the
+// replay's trace against.
+static void replay(const Event *events) {
+  int first = 0;
+  while (first < RECORDER_EVENTS && events[first].kind == EVENT_NONE)
+    first++;
+  if (first == RECORDER_EVENTS) {
+    printf("# Nothing was recorded\n");
+    return;
+  }
+
+  // Times are from power on as far as the simulator is concerned
+  uint32_t start = events[first].time;
+  if (events[first].kind != EVENT_POWER_ON)
+    printf("# The recorder had wrapped, so what came before the first event is\n"
+           "# missing and the replay can differ from what the unit did\n");
+
+  bool turned[2] = { false, false };
+  uint32_t prevAt = 0;
+  for (int i = first; i < RECORDER_EVENTS; i++) {
+    const Event &e = events[i];
+    uint32_t time = e.time - start;
+    unsigned value = e.value;
+    if (isInput(e.kind) && time != prevAt) {
+      printf("at %u\n", time);
+      prevAt = time;
+    }
+    switch (e.kind) {
+      case EVENT_POWER_ON:
+        printf("# %10u power on\n", time);
+        break;
+      case EVENT_PRESS:
+      case EVENT_RELEASE: {
+        // Released in the same poll is a tap, which the simulator keeps together
+        const char *command = e.kind == EVENT_PRESS ? "press" : "release";
+        if (e.kind == EVENT_PRESS && i + 1 < RECORDER_EVENTS && events[i + 1].kind == EVENT_RELEASE
+            && events[i + 1].value == e.value && events[i + 1].time == e.time) {
+          command = "tap";
+          i++;
+        }
+        printf("%s %u %u\n", command, value % Geometry::WIDTH, value / Geometry::WIDTH);
+        break;
+      }
+      case EVENT_TURN: {
+        uint8_t encoder = value >> 7 & 1;
+        int detents = (int8_t) (value << 1) >> 1;
+        // The decoder takes a detent to find its feet after power on
+        if (!turned[encoder])
+          printf("turn %s %d\n", ENCODER_NAMES[encoder], detents < 0 ? -1 : 1);
+        turned[encoder] = true;
+        printf("turn %s %d\n", ENCODER_NAMES[encoder], detents);
+        break;
+      }
+      case EVENT_PUSH:
+      case EVENT_LET:
+        printf("%s %s\n", e.kind == EVENT_PUSH ? "push" : "let", ENCODER_NAMES[value & 1]);
+        break;
+      case EVENT_RESET:
+        printf("reset\n");
+        break;
+      case EVENT_CLOCK_RISING:
+      case EVENT_CLOCK_FALLING:
+        printf("# %10u clock %s, %s\n", time, e.kind == EVENT_CLOCK_RISING ? "rising" : "falling",
+          value < 3 ? CLOCK_NAMES[value] : "?");
+        break;
+      case EVENT_OUTPUTS:
+        printf("# %10u outputs %0*X\n", time, GRID_ROW_BYTES * 2, value);
+        break;
+      default:
+        printf("# %10u unknown event %d\n", time, e.kind);
+        break;
+    }
+  }
+  // Run on to the end, for the outputs after the last input
+  printf("at %u\n", events[RECORDER_EVENTS - 1].time - start);
+}
+
+static bool writeRecording(const char *path, const Event *events) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  uint8_t version = PROTOCOL_VERSION;
+  bool ok = fwrite(RECORDING_MAGIC, 4, 1, f) == 1 && fwrite(&version, 1, 1, f) == 1
+    && fwrite(events, sizeof(Event), RECORDER_EVENTS, f) == RECORDER_EVENTS;
+  return fclose(f) == 0 && ok;
+}
+
+static bool readRecording(const char *path, Event *events) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  char magic[4];
+  uint8_t version;
+  bool ok = fread(magic, 4, 1, f) == 1 && !memcmp(magic, RECORDING_MAGIC, 4)
+    && fread(&version, 1, 1, f) == 1 && version == PROTOCOL_VERSION
+    && fread(events, sizeof(Event), RECORDER_EVENTS, f) == RECORDER_EVENTS;
+  fclose(f);
+  if (!ok)
+    fprintf(stderr, "%s: not a version %d recording\n", path, PROTOCOL_VERSION);
+  return ok;
+}
+
+static bool writeSet(const char *path, const Set &set) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  uint8_t version = PROTOCOL_VERSION;
+  bool ok = fwrite(SET_MAGIC, 4, 1, f) == 1 && fwrite(&version, 1, 1, f) == 1
+    && fwrite(&set, sizeof(set), 1, f) == 1;
+  return fclose(f) == 0 && ok;
+}
+
+static bool readSet(const char *path, Set &set) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  char magic[4];
+  uint8_t version;
+  bool ok = fread(magic, 4, 1, f) == 1 && !memcmp(magic, SET_MAGIC, 4)
+    && fread(&version, 1, 1, f) == 1 && version == PROTOCOL_VERSION
+    && fread(&set, sizeof(set), 1, f) == 1;
+  fclose(f);
+  if (!ok)
+    fprintf(stderr, "%s: not a version %d set file\n", path, PROTOCOL_VERSION);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  Event events[RECORDER_EVENTS];
+  if (argc == 3 && !strcmp(argv[1], "replay")) {
+    if (!readRecording(argv[2], events))
+      return 1;
+    replay(events);
+    return 0;
+  }
+  if (argc == 4 && !strcmp(argv[1], "record")) {
+    Port port;
+    port.fd = openPort(argv[2]);
+    if (port.fd < 0)
+      return 1;
+    bool ok = record(port, events) && writeRecording(argv[3], events);
+    close(port.fd);
+    if (ok)
+      printf("Recorded to %s\n", argv[3]);
+    return ok ? 0 : 1;
+  }
+  if (argc == 3 && (!strcmp(argv[1], "stats") || !strcmp(argv[1], "faults"))) {
+    Port port;
+    port.fd = openPort(argv[2]);
+    if (port.fd < 0)
+      return 1;
+    bool ok = !strcmp(argv[1], "stats") ? stats(port) : faults(port);
+    close(port.fd);
+    return ok ? 0 : 1;
+  }
+  if (argc != 4 || (strcmp(argv[1], "dump") && strcmp(argv[1], "load"))) {
+    fprintf(stderr, "usage: %s dump|load|record <port> <file>\n       %s stats|faults <port>\n"
+      "       %s replay <file>\n", argv[0], argv[0], argv[0]);
+    return 2;
+  }
+  bool dumping = !strcmp(argv[1], "dump");
+
+  Set set;
+  if (!dumping && !readSet(argv[3], set))
+    return 1;
+
+  Port port;
+  port.fd = openPort(argv[2]);
+  if (port.fd < 0)
+    return 1;
+
+  Clock::time_point start = Clock::now();
+  bool ok = dumping ? dump(port, set) && writeSet(argv[3], set) : load(port, set);
+  close(port.fd);
+  if (!ok)
+    return 1;
+
+  long ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+  printf("%s %s in %ld ms\n", dumping ? "Dumped to" : "Loaded", argv[3], ms);
+  return 0;
+}
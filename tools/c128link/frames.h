@@ -0,0 +1,125 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef frames_h
+#define frames_h
+
+// Framing shared by the host tool and the stand-in device
+
+#include <stdint.h>
+#include <vector>
+#include "../../firmware/controller-128/protocol.h"
+
+struct Frame {
+  uint8_t type;
+  std::vector<uint8_t> payload;
+};
+
+struct VectorSink {
+  std::vector<uint8_t> *out;
+  void operator()(uint8_t b) { out->push_back(b); }
+};
+
+// Whole frame: SYNC, type, length, payload, CRC
+inline std::vector<uint8_t> encodeFrame(uint8_t type, const std::vector<uint8_t> &payload) {
+  std::vector<uint8_t> out;
+  out.push_back(PROTOCOL_SYNC);
+  out.push_back(type);
+  out.push_back((uint8_t) payload.size());
+  out.insert(out.end(), payload.begin(), payload.end());
+
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 1; i < out.size(); i++)
+    crc = Protocol::crcUpdate(crc, out[i]);
+  out.push_back(crc & 0xFF);
+  out.push_back(crc >> 8);
+  return out;
+}
+
+// Payload for an image frame: optional index byte, then the packed image
+inline std::vector<uint8_t> packImage(int index, const uint8_t *image, uint8_t size) {
+  std::vector<uint8_t> payload;
+  if (index >= 0)
+    payload.push_back((uint8_t) index);
+  VectorSink sink { &payload };
+  Protocol::pack(image, size, sink);
+  return payload;
+}
+
+inline bool unpackImage(const std::vector<uint8_t> &payload, size_t from, uint8_t *image, uint8_t size) {
+  Protocol::Unpacker unpacker;
+  unpacker.begin(image, size);
+  for (size_t i = from; i < payload.size(); i++)
+    unpacker.push(payload[i]);
+  return unpacker.complete();
+}
+
+// Byte at a time frame parser, drops frames with a bad CRC
+class FrameParser {
+  enum { SYNC, TYPE, LENGTH, PAYLOAD, CRC_LOW, CRC_HIGH } state = SYNC;
+  Frame frame;
+  uint8_t left = 0;
+  uint16_t crc = 0, received = 0;
+
+public:
+  // Returns true when b completes a good frame, which is then in out
+  bool push(uint8_t b, Frame &out) {
+    switch (state) {
+      case SYNC:
+        if (b == PROTOCOL_SYNC) {
+          crc = 0xFFFF;
+          state = TYPE;
+        }
+        return false;
+      case TYPE:
+        frame.type = b;
+        frame.payload.clear();
+        state = LENGTH;
+        break;
+      case LENGTH:
+        left = b;
+        state = left ? PAYLOAD : CRC_LOW;
+        break;
+      case PAYLOAD:
+        frame.payload.push_back(b);
+        if (!--left)
+          state = CRC_LOW;
+        break;
+      case CRC_LOW:
+        received = b;
+        state = CRC_HIGH;
+        return false;
+      case CRC_HIGH:
+        received |= b << 8;
+        state = SYNC;
+        if (received != crc)
+          return false;
+        out = frame;
+        return true;
+    }
+    crc = Protocol::crcUpdate(crc, b);
+    return false;
+  }
+};
+
+#endif
@@ -0,0 +1,174 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+// Stand-in for the controller on a pseudo terminal, for trying c128link
+// without hardware. Prints the port to pass to c128link, then answers dumps
+// and loads from a set held in memory until killed. A recording is a few
+// seconds of playing pattern 1 with one step set.
+//
+//   standin [--busy N] [--fill]
+//
+// --busy N answers the first N song loads with BUSY, like a device waiting
+// for its playing pattern to wrap. --fill starts with steps set instead of
+// an empty set.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "frames.h"
+
+
+using namespace Protocol;
+
+static uint8_t patterns[BANK_PATTERNS][PATTERN_IMAGE_SIZE];
+static uint8_t song[SONG_IMAGE_SIZE];
+
+static void initSet(bool fill) {
+  for (int i = 0; i < BANK_PATTERNS; i++) {
+    uint8_t *p = patterns[i];
+    memset(p, 0, PATTERN_IMAGE_SIZE);
+    p[PATTERN_LENGTH] = 16;
+    memset(p + PATTERN_CONDITIONS, 0xF0, 8);
+    if (fill)
+      for (int s = 0; s < 32; s++)
+        p[PATTERN_STATE + s] = rand();
+  }
+  memset(song, 0, SONG_IMAGE_SIZE);
+  song[SONG_LENGTH] = 16;
+  song[SONG_TEMPO] = 6000 & 0xFF;
+  song[SONG_TEMPO + 1] = 6000 >> 8;
+}
+
+static Event recording[RECORDER_EVENTS];
+
+// Power on, step 1 of channel 1 set, play pattern, then the clock at 60 BPM
+static void initRecording() {
+  int n = 0;
+  recording[n++] = { 0, EVENT_POWER_ON, 0 };
+  recording[n++] = { 1500000, EVENT_PRESS, Geometry::WIDTH };
+  recording[n++] = { 1500000, EVENT_RELEASE, Geometry::WIDTH };
+  uint8_t play = Geometry::controlX(Geometry::CONTROL_PLAY_PATTERN);
+  recording[n++] = { 2000000, EVENT_PRESS, play };
+  recording[n++] = { 2100000, EVENT_RELEASE, play };
+  uint32_t time = 2125000;
+  for (int step = 0; n + 4 <= RECORDER_EVENTS; step++) {
+    recording[n++] = { time, EVENT_CLOCK_RISING, 0 };
+    recording[n++] = { time, EVENT_OUTPUTS, (Geometry::RowMask) (step % 16 ? 1 : 3) };
+    time += 125000;
+    recording[n++] = { time, EVENT_CLOCK_FALLING, 0 };
+    recording[n++] = { time, EVENT_OUTPUTS, 0 };
+    time += 125000;
+  }
+}
+
+static void send(int fd, uint8_t type, const std::vector<uint8_t> &payload) {
+  std::vector<uint8_t> bytes = encodeFrame(type, payload);
+  if (write(fd, bytes.data(), bytes.size()) != (ssize_t) bytes.size())
+    perror("write");
+}
+
+static void ack(int fd, uint8_t type, Status status) {
+  send(fd, ACK, { type, (uint8_t) status });
+}
+
+int main(int argc, char **argv) {
+  int busy = 0;
+  bool fill = false;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--busy") && i + 1 < argc)
+      busy = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--fill"))
+      fill = true;
+  }
+  initSet(fill);
+  initRecording();
+
+  int fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (fd < 0 || grantpt(fd) || unlockpt(fd)) {
+    perror("pty");
+    return 1;
+  }
+  termios tio;
+  tcgetattr(fd, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(fd, TCSANOW, &tio);
+  printf("%s\n", ptsname(fd));
+  fflush(stdout);
+
+  FrameParser parser;
+  Frame frame;
+  uint8_t buf[64];
+  for (;;) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0) {
+      // EIO until something opens the other side
+      usleep(10000);
+      continue;
+    }
+    for (ssize_t i = 0; i < n; i++) {
+      if (!parser.push(buf[i], frame))
+        continue;
+
+      if (frame.type == DUMP) {
+        for (int p = 0; p < BANK_PATTERNS; p++)
+          send(fd, PATTERN, packImage(p, patterns[p], PATTERN_IMAGE_SIZE));
+        send(fd, SONG, packImage(-1, song, SONG_IMAGE_SIZE));
+      } else if (frame.type == PATTERN) {
+        uint8_t image[PATTERN_IMAGE_SIZE];
+        if (frame.payload.empty() || frame.payload[0] >= BANK_PATTERNS
+            || !unpackImage(frame.payload, 1, image, PATTERN_IMAGE_SIZE)) {
+          ack(fd, PATTERN, BAD_IMAGE);
+          continue;
+        }
+        memcpy(patterns[frame.payload[0]], image, PATTERN_IMAGE_SIZE);
+        ack(fd, PATTERN, OK);
+      } else if (frame.type == SONG) {
+        uint8_t image[SONG_IMAGE_SIZE];
+        if (!unpackImage(frame.payload, 0, image, SONG_IMAGE_SIZE)) {
+          ack(fd, SONG, BAD_IMAGE);
+        } else if (busy > 0) {
+          busy--;
+          ack(fd, SONG, BUSY);
+        } else {
+          memcpy(song, image, SONG_IMAGE_SIZE);
+          ack(fd, SONG, OK);
+        }
+      } else if (frame.type == FAULTS) {
+        FaultImage faults = {};
+        send(fd, FAULTS, packImage(-1, (const uint8_t *) &faults, sizeof(faults)));
+      } else if (frame.type == RECORDING) {
+        for (int c = 0; c < RECORDER_CHUNKS; c++)
+          send(fd, RECORDING, packImage(c, (const uint8_t *) (recording + c * RECORDER_CHUNK),
+                                        RECORDER_CHUNK * sizeof(Event)));
+      } else {
+        ack(fd, frame.type, UNKNOWN);
+      }
+    }
+  }
+}
@@ -0,0 +1,111 @@
+/*
+
+    mplsartindustry/controller-128
+    Copyright (c) 2020-2024 held jointly by the individual authors.
+
+    This file is part of mplsartindustry/controller-128.
+
+    mplsartindustry/controller-128 is free software: you can redistribute
+    it and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    mplsartindustry/controller-128 is distributed in the hope that it will
+    be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+    of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with mplsartindustry/controller-128.  If not, please see
+    <http://www.gnu.org/licenses/>.
+
+*/
+
+// Loopback stand-in for slaving to USB-MIDI clock. Plays a steady 24 PPQN
+// clock into the firmware's TempoFollower the way the controller would see
+// it: ticks land on 1 ms USB frames after some host send jitter, and are only
+// read when loop() comes around. Reports how evenly the resulting clock
+// phase edges come out, next to stepping straight off every third tick.
+//
+//   midijitter [bpm] [loop period us] [host jitter us]
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "../../firmware/controller-128/tempo_follower.h"
+
+#define TICKS 24 * 64
+#define USB_FRAME_US 1000
+
+struct Stats {
+  double mean = 0, stddev = 0, worst = 0;
+};
+
+// Spread of the intervals between consecutive edges
+static Stats measure(const std::vector<double> &edges) {
+  Stats s;
+  std::vector<double> intervals;
+  for (size_t i = 1; i < edges.size(); i++)
+    intervals.push_back(edges[i] - edges[i - 1]);
+  for (double d : intervals)
+    s.mean += d;
+  s.mean /= intervals.size();
+  for (double d : intervals) {
+    s.stddev += (d - s.mean) * (d - s.mean);
+    s.worst = std::fmax(s.worst, std::fabs(d - s.mean));
+  }
+  s.stddev = std::sqrt(s.stddev / intervals.size());
+  return s;
+}
+
+int main(int argc, char **argv) {
+  double bpm = argc > 1 ? atof(argv[1]) : 120;
+  double loopPeriod = argc > 2 ? atof(argv[2]) : 1500;
+  double hostJitter = argc > 3 ? atof(argv[3]) : 500;
+
+  std::mt19937 gen(1);
+  std::uniform_real_distribution<double> jitter(0, hostJitter);
+  std::uniform_real_distribution<double> loopJitter(0.5, 1.5);
+
+  // When each tick becomes readable on the device
+  double tickPeriod = 60e6 / (bpm * 24);
+  std::vector<double> arrivals;
+  for (int i = 0; i < TICKS; i++) {
+    double sent = 100000 + i * tickPeriod + jitter(gen);
+    arrivals.push_back(std::ceil(sent / USB_FRAME_US) * USB_FRAME_US);
+  }
+
+  Midi::TempoFollower follower;
+  std::vector<double> direct, followed, scheduled;
+  size_t next = 0;
+  unsigned count = 0;
+  for (double now = 0; next < arrivals.size() || follower.pendingEdges; now += loopPeriod * loopJitter(gen)) {
+    // One loop(): read whatever arrived, then emit due edges
+    for (; next < arrivals.size() && arrivals[next] <= now; next++) {
+      follower.tick((uint32_t) now);
+      if (count++ % MIDI_TICKS_PER_PHASE == 0)
+        direct.push_back(now);
+    }
+    uint32_t edgeTime;
+    while (follower.poll((uint32_t) now, edgeTime)) {
+      followed.push_back(now);
+      scheduled.push_back(edgeTime);
+    }
+  }
+
+  // Skip the first beat while the follower locks on
+  direct.erase(direct.begin(), direct.begin() + 8);
+  followed.erase(followed.begin(), followed.begin() + 8);
+  scheduled.erase(scheduled.begin(), scheduled.begin() + 8);
+
+  // Edges still go out on loop() passes, so loop time bounds all three
+  Stats a = measure(direct), b = measure(followed), c = measure(scheduled);
+  printf("%.1f BPM, loop ~%.0f us, host jitter %.0f us, phase %.0f us\n", bpm, loopPeriod, hostJitter, tickPeriod * 3);
+  printf("every third tick: stddev %6.0f us, worst %6.0f us\n", a.stddev, a.worst);
+  printf("tempo follower:   stddev %6.0f us, worst %6.0f us\n", b.stddev, b.worst);
+  printf("  as scheduled:   stddev %6.0f us, worst %6.0f us\n", c.stddev, c.worst);
+  return 0;
+}